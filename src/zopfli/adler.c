@@ -0,0 +1,281 @@
+#include "adler.h"
+
+/*
+Vector Adler-32: NEON on ARM when the compiler targets it, SSSE3 or AVX2 on x86
+if the CPU has it, which is checked on the first call.
+*/
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define ADLER_NEON
+#include <arm_neon.h>
+#elif (defined(_MSC_VER) && _MSC_VER >= 1500 && \
+       (defined(_M_IX86) || defined(_M_X64))) || \
+      (defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)))
+#define ADLER_X86
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#if defined(__GNUC__) || _MSC_VER >= 1800
+#define ADLER_AVX2
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+/* Largest prime smaller than 65536. */
+#define ADLER_BASE 65521
+
+/*
+Largest amount of bytes that can be summed before s2 may overflow 32 bits, so
+before the sums must be taken modulo ADLER_BASE.
+*/
+#define ADLER_NMAX 5552
+
+/* Amount of bytes handled per step by the vector code. */
+#define ADLER_BLOCK 32
+
+#ifdef ADLER_X86
+/* Vector code to use: 0 for none, 1 for SSSE3, 2 for AVX2, -1 if unknown. */
+static int adler_simd = -1;
+
+static int DetectAdlerSIMD(void) {
+#if defined(_MSC_VER)
+  int info[4];
+  int maxleaf;
+  __cpuid(info, 0);
+  maxleaf = info[0];
+  __cpuid(info, 1);
+#ifdef ADLER_AVX2
+  /* AVX2 needs the OS to save the AVX registers (OSXSAVE, AVX and XCR0). */
+  if (maxleaf >= 7 && (info[2] & (1 << 27)) && (info[2] & (1 << 28)) &&
+      (_xgetbv(0) & 6) == 6) {
+    int info7[4];
+    __cpuidex(info7, 7, 0);
+    if (info7[1] & (1 << 5)) return 2;
+  }
+#endif
+  return (info[2] & (1 << 9)) ? 1 : 0;
+#else
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return 2;
+  return __builtin_cpu_supports("ssse3") ? 1 : 0;
+#endif
+}
+
+/*
+Adds blocks * ADLER_BLOCK bytes to the sums s1 and s2 of the checksum. Within a
+block, s2 gets the bytes multiplied by their distance to the block end, and
+the value of s1 before the block times the block size.
+*/
+#if defined(__GNUC__)
+__attribute__ ((target("ssse3")))
+#endif
+static void AdlerSSSE3(unsigned* s1, unsigned* s2,
+                       const unsigned char* data, size_t blocks) {
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                     24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,
+                                     8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  unsigned a = *s1, b = *s2;
+
+  while (blocks > 0) {
+    size_t n = ADLER_NMAX / ADLER_BLOCK;
+    __m128i v_ps, v_s1, v_s2;
+    if (n > blocks) n = blocks;
+    blocks -= n;
+
+    /* Sum of the values of s1 before each block. */
+    v_ps = _mm_cvtsi32_si128((int)(a * n));
+    v_s1 = zero;
+    v_s2 = _mm_cvtsi32_si128((int)b);
+    do {
+      __m128i bytes1 = _mm_loadu_si128((const __m128i*)data);
+      __m128i bytes2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2,
+          _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2,
+          _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      data += ADLER_BLOCK;
+    } while (--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    /* Add up the lanes. */
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    a = (a + (unsigned)_mm_cvtsi128_si32(v_s1)) % ADLER_BASE;
+    b = (unsigned)_mm_cvtsi128_si32(v_s2) % ADLER_BASE;
+  }
+  *s1 = a;
+  *s2 = b;
+}
+
+#ifdef ADLER_AVX2
+/* Like AdlerSSSE3, with a whole block per vector. */
+#if defined(__GNUC__)
+__attribute__ ((target("avx2")))
+#endif
+static void AdlerAVX2(unsigned* s1, unsigned* s2,
+                      const unsigned char* data, size_t blocks) {
+  const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                       24, 23, 22, 21, 20, 19, 18, 17,
+                                       16, 15, 14, 13, 12, 11, 10, 9,
+                                       8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  unsigned a = *s1, b = *s2;
+
+  while (blocks > 0) {
+    size_t n = ADLER_NMAX / ADLER_BLOCK;
+    __m256i v_ps, v_s1, v_s2;
+    __m128i h_s1, h_s2;
+    if (n > blocks) n = blocks;
+    blocks -= n;
+
+    v_ps = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, (int)(a * n));
+    v_s1 = zero;
+    v_s2 = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, (int)b);
+    do {
+      __m256i bytes = _mm256_loadu_si256((const __m256i*)data);
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      v_s2 = _mm256_add_epi32(v_s2,
+          _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+      data += ADLER_BLOCK;
+    } while (--n);
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+    /* Add up the lanes. */
+    h_s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1),
+                         _mm256_extracti128_si256(v_s1, 1));
+    h_s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2),
+                         _mm256_extracti128_si256(v_s2, 1));
+    h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+    h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    a = (a + (unsigned)_mm_cvtsi128_si32(h_s1)) % ADLER_BASE;
+    b = (unsigned)_mm_cvtsi128_si32(h_s2) % ADLER_BASE;
+  }
+  *s1 = a;
+  *s2 = b;
+}
+#endif
+#endif
+
+#ifdef ADLER_NEON
+/*
+Like AdlerSSSE3. The bytes are summed per column in 16-bit lanes, which are
+multiplied with their distance to the block end after the loop.
+*/
+static void AdlerNEON(unsigned* s1, unsigned* s2,
+                      const unsigned char* data, size_t blocks) {
+  static const unsigned short taps[32] = {
+    32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+    16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1
+  };
+  unsigned a = *s1, b = *s2;
+
+  while (blocks > 0) {
+    size_t n = ADLER_NMAX / ADLER_BLOCK;
+    uint32x4_t v_ps, v_s1, v_s2;
+    uint16x8_t col1, col2, col3, col4;
+    uint32x2_t sum1, sum2, sums;
+    if (n > blocks) n = blocks;
+    blocks -= n;
+
+    v_ps = vsetq_lane_u32((uint32_t)(a * n), vdupq_n_u32(0), 0);
+    v_s1 = vdupq_n_u32(0);
+    col1 = col2 = col3 = col4 = vdupq_n_u16(0);
+    do {
+      uint8x16_t bytes1 = vld1q_u8(data);
+      uint8x16_t bytes2 = vld1q_u8(data + 16);
+      v_ps = vaddq_u32(v_ps, v_s1);
+      v_s1 = vpadalq_u16(v_s1, vpadalq_u8(vpaddlq_u8(bytes1), bytes2));
+      col1 = vaddw_u8(col1, vget_low_u8(bytes1));
+      col2 = vaddw_u8(col2, vget_high_u8(bytes1));
+      col3 = vaddw_u8(col3, vget_low_u8(bytes2));
+      col4 = vaddw_u8(col4, vget_high_u8(bytes2));
+      data += ADLER_BLOCK;
+    } while (--n);
+
+    v_s2 = vshlq_n_u32(v_ps, 5);
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(col1), vld1_u16(taps + 0));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(col1), vld1_u16(taps + 4));
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(col2), vld1_u16(taps + 8));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(col2), vld1_u16(taps + 12));
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(col3), vld1_u16(taps + 16));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(col3), vld1_u16(taps + 20));
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(col4), vld1_u16(taps + 24));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(col4), vld1_u16(taps + 28));
+
+    /* Add up the lanes. */
+    sum1 = vpadd_u32(vget_low_u32(v_s1), vget_high_u32(v_s1));
+    sum2 = vpadd_u32(vget_low_u32(v_s2), vget_high_u32(v_s2));
+    sums = vpadd_u32(sum1, sum2);
+    a = (a + vget_lane_u32(sums, 0)) % ADLER_BASE;
+    b = (b + vget_lane_u32(sums, 1)) % ADLER_BASE;
+  }
+  *s1 = a;
+  *s2 = b;
+}
+#endif
+
+unsigned UpdateAdler32(unsigned adler, const unsigned char* data, size_t len) {
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  size_t blocks = len / ADLER_BLOCK;
+
+#ifdef ADLER_X86
+  if (adler_simd < 0) adler_simd = DetectAdlerSIMD();
+  if (adler_simd == 0) blocks = 0;
+#ifdef ADLER_AVX2
+  else if (adler_simd == 2) AdlerAVX2(&s1, &s2, data, blocks);
+#endif
+  else AdlerSSSE3(&s1, &s2, data, blocks);
+#elif defined(ADLER_NEON)
+  AdlerNEON(&s1, &s2, data, blocks);
+#else
+  blocks = 0;
+#endif
+  data += blocks * ADLER_BLOCK;
+  len -= blocks * ADLER_BLOCK;
+
+  while (len > 0) {
+    size_t amount = len > ADLER_NMAX ? ADLER_NMAX : len;
+    len -= amount;
+    while (amount > 0) {
+      s1 += (*data++);
+      s2 += s1;
+      amount--;
+    }
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+  }
+
+  return (s2 << 16) | s1;
+}
+
+unsigned CombineAdler32(unsigned adler1, unsigned adler2, size_t len2) {
+  unsigned rem = (unsigned)(len2 % ADLER_BASE);
+  unsigned s1 = adler1 & 0xffff;
+  unsigned s2 = (rem * s1) % ADLER_BASE;
+  /*
+  The bytes of the second piece come after s1 of the first piece instead of
+  after 1, which adds (s1 - 1) to s1, and rem times that to s2.
+  */
+  s1 += (adler2 & 0xffff) + ADLER_BASE - 1;
+  s2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) +
+      ADLER_BASE - rem;
+  if (s1 >= ADLER_BASE) s1 -= ADLER_BASE;
+  if (s1 >= ADLER_BASE) s1 -= ADLER_BASE;
+  if (s2 >= 2 * ADLER_BASE) s2 -= 2 * ADLER_BASE;
+  if (s2 >= ADLER_BASE) s2 -= ADLER_BASE;
+  return (s2 << 16) | s1;
+}
@@ -0,0 +1,27 @@
+#ifndef ZOPFLI_ADLER_H_
+#define ZOPFLI_ADLER_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Updates a running Adler-32 checksum with the bytes data[0..len-1] and returns
+the updated checksum. The checksum should be initialized to 1. Uses SSSE3 or
+AVX2 on x86 if the CPU supports it, and NEON on ARM if the compiler targets it.
+*/
+unsigned UpdateAdler32(unsigned adler, const unsigned char* data, size_t len);
+
+/*
+Returns the Adler-32 checksum of two pieces of data one after the other, given
+the checksum adler1 of the first piece, and the checksum adler2 and the length
+len2 of the second piece.
+*/
+unsigned CombineAdler32(unsigned adler1, unsigned adler2, size_t len2);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
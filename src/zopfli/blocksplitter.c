@@ -22,6 +22,7 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "deflate.h"
 #include "lz77.h"
@@ -93,20 +94,60 @@ static size_t FindMinimum(FindMinimumFun f, void* context,
   }
 }
 
+/*
+Amount of entries of the cache of block costs. The block splitter asks for the
+cost of the same symbol counts again, e.g. for both halves of a chosen split,
+of which the largest is usually the next block to try to split.
+*/
+#define COST_CACHE_SIZE 64
+
+/*
+A block cost with the symbol counts it was calculated from.
+*/
+typedef struct CostCacheEntry {
+  size_t fingerprint;  /* CountsFingerprint of the counts. */
+  size_t cost;  /* Cost in bits, 0 if the entry is not used yet. */
+  size_t ll_counts[288];
+  size_t d_counts[32];
+} CostCacheEntry;
+
+/*
+Returns a hash of the symbol counts, used to find them in the cost cache. Only
+equal counts are taken from the cache, this just rejects most others cheaply.
+*/
+static size_t CountsFingerprint(const size_t* ll_counts,
+                                const size_t* d_counts) {
+  size_t result = 0;
+  size_t i;
+  for (i = 0; i < 288; i++) result = result * 31 + ll_counts[i];
+  for (i = 0; i < 32; i++) result = result * 31 + d_counts[i];
+  return result ^ (result >> 15);
+}
+
 /*
 Returns estimated cost of a block in bits.  It includes the size to encode the
 tree and the size to encode all literal, length and distance symbols and their
-extra bits.
+extra bits. This only depends on the symbol counts of the block, so the cost is
+taken from the cache if the same counts were seen recently.
 
-litlens: lz77 lit/lengths
-dists: ll77 distances
-lstart: start of block
-lend: end of block (not inclusive)
+cache: array of COST_CACHE_SIZE entries
+ll_counts: lit/len symbol counts of the block, as given by ZopfliLZ77Counts
+d_counts: dist symbol counts of the block
 */
-static size_t EstimateCost(const unsigned short* litlens,
-                           const unsigned short* dists,
-                           size_t lstart, size_t lend) {
-  return ZopfliCalculateBlockSize(litlens, dists, lstart, lend, 2);
+static size_t EstimateCost(CostCacheEntry* cache,
+                           const size_t* ll_counts, const size_t* d_counts) {
+  size_t fingerprint = CountsFingerprint(ll_counts, d_counts);
+  CostCacheEntry* entry = &cache[fingerprint % COST_CACHE_SIZE];
+  if (entry->cost != 0 && entry->fingerprint == fingerprint &&
+      !memcmp(entry->ll_counts, ll_counts, sizeof(entry->ll_counts)) &&
+      !memcmp(entry->d_counts, d_counts, sizeof(entry->d_counts))) {
+    return entry->cost;
+  }
+  entry->fingerprint = fingerprint;
+  entry->cost = ZopfliCalculateDynamicBlockSize(ll_counts, d_counts);
+  memcpy(entry->ll_counts, ll_counts, sizeof(entry->ll_counts));
+  memcpy(entry->d_counts, d_counts, sizeof(entry->d_counts));
+  return entry->cost;
 }
 
 typedef struct SplitCostContext {
@@ -115,8 +156,38 @@ typedef struct SplitCostContext {
   size_t llsize;
   size_t start;
   size_t end;
+  CostCacheEntry* cache;
+
+  /*
+  The split position the counts below are for: the left counts are of the
+  section from start to pos, the right counts from pos to end. Moving pos only
+  updates the counts with the symbols in between.
+  */
+  size_t pos;
+  size_t ll_left[288];
+  size_t d_left[32];
+  size_t ll_right[288];
+  size_t d_right[32];
 } SplitCostContext;
 
+/*
+Sets up the context for the section from start to end, with the split position
+at start.
+*/
+static void InitSplitCostContext(const unsigned short* litlens,
+                                 const unsigned short* dists, size_t llsize,
+                                 size_t start, size_t end,
+                                 CostCacheEntry* cache, SplitCostContext* c) {
+  c->litlens = litlens;
+  c->dists = dists;
+  c->llsize = llsize;
+  c->start = start;
+  c->end = end;
+  c->cache = cache;
+  c->pos = start;
+  ZopfliLZ77Counts(litlens, dists, start, start, c->ll_left, c->d_left);
+  ZopfliLZ77Counts(litlens, dists, start, end, c->ll_right, c->d_right);
+}
 
 /*
 Gets the cost which is the sum of the cost of the left and the right section
@@ -125,8 +196,20 @@ type: FindMinimumFun
 */
 static size_t SplitCost(size_t i, void* context) {
   SplitCostContext* c = (SplitCostContext*)context;
-  return EstimateCost(c->litlens, c->dists, c->start, i) +
-      EstimateCost(c->litlens, c->dists, i, c->end);
+  if (i > c->pos) {
+    ZopfliLZ77UpdateCounts(c->litlens, c->dists, c->pos, i, 0,
+                           c->ll_left, c->d_left);
+    ZopfliLZ77UpdateCounts(c->litlens, c->dists, c->pos, i, 1,
+                           c->ll_right, c->d_right);
+  } else if (i < c->pos) {
+    ZopfliLZ77UpdateCounts(c->litlens, c->dists, i, c->pos, 1,
+                           c->ll_left, c->d_left);
+    ZopfliLZ77UpdateCounts(c->litlens, c->dists, i, c->pos, 0,
+                           c->ll_right, c->d_right);
+  }
+  c->pos = i;
+  return EstimateCost(c->cache, c->ll_left, c->d_left) +
+      EstimateCost(c->cache, c->ll_right, c->d_right);
 }
 
 #ifdef _MSC_VER
@@ -240,6 +323,7 @@ void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
   size_t numblocks = 1;
   unsigned char* done;
   size_t splitcost, origcost;
+  CostCacheEntry* cache;
 
   if (llsize < 10) return;  /* This code fails on tiny files. */
 
@@ -247,6 +331,10 @@ void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
   if (!done) exit(-1); /* Allocation failed. */
   for (i = 0; i < llsize; i++) done[i] = 0;
 
+  cache = (CostCacheEntry*)malloc(COST_CACHE_SIZE * sizeof(*cache));
+  if (!cache) exit(-1); /* Allocation failed. */
+  for (i = 0; i < COST_CACHE_SIZE; i++) cache[i].cost = 0;
+
   lstart = 0;
   lend = llsize;
   for (;;) {
@@ -256,20 +344,15 @@ void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
       break;
     }
 
-    c.litlens = litlens;
-    c.dists = dists;
-    c.llsize = llsize;
-    c.start = lstart;
-    c.end = lend;
     assert(lstart < lend);
+    InitSplitCostContext(litlens, dists, llsize, lstart, lend, cache, &c);
+    origcost = EstimateCost(cache, c.ll_right, c.d_right);
     llpos = FindMinimum(SplitCost, &c, lstart + 1, lend);
 
     assert(llpos > lstart);
     assert(llpos < lend);
 
-    splitcost = EstimateCost(litlens, dists, lstart, llpos) +
-        EstimateCost(litlens, dists, llpos, lend);
-    origcost = EstimateCost(litlens, dists, lstart, lend);
+    splitcost = SplitCost(llpos, &c);
 
     if (splitcost > origcost || llpos == lstart + 1 || llpos == lend) {
       done[lstart] = 1;
@@ -292,6 +375,7 @@ void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
     PrintBlockSplitPoints(litlens, dists, llsize, *splitpoints, *npoints);
   }
 
+  free(cache);
   free(done);
 }
 
@@ -314,10 +398,19 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   s.lmc = 0;
 #endif
+#ifdef ZOPFLI_COUNTERS
+  ZopfliInitCounters(&s.counters);
+#endif
 
   /* Unintuitively, Using a simple LZ77 method here instead of ZopfliLZ77Optimal
   results in better blocks. */
   ZopfliLZ77Greedy(&s, in, instart, inend, &store);
+#ifdef ZOPFLI_COUNTERS
+  if (options->verbose) {
+    fprintf(stderr, "block split ");
+    ZopfliPrintCounters(&s.counters, instart, inend);
+  }
+#endif
 
   ZopfliBlockSplitLZ77(options,
                        store.litlens, store.dists, store.size, maxblocks,
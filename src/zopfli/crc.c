@@ -1,35 +1,213 @@
 #include "crc.h"
 
-/* Table of CRCs of all 8-bit messages. */
-static unsigned long crc_table[256];
+/*
+Hardware CRC: the ARMv8 CRC32 instructions when the compiler targets them, or
+carry-less multiplication (PCLMULQDQ) on x86 if the CPU has it, which is
+checked at runtime in MakeCRCTable.
+*/
+#if defined(__ARM_FEATURE_CRC32)
+#define CRC_ARM
+#include <arm_acle.h>
+#include <string.h>
+#elif (defined(_MSC_VER) && _MSC_VER >= 1500 && \
+       (defined(_M_IX86) || defined(_M_X64))) || \
+      (defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)))
+#define CRC_PCLMUL
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+/* The CRC-32 polynomial, bit reflected. */
+#define CRC_POLY 0xedb88320L
+
+/*
+Tables of CRCs of all 8-bit messages, followed by 1 to 7 zero bytes for
+crc_table[1] to crc_table[7], to process 8 bytes at a time ("slicing-by-8").
+*/
+static unsigned crc_table[8][256];
+
+/* x^(2^n) modulo the polynomial, for CombineCRC. */
+static unsigned long x2n_table[32];
+
+#ifdef CRC_PCLMUL
+/* Flag: whether the CPU supports PCLMULQDQ, set by MakeCRCTable. */
+static int crc_pclmul = 0;
+
+static int HasPclmul(void) {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  /* PCLMULQDQ and SSE2. */
+  return (info[2] & (1 << 1)) && (info[3] & (1 << 26));
+#else
+  unsigned a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d)) return 0;
+  return (c & (1 << 1)) && (d & (1 << 26));
+#endif
+}
+#endif
+
+#if !defined(__GNUC__) && !defined(INIT_CRC_TABLE_MANUALLY)
+/* Flag: To create CRC table on startup */
+static int crc_table_computed = 0;
+#endif
+
+/*
+Returns a * b modulo the polynomial, with the bits reflected like the CRC.
+*/
+static unsigned long MultModP(unsigned long a, unsigned long b) {
+  unsigned long m = 1UL << 31;
+  unsigned long p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ CRC_POLY : b >> 1;
+  }
+  return p;
+}
+
+#if !defined(INIT_CRC_TABLE_MANUALLY) && defined(__GNUC__)
+static void MakeCRCTable(void) __attribute__ ((constructor));
+#endif
 
-/* Makes the table for a fast CRC. */
+/* Makes the tables for a fast CRC. */
 #if !defined(INIT_CRC_TABLE_MANUALLY)
 static
 #endif
-void MakeCRCTable()
-#if defined(__GNUC__)
-__attribute__ ((constructor))
-#endif
-{
+void MakeCRCTable(void) {
   unsigned long c;
   int n, k;
   for (n = 0; n < 256; n++) {
     c = (unsigned long) n;
     for (k = 0; k < 8; k++) {
       if (c & 1) {
-        c = 0xedb88320L ^ (c >> 1);
+        c = CRC_POLY ^ (c >> 1);
       } else {
         c = c >> 1;
       }
     }
-    crc_table[n] = c;
+    crc_table[0][n] = c;
+  }
+  for (n = 0; n < 256; n++) {
+    c = crc_table[0][n];
+    for (k = 1; k < 8; k++) {
+      c = crc_table[0][c & 0xff] ^ (c >> 8);
+      crc_table[k][n] = c;
+    }
+  }
+
+  c = 1UL << 30;  /* x^1 */
+  x2n_table[0] = c;
+  for (n = 1; n < 32; n++) {
+    x2n_table[n] = c = MultModP(c, c);
   }
-}
 
+#ifdef CRC_PCLMUL
+  crc_pclmul = HasPclmul();
+#endif
 #if !defined(__GNUC__) && !defined(INIT_CRC_TABLE_MANUALLY)
-/* Flag: To create CRC table on startup */
-static int crc_table_computed = 0;
+  crc_table_computed = 1;
+#endif
+}
+
+#ifdef CRC_PCLMUL
+/*
+Updates the running (pre-inverted) crc c with len bytes, folding 64 and then 16
+bytes at a time with carry-less multiplications, followed by a Barrett
+reduction. len must be a multiple of 16 and at least 64. The constants are
+from the paper "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+Instruction" by Vinodh Gopal et al., for the bit reflected gzip polynomial.
+*/
+#if defined(__GNUC__)
+__attribute__ ((target("sse2,pclmul")))
+#endif
+static unsigned long CRCPclmul(unsigned long c, const unsigned char* buf,
+                               size_t len) {
+  __m128i k1k2 = _mm_set_epi32(0x00000001, (int)0xc6e41596,
+                               0x00000001, 0x54442bd4);
+  __m128i k3k4 = _mm_set_epi32(0x00000000, (int)0xccaa009e,
+                               0x00000001, 0x751997d0);
+  __m128i k5k0 = _mm_set_epi32(0, 0, 0x00000001, 0x63cd6124);
+  __m128i poly = _mm_set_epi32(0x00000001, (int)0xf7011641,
+                               0x00000001, (int)0xdb710641);
+  __m128i mask32 = _mm_set_epi32(0, ~0, 0, ~0);
+  __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+  x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+  x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+  x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+  buf += 64;
+  len -= 64;
+
+  /* Fold 4 blocks of 16 bytes in parallel. */
+  while (len >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i*)(buf + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                       _mm_loadu_si128((const __m128i*)(buf + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                       _mm_loadu_si128((const __m128i*)(buf + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                       _mm_loadu_si128((const __m128i*)(buf + 0x30)));
+    buf += 64;
+    len -= 64;
+  }
+
+  /* Fold the 4 blocks into one. */
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  /* Fold the remaining blocks of 16 bytes. */
+  while (len >= 16) {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i*)buf));
+    buf += 16;
+    len -= 16;
+  }
+
+  /* Fold 128 bits to 64 bits. */
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /* Barrett reduction to 32 bits. */
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
 #endif
 
 /*
@@ -44,19 +222,54 @@ __inline
 unsigned long UpdateCRC(unsigned long crc,
                                const unsigned char *buf, size_t len) {
   unsigned long c = crc ^ 0xffffffffL;
-  unsigned n;
 
 #if !defined(__GNUC__) && !defined(INIT_CRC_TABLE_MANUALLY)
   if (!crc_table_computed)
     MakeCRCTable();
 #endif
-  for (n = 0; n < len; n++) {
-    c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+#ifdef CRC_PCLMUL
+  if (crc_pclmul && len >= 64) {
+    size_t chunk = len & ~(size_t)15;
+    c = CRCPclmul(c, buf, chunk);
+    buf += chunk;
+    len -= chunk;
+  }
+#endif
+#ifdef CRC_ARM
+  for (; len >= 8; len -= 8, buf += 8) {
+    uint64_t v;
+    memcpy(&v, buf, 8);
+    c = __crc32d((uint32_t)c, v);
+  }
+#endif
+  for (; len >= 8; len -= 8, buf += 8) {
+    c ^= buf[0] | (buf[1] << 8) | ((unsigned long)buf[2] << 16) |
+        ((unsigned long)buf[3] << 24);
+    c = crc_table[7][c & 0xff] ^ crc_table[6][(c >> 8) & 0xff] ^
+        crc_table[5][(c >> 16) & 0xff] ^ crc_table[4][(c >> 24) & 0xff] ^
+        crc_table[3][buf[4]] ^ crc_table[2][buf[5]] ^
+        crc_table[1][buf[6]] ^ crc_table[0][buf[7]];
+  }
+  for (; len > 0; len--) {
+    c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
   }
   return c ^ 0xffffffffL;
 }
 
+unsigned long CombineCRC(unsigned long crc1, unsigned long crc2, size_t len2) {
+  /* Multiply crc1 by x^(8 * len2), i.e. append len2 zero bytes to it. */
+  unsigned long p = 1UL << 31;  /* x^0 */
+  size_t n = len2;
+  int k = 3;
+  while (n) {
+    if (n & 1) p = MultModP(x2n_table[k & 31], p);
+    n >>= 1;
+    k++;
+  }
+  return MultModP(p, crc1) ^ crc2;
+}
+
 /* Returns the CRC of the bytes buf[0..len-1]. */
-unsigned lodepng_crc32(const unsigned char* buf, size_t len) {
+unsigned long lodepng_crc32(const unsigned char* buf, size_t len) {
   return UpdateCRC(0L, buf, len);
-}
\ No newline at end of file
+}
@@ -1,6 +1,8 @@
 #ifndef ZOPFLI_CRC_H_
 #define ZOPFLI_CRC_H_
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -9,6 +11,14 @@ extern "C" {
 
 unsigned long UpdateCRC(unsigned long crc, const unsigned char *buf, size_t len);
 unsigned long lodepng_crc32(const unsigned char* buf, size_t len);
+
+/*
+Returns the CRC of two pieces of data one after the other, given the CRC crc1
+of the first piece, and the CRC crc2 and the length len2 of the second piece.
+This allows to compute the CRC of pieces independently, and combine them in
+order without going over the data again.
+*/
+unsigned long CombineCRC(unsigned long crc1, unsigned long crc2, size_t len2);
 #ifdef INIT_CRC_TABLE_MANUALLY
 void MakeCRCTable(void);
 #endif
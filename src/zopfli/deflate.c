@@ -22,45 +22,116 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "blocksplitter.h"
 #include "lz77.h"
 #include "squeeze.h"
 #include "tree.h"
+#include "util.h"
 
-static void AddBit(int bit,
-                   unsigned char* bp, unsigned char** out, size_t* outsize) {
-  if (((*bp) & 7) == 0) ZOPFLI_APPEND_DATA(0, out, outsize);
-  (*out)[*outsize - 1] |= bit << ((*bp) & 7);
-  (*bp)++;
+/*
+The bit accumulator of the BitWriter. Bits are flushed to the output
+BITWRITER_FLUSH_BITS at a time, so a wide accumulator writes whole words.
+*/
+#if defined(_MSC_VER)
+typedef unsigned __int64 BitBuffer;
+#define BITWRITER_FLUSH_BITS 32
+#elif defined(__GNUC__)
+__extension__ typedef unsigned long long BitBuffer;
+#define BITWRITER_FLUSH_BITS 32
+#else
+typedef unsigned long BitBuffer;
+#define BITWRITER_FLUSH_BITS 8
+#endif
+
+/*
+Writes bits to an output. Bits are collected in an accumulator and stored whole
+bytes at a time.
+*/
+typedef struct BitWriter {
+  BitBuffer bits;  /* Pending bits, the first one in the lowest bit. */
+  unsigned count;  /* Amount of pending bits. */
+  ZopfliOutput* out;  /* The output, its size is the amount of complete bytes. */
+} BitWriter;
+
+/* Starts writing at the bit pointer bp of the output. */
+static void InitBitWriter(unsigned char bp, ZopfliOutput* out, BitWriter* w) {
+  w->out = out;
+  w->bits = 0;
+  w->count = bp & 7;
+  if (w->count) {
+    /* Continue in the partial last byte, unless it was dropped. */
+    out->size--;
+    if (out->size < out->capacity) {
+      w->bits = out->data[out->size] & ((1u << w->count) - 1);
+    }
+  }
 }
 
-static void AddBits(unsigned symbol, unsigned length,
-                    unsigned char* bp, unsigned char** out, size_t* outsize) {
-  /* TODO(lode): make more efficient (add more bits at once). */
-  unsigned i;
-  for (i = 0; i < length; i++) {
-    unsigned bit = (symbol >> i) & 1;
-    if (((*bp) & 7) == 0) ZOPFLI_APPEND_DATA(0, out, outsize);
-    (*out)[*outsize - 1] |= bit << ((*bp) & 7);
-    (*bp)++;
+static void FlushBits(BitWriter* w) {
+  ZopfliOutput* out = w->out;
+  while (w->count >= BITWRITER_FLUSH_BITS) {
+    if (out->size + BITWRITER_FLUSH_BITS / 8 <= out->capacity ||
+        ZopfliReserveOutput(out, BITWRITER_FLUSH_BITS / 8)) {
+      unsigned i;
+      for (i = 0; i < BITWRITER_FLUSH_BITS / 8; i++) {
+        out->data[out->size + i] = (unsigned char)(w->bits >> (i * 8));
+      }
+    }
+    out->size += BITWRITER_FLUSH_BITS / 8;
+    w->bits >>= BITWRITER_FLUSH_BITS;
+    w->count -= BITWRITER_FLUSH_BITS;
   }
 }
 
 /*
-Adds bits, like AddBits, but the order is inverted. The deflate specification
-uses both orders in one standard.
+Writes the pending bits, the last byte partially if needed, and gives the bit
+pointer in that byte.
 */
-static void AddHuffmanBits(unsigned symbol, unsigned length,
-                           unsigned char* bp, unsigned char** out,
-                           size_t* outsize) {
-  /* TODO(lode): make more efficient (add more bits at once). */
-  unsigned i;
-  for (i = 0; i < length; i++) {
-    unsigned bit = (symbol >> (length - i - 1)) & 1;
-    if (((*bp) & 7) == 0) ZOPFLI_APPEND_DATA(0, out, outsize);
-    (*out)[*outsize - 1] |= bit << ((*bp) & 7);
-    (*bp)++;
+static void FinishBitWriter(BitWriter* w, unsigned char* bp) {
+  *bp = w->count & 7;
+  while (w->count > 0) {
+    ZopfliAppendOutput((unsigned char)w->bits, w->out);
+    w->bits >>= 8;
+    w->count = w->count > 8 ? w->count - 8 : 0;
+  }
+}
+
+/* Returns the amount of bits written to the output in total. */
+static size_t BitWriterPosition(const BitWriter* w) {
+  return w->out->size * 8 + w->count;
+}
+
+/*
+Adds length bits of symbol, the lowest first. At most 16 bits can be added at
+once.
+*/
+static void AddBits(unsigned symbol, unsigned length, BitWriter* w) {
+  assert(length <= 16);
+  assert(symbol >> length == 0);
+  w->bits |= (BitBuffer)symbol << w->count;
+  w->count += length;
+  if (w->count >= BITWRITER_FLUSH_BITS) FlushBits(w);
+}
+
+static void AddBit(int bit, BitWriter* w) {
+  AddBits(bit, 1, w);
+}
+
+/*
+Reverses the bits of the Huffman symbols, the deflate specification stores
+them highest bit first, so that AddBits can add them.
+*/
+static void ReverseSymbols(const unsigned* lengths, size_t n,
+                           unsigned* symbols) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    unsigned symbol = symbols[i], reversed = 0, j;
+    for (j = 0; j < lengths[i]; j++) {
+      reversed = (reversed << 1) | ((symbol >> j) & 1);
+    }
+    symbols[i] = reversed;
   }
 }
 
@@ -91,127 +162,171 @@ static void PatchDistanceCodesForBuggyDecoders(unsigned* d_lengths) {
   }
 }
 
-static void AddDynamicTree(const unsigned* ll_lengths,
-                           const unsigned* d_lengths,
-                           unsigned char* bp,
-                           unsigned char** out, size_t* outsize) {
-  unsigned* lld_lengths = 0;  /* All litlen and dist lengthts with ending zeros
-      trimmed together in one array. */
-  unsigned lld_total;  /* Size of lld_lengths. */
-  unsigned* rle = 0;  /* Runlength encoded version of lengths of litlen and dist
-      trees. */
-  unsigned* rle_bits = 0;  /* Extra bits for rle values 16, 17 and 18. */
-  size_t rle_size = 0;  /* Size of rle array. */
-  size_t rle_bits_size = 0;  /* Should have same value as rle_size. */
+/*
+Run length encodes the code lengths of a dynamic tree header, and writes the
+header if w is not NULL. use_16, use_17 and use_18 choose which of the repeat
+codes are used, since avoiding one can make the code length code cheaper.
+Returns the size of the header in bits.
+*/
+static size_t EncodeTree(const unsigned* ll_lengths,
+                         const unsigned* d_lengths,
+                         int use_16, int use_17, int use_18,
+                         BitWriter* w) {
+  unsigned rle[286 + 30];  /* Runlength encoded version of lengths of litlen
+      and dist trees. */
+  unsigned rle_bits[286 + 30];  /* Extra bits for rle values 16, 17 and 18. */
+  size_t rle_size = 0;  /* Size of rle and rle_bits. */
   unsigned hlit = 29; /* 286 - 257 */
   unsigned hdist = 29;  /* 32 - 1, but gzip does not like hdist > 29.*/
   unsigned hclen;
-  size_t i, j, count;
+  unsigned hlit2;
+  size_t lld_total;  /* Amount of litlen and dist lengths, trimmed. */
+  size_t i, j;
   size_t clcounts[19];
   unsigned clcl[19];  /* Code length code lengths. */
   unsigned clsymbols[19];
   /* The order in which code length code lengths are encoded as per deflate. */
-  unsigned order[19] = {
+  static const unsigned order[19] = {
     16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
   };
+  size_t result;
 
   /* Trim zeros. */
   while (hlit > 0 && ll_lengths[257 + hlit - 1] == 0) hlit--;
   while (hdist > 0 && d_lengths[1 + hdist - 1] == 0) hdist--;
+  hlit2 = hlit + 257;
 
-  lld_total = hlit + 257 + hdist + 1;
-  lld_lengths = (unsigned*)malloc(sizeof(*lld_lengths) * lld_total);
-  if (!lld_lengths) exit(-1); /* Allocation failed. */
+  lld_total = hlit2 + hdist + 1;
 
-  for (i = 0; i < lld_total; i++) {
-    lld_lengths[i] = i < 257 + hlit
-        ? ll_lengths[i] : d_lengths[i - 257 - hlit];
-    assert(lld_lengths[i] < 16);
-  }
+  for (i = 0; i < 19; i++) clcounts[i] = 0;
 
-  for (i = 0; i < lld_total; i += count) {
-    unsigned int rle_data, rle_bits_data;
-    count = 0;
-    for (j = i; j < lld_total && lld_lengths[i] == lld_lengths[j]; j++) {
-      count++;
+  for (i = 0; i < lld_total; i++) {
+    /* This is an encoding of a huffman tree, so now the length is a symbol */
+    unsigned symbol = i < hlit2 ? ll_lengths[i] : d_lengths[i - hlit2];
+    unsigned count = 1;
+    assert(symbol < 16);
+    if (use_16 || (symbol == 0 && (use_17 || use_18))) {
+      for (j = i + 1; j < lld_total && symbol ==
+          (j < hlit2 ? ll_lengths[j] : d_lengths[j - hlit2]); j++) {
+        count++;
+      }
     }
-    if (count >= 4 || (count >= 3 && lld_lengths[i] == 0)) {
-      if (lld_lengths[i] == 0) {
-        if (count > 10) {
-          if (count > 138) count = 138;
-          rle_data = 18;
-          rle_bits_data = (unsigned)count - 11;
-          goto append_data_once;
-        } else {
-          rle_data = 17;
-          rle_bits_data = (unsigned)count - 3;
-          goto append_data_once;
-        }
-      } else {
-        unsigned repeat = (unsigned)count - 1;  /* Since the first one is hardcoded. */
-        ZOPFLI_APPEND_DATA_T(unsigned, lld_lengths[i], rle, rle_size);
-        ZOPFLI_APPEND_DATA_T(unsigned, 0, rle_bits, rle_bits_size);
-        while (repeat >= 6) {
-          ZOPFLI_APPEND_DATA_T(unsigned, 16, rle, rle_size);
-          ZOPFLI_APPEND_DATA_T(unsigned, 6 - 3, rle_bits, rle_bits_size);
-          repeat -= 6;
+    i += count - 1;
+
+    /* Repetitions of zeroes */
+    if (symbol == 0 && count >= 3) {
+      if (use_18) {
+        while (count >= 11) {
+          unsigned count2 = count > 138 ? 138 : count;
+          rle[rle_size] = 18;
+          rle_bits[rle_size++] = count2 - 11;
+          clcounts[18]++;
+          count -= count2;
         }
-        if (repeat >= 3) {
-          ZOPFLI_APPEND_DATA_T(unsigned, 16, rle, rle_size);
-          ZOPFLI_APPEND_DATA_T(unsigned, repeat - 3, rle_bits, rle_bits_size);
-          repeat = 0;
-        }
-        while (repeat != 0) {
-          ZOPFLI_APPEND_DATA_T(unsigned, lld_lengths[i], rle, rle_size);
-          ZOPFLI_APPEND_DATA_T(unsigned, 0, rle_bits, rle_bits_size);
-          repeat--;
+      }
+      if (use_17) {
+        while (count >= 3) {
+          unsigned count2 = count > 10 ? 10 : count;
+          rle[rle_size] = 17;
+          rle_bits[rle_size++] = count2 - 3;
+          clcounts[17]++;
+          count -= count2;
         }
       }
-    } else {
-      rle_data = lld_lengths[i];
-      rle_bits_data = 0;
-      count = 1;
-append_data_once:
-      ZOPFLI_APPEND_DATA_T(unsigned, rle_data, rle, rle_size);
-      ZOPFLI_APPEND_DATA_T(unsigned, rle_bits_data, rle_bits, rle_bits_size);
     }
-    assert(rle[rle_size - 1] <= 18);
-  }
 
-  for (i = 0; i < 19; i++) {
-    clcounts[i] = 0;
-  }
-  for (i = 0; i < rle_size; i++) {
-    clcounts[rle[i]]++;
+    /* Repetitions of any symbol */
+    if (use_16 && count >= 4) {
+      count--;  /* Since the first one is hardcoded. */
+      rle[rle_size] = symbol;
+      rle_bits[rle_size++] = 0;
+      clcounts[symbol]++;
+      while (count >= 3) {
+        unsigned count2 = count > 6 ? 6 : count;
+        rle[rle_size] = 16;
+        rle_bits[rle_size++] = count2 - 3;
+        clcounts[16]++;
+        count -= count2;
+      }
+    }
+
+    /* No or insufficient repetition */
+    clcounts[symbol] += count;
+    while (count > 0) {
+      rle[rle_size] = symbol;
+      rle_bits[rle_size++] = 0;
+      count--;
+    }
   }
+  assert(rle_size <= 286 + 30);
 
   ZopfliCalculateBitLengths(clcounts, 19, 7, clcl);
-  ZopfliLengthsToSymbols(clcl, 19, 7, clsymbols);
 
   hclen = 15;
   /* Trim zeros. */
   while (hclen > 0 && clcounts[order[hclen + 4 - 1]] == 0) hclen--;
 
-  AddBits(hlit, 5, bp, out, outsize);
-  AddBits(hdist, 5, bp, out, outsize);
-  AddBits(hclen, 4, bp, out, outsize);
+  if (w) {
+    ZopfliLengthsToSymbols(clcl, 19, 7, clsymbols);
+    ReverseSymbols(clcl, 19, clsymbols);
 
-  for (i = 0; i < hclen + 4; i++) {
-    AddBits(clcl[order[i]], 3, bp, out, outsize);
+    AddBits(hlit, 5, w);
+    AddBits(hdist, 5, w);
+    AddBits(hclen, 4, w);
+
+    for (i = 0; i < hclen + 4; i++) {
+      AddBits(clcl[order[i]], 3, w);
+    }
+
+    for (i = 0; i < rle_size; i++) {
+      unsigned symbol = clsymbols[rle[i]];
+      AddBits(symbol, clcl[rle[i]], w);
+      /* Extra bits. */
+      if (rle[i] == 16) AddBits(rle_bits[i], 2, w);
+      else if (rle[i] == 17) AddBits(rle_bits[i], 3, w);
+      else if (rle[i] == 18) AddBits(rle_bits[i], 7, w);
+    }
   }
 
-  for (i = 0; i < rle_size; i++) {
-    unsigned symbol = clsymbols[rle[i]];
-    AddHuffmanBits(symbol, clcl[rle[i]], bp, out, outsize);
-    /* Extra bits. */
-    if (rle[i] == 16) AddBits(rle_bits[i], 2, bp, out, outsize);
-    else if (rle[i] == 17) AddBits(rle_bits[i], 3, bp, out, outsize);
-    else if (rle[i] == 18) AddBits(rle_bits[i], 7, bp, out, outsize);
+  result = 14;  /* hlit, hdist, hclen bits */
+  result += (hclen + 4) * 3;  /* clcl bits */
+  for (i = 0; i < 19; i++) {
+    result += clcl[i] * clcounts[i];
+  }
+  /* Extra bits. */
+  result += clcounts[16] * 2;
+  result += clcounts[17] * 3;
+  result += clcounts[18] * 7;
+  return result;
+}
+
+/*
+Returns which combination of the use_16, use_17 and use_18 flags of EncodeTree,
+as bits 1, 2 and 4, gives the smallest tree header, and its size in bits.
+*/
+static int BestTreeEncoding(const unsigned* ll_lengths,
+                            const unsigned* d_lengths, size_t* size) {
+  int i;
+  int best = 7;
+  size_t bestsize = EncodeTree(ll_lengths, d_lengths, 1, 1, 1, 0);
+  for (i = 0; i < 7; i++) {
+    size_t cost = EncodeTree(ll_lengths, d_lengths, i & 1, i & 2, i & 4, 0);
+    if (cost < bestsize) {
+      bestsize = cost;
+      best = i;
+    }
   }
+  *size = bestsize;
+  return best;
+}
 
-  free(lld_lengths);
-  free(rle);
-  free(rle_bits);
+/* Adds the smallest encoding of the dynamic tree header to the output. */
+static void AddDynamicTree(const unsigned* ll_lengths,
+                           const unsigned* d_lengths,
+                           BitWriter* w) {
+  size_t size;
+  int best = BestTreeEncoding(ll_lengths, d_lengths, &size);
+  EncodeTree(ll_lengths, d_lengths, best & 1, best & 2, best & 4, w);
 }
 
 /*
@@ -219,24 +334,22 @@ Gives the exact size of the tree, in bits, as it will be encoded in DEFLATE.
 */
 static size_t CalculateTreeSize(const unsigned* ll_lengths,
                                 const unsigned* d_lengths,
-                                size_t* ll_counts, size_t* d_counts) {
-  unsigned char* dummy = 0;
-  size_t dummysize = 0;
-  unsigned char bp = 0;
+                                const size_t* ll_counts,
+                                const size_t* d_counts) {
+  size_t size;
 
   (void)ll_counts;
   (void)d_counts;
 
-  AddDynamicTree(ll_lengths, d_lengths, &bp, &dummy, &dummysize);
-  free(dummy);
-
-  return dummysize * 8 + (bp & 7);
+  BestTreeEncoding(ll_lengths, d_lengths, &size);
+  return size;
 }
 
 /*
 Adds all lit/len and dist codes from the lists as huffman symbols. Does not add
 end code 256. expected_data_size is the uncompressed block size, used for
-assert, but you can set it to 0 to not do the assertion.
+assert, but you can set it to 0 to not do the assertion. The symbols must have
+been reversed by ReverseSymbols.
 */
 static void AddLZ77Data(const unsigned short* litlens,
                         const unsigned short* dists,
@@ -244,8 +357,7 @@ static void AddLZ77Data(const unsigned short* litlens,
                         size_t expected_data_size,
                         const unsigned* ll_symbols, const unsigned* ll_lengths,
                         const unsigned* d_symbols, const unsigned* d_lengths,
-                        unsigned char* bp,
-                        unsigned char** out, size_t* outsize) {
+                        BitWriter* w) {
   size_t testlength = 0;
   size_t i;
 
@@ -255,7 +367,7 @@ static void AddLZ77Data(const unsigned short* litlens,
     if (dist == 0) {
       assert(litlen < 256);
       assert(ll_lengths[litlen] > 0);
-      AddHuffmanBits(ll_symbols[litlen], ll_lengths[litlen], bp, out, outsize);
+      AddBits(ll_symbols[litlen], ll_lengths[litlen], w);
       testlength++;
     } else {
       unsigned lls = ZopfliGetLengthSymbol(litlen);
@@ -263,14 +375,12 @@ static void AddLZ77Data(const unsigned short* litlens,
       assert(litlen >= 3 && litlen <= 288);
       assert(ll_lengths[lls] > 0);
       assert(d_lengths[ds] > 0);
-      AddHuffmanBits(ll_symbols[lls], ll_lengths[lls], bp, out, outsize);
+      AddBits(ll_symbols[lls], ll_lengths[lls], w);
       AddBits(ZopfliGetLengthExtraBitsValue(litlen),
-              ZopfliGetLengthExtraBits(litlen),
-              bp, out, outsize);
-      AddHuffmanBits(d_symbols[ds], d_lengths[ds], bp, out, outsize);
+              ZopfliGetLengthExtraBits(litlen), w);
+      AddBits(d_symbols[ds], d_lengths[ds], w);
       AddBits(ZopfliGetDistExtraBitsValue(dist),
-              ZopfliGetDistExtraBits(dist),
-              bp, out, outsize);
+              ZopfliGetDistExtraBits(dist), w);
       testlength += litlen;
     }
   }
@@ -327,10 +437,7 @@ size_t ZopfliCalculateBlockSize(const unsigned short* litlens,
     GetFixedTree(ll_lengths, d_lengths);
   } else {
     ZopfliLZ77Counts(litlens, dists, lstart, lend, ll_counts, d_counts);
-    ZopfliCalculateBitLengths(ll_counts, 288, 15, ll_lengths);
-    ZopfliCalculateBitLengths(d_counts, 32, 15, d_lengths);
-    PatchDistanceCodesForBuggyDecoders(d_lengths);
-    result += CalculateTreeSize(ll_lengths, d_lengths, ll_counts, d_counts);
+    return ZopfliCalculateDynamicBlockSize(ll_counts, d_counts);
   }
 
   result += CalculateBlockSymbolSize(
@@ -338,6 +445,40 @@ size_t ZopfliCalculateBlockSize(const unsigned short* litlens,
   return result;
 }
 
+size_t ZopfliCalculateDynamicBlockSize(const size_t* ll_counts,
+                                       const size_t* d_counts) {
+  /* Extra bits of the length symbols 257-285 and the distance symbols. */
+  static const unsigned char lengthextrabits[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+  };
+  static const unsigned char distextrabits[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+  };
+  unsigned ll_lengths[288];
+  unsigned d_lengths[32];
+  size_t result = 3; /*bfinal and btype bits*/
+  size_t i;
+
+  ZopfliCalculateBitLengths(ll_counts, 288, 15, ll_lengths);
+  ZopfliCalculateBitLengths(d_counts, 32, 15, d_lengths);
+  PatchDistanceCodesForBuggyDecoders(d_lengths);
+  result += CalculateTreeSize(ll_lengths, d_lengths, ll_counts, d_counts);
+
+  /* The symbols, including the end symbol, and their extra bits. */
+  for (i = 0; i < 288; i++) {
+    result += ll_counts[i] * ll_lengths[i];
+  }
+  for (i = 0; i < 29; i++) {
+    result += ll_counts[257 + i] * lengthextrabits[i];
+  }
+  for (i = 0; i < 30; i++) {
+    result += d_counts[i] * (d_lengths[i] + distextrabits[i]);
+  }
+  return result;
+}
+
 /*
 Adds a deflate block with the given LZ77 data to the output.
 options: global program options
@@ -352,8 +493,7 @@ lend: where to end in the LZ77 data (not inclusive)
 expected_data_size: the uncompressed block size, used for assert, but you can
   set it to 0 to not do the assertion.
 bp: output bit pointer
-out: dynamic output array to append to
-outsize: dynamic output array size
+out: the output to append to
 */
 static void AddLZ77Block(const ZopfliOptions* options, int btype, int final,
                          const unsigned short* litlens,
@@ -361,37 +501,43 @@ static void AddLZ77Block(const ZopfliOptions* options, int btype, int final,
                          size_t lstart, size_t lend,
                          size_t expected_data_size,
                          unsigned char* bp,
-                         unsigned char** out, size_t* outsize) {
+                         ZopfliOutput* out) {
   size_t ll_counts[288];
   size_t d_counts[32];
   unsigned ll_lengths[288];
   unsigned d_lengths[32];
   unsigned ll_symbols[288];
   unsigned d_symbols[32];
-  size_t detect_block_size = *outsize;
+  size_t detect_bits;
   size_t compressed_size;
   size_t uncompressed_size = 0;
   size_t i;
+  BitWriter w;
 
-  AddBit(final, bp, out, outsize);
-  AddBit(btype & 1, bp, out, outsize);
-  AddBit((btype & 2) >> 1, bp, out, outsize);
+  InitBitWriter(*bp, out, &w);
+  AddBit(final, &w);
+  AddBit(btype & 1, &w);
+  AddBit((btype & 2) >> 1, &w);
 
   if (btype == 1) {
     /* Fixed block. */
     GetFixedTree(ll_lengths, d_lengths);
   } else {
     /* Dynamic block. */
-    unsigned detect_tree_size;
     assert(btype == 2);
+    ZopfliReportPhase(options, ZOPFLI_PHASE_TREE, 0, lstart, lend, -1, 0);
     ZopfliLZ77Counts(litlens, dists, lstart, lend, ll_counts, d_counts);
     ZopfliCalculateBitLengths(ll_counts, 288, 15, ll_lengths);
     ZopfliCalculateBitLengths(d_counts, 32, 15, d_lengths);
     PatchDistanceCodesForBuggyDecoders(d_lengths);
-    detect_tree_size = *outsize;
-    AddDynamicTree(ll_lengths, d_lengths, bp, out, outsize);
+    detect_bits = BitWriterPosition(&w);
+    AddDynamicTree(ll_lengths, d_lengths, &w);
+    ZopfliReportPhase(options, ZOPFLI_PHASE_TREE, 1, lstart, lend, -1,
+                      BitWriterPosition(&w) - detect_bits);
     if (options->verbose) {
-      fprintf(stderr, "treesize: %d\n", (int)(*outsize - detect_tree_size));
+      fprintf(stderr, "treesize: %d\n",
+              (int)((BitWriterPosition(&w) + 7) / 8
+                    - (detect_bits + 7) / 8));
     }
 
     /* Assert that for every present symbol, the code length is non-zero. */
@@ -402,18 +548,23 @@ static void AddLZ77Block(const ZopfliOptions* options, int btype, int final,
 
   ZopfliLengthsToSymbols(ll_lengths, 288, 15, ll_symbols);
   ZopfliLengthsToSymbols(d_lengths, 32, 15, d_symbols);
+  ReverseSymbols(ll_lengths, 288, ll_symbols);
+  ReverseSymbols(d_lengths, 32, d_symbols);
 
-  detect_block_size = *outsize;
+  ZopfliReportPhase(options, ZOPFLI_PHASE_OUTPUT, 0, lstart, lend, -1, 0);
+  detect_bits = BitWriterPosition(&w);
   AddLZ77Data(litlens, dists, lstart, lend, expected_data_size,
-              ll_symbols, ll_lengths, d_symbols, d_lengths,
-              bp, out, outsize);
+              ll_symbols, ll_lengths, d_symbols, d_lengths, &w);
   /* End symbol. */
-  AddHuffmanBits(ll_symbols[256], ll_lengths[256], bp, out, outsize);
+  AddBits(ll_symbols[256], ll_lengths[256], &w);
+  ZopfliReportPhase(options, ZOPFLI_PHASE_OUTPUT, 1, lstart, lend, -1,
+                    BitWriterPosition(&w) - detect_bits);
+  compressed_size = (BitWriterPosition(&w) + 7) / 8 - (detect_bits + 7) / 8;
+  FinishBitWriter(&w, bp);
 
   for (i = lstart; i < lend; i++) {
     uncompressed_size += dists[i] == 0 ? 1 : litlens[i];
   }
-  compressed_size = *outsize - detect_block_size;
   if (options->verbose) {
     fprintf(stderr, "compressed block size: %d (%dk) (unc: %d)\n",
            (int)compressed_size, (int)(compressed_size / 1024),
@@ -425,7 +576,7 @@ static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
                                 const unsigned char* in,
                                 size_t instart, size_t inend,
                                 unsigned char* bp,
-                                unsigned char** out, size_t* outsize) {
+                                ZopfliOutput* out) {
   ZopfliBlockState s;
   size_t blocksize = inend - instart;
   ZopfliLZ77Store store;
@@ -440,6 +591,9 @@ static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
   s.lmc = (ZopfliLongestMatchCache*)malloc(sizeof(ZopfliLongestMatchCache));
   ZopfliInitCache(blocksize, s.lmc);
 #endif
+#ifdef ZOPFLI_COUNTERS
+  ZopfliInitCounters(&s.counters);
+#endif
 
   ZopfliLZ77Optimal(&s, in, instart, inend, &store);
 
@@ -465,8 +619,13 @@ static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
 
   AddLZ77Block(s.options, btype, final,
                store.litlens, store.dists, 0, store.size,
-               blocksize, bp, out, outsize);
+               blocksize, bp, out);
 
+#ifdef ZOPFLI_COUNTERS
+  if (options->verbose) {
+    ZopfliPrintCounters(&s.counters, instart, inend);
+  }
+#endif
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   ZopfliCleanCache(s.lmc);
   free(s.lmc);
@@ -478,7 +637,7 @@ static void DeflateFixedBlock(const ZopfliOptions* options, int final,
                               const unsigned char* in,
                               size_t instart, size_t inend,
                               unsigned char* bp,
-                              unsigned char** out, size_t* outsize) {
+                              ZopfliOutput* out) {
   ZopfliBlockState s;
   size_t blocksize = inend - instart;
   ZopfliLZ77Store store;
@@ -492,12 +651,20 @@ static void DeflateFixedBlock(const ZopfliOptions* options, int final,
   s.lmc = (ZopfliLongestMatchCache*)malloc(sizeof(ZopfliLongestMatchCache));
   ZopfliInitCache(blocksize, s.lmc);
 #endif
+#ifdef ZOPFLI_COUNTERS
+  ZopfliInitCounters(&s.counters);
+#endif
 
   ZopfliLZ77OptimalFixed(&s, in, instart, inend, &store);
 
   AddLZ77Block(s.options, 1, final, store.litlens, store.dists, 0, store.size,
-               blocksize, bp, out, outsize);
+               blocksize, bp, out);
 
+#ifdef ZOPFLI_COUNTERS
+  if (options->verbose) {
+    ZopfliPrintCounters(&s.counters, instart, inend);
+  }
+#endif
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   ZopfliCleanCache(s.lmc);
   free(s.lmc);
@@ -509,29 +676,54 @@ static void DeflateNonCompressedBlock(const ZopfliOptions* options, int final,
                                       const unsigned char* in, size_t instart,
                                       size_t inend,
                                       unsigned char* bp,
-                                      unsigned char** out, size_t* outsize) {
-  size_t i;
+                                      ZopfliOutput* out) {
   size_t blocksize = inend - instart;
   unsigned short nlen = ~blocksize;
+  BitWriter w;
 
   (void)options;
   assert(blocksize < 65536);  /* Non compressed blocks are max this size. */
 
-  AddBit(final, bp, out, outsize);
+  InitBitWriter(*bp, out, &w);
+  AddBit(final, &w);
   /* BTYPE 00 */
-  AddBit(0, bp, out, outsize);
-  AddBit(0, bp, out, outsize);
+  AddBit(0, &w);
+  AddBit(0, &w);
+  FinishBitWriter(&w, bp);
 
   /* Any bits of input up to the next byte boundary are ignored. */
   *bp = 0;
 
-  ZOPFLI_APPEND_DATA(blocksize % 256, out, outsize);
-  ZOPFLI_APPEND_DATA((blocksize / 256) % 256, out, outsize);
-  ZOPFLI_APPEND_DATA(nlen % 256, out, outsize);
-  ZOPFLI_APPEND_DATA((nlen / 256) % 256, out, outsize);
+  ZopfliAppendOutput(blocksize % 256, out);
+  ZopfliAppendOutput((blocksize / 256) % 256, out);
+  ZopfliAppendOutput(nlen % 256, out);
+  ZopfliAppendOutput((nlen / 256) % 256, out);
+
+  if (ZopfliReserveOutput(out, blocksize)) {
+    memcpy(out->data + out->size, in + instart, blocksize);
+  }
+  out->size += blocksize;
+}
+
+/*
+Smallest time limit given to a part of the input. It must stay positive since a
+time limit of 0 means no limit, and a part that gets this little time is
+considered out of time.
+*/
+#define MIN_TIME_SHARE 1e-6
 
-  for (i = instart; i < inend; i++) {
-    ZOPFLI_APPEND_DATA(in[i], out, outsize);
+/*
+Copies options to partoptions, giving it the share of the time left until
+deadline that belongs to size bytes out of the remaining bytes. Only the time
+limit differs between both, and only if options has a time limit.
+*/
+static void ShareTimeLimit(const ZopfliOptions* options, double deadline,
+                           size_t size, size_t remaining,
+                           ZopfliOptions* partoptions) {
+  *partoptions = *options;
+  if (options->timelimit > 0) {
+    double share = (deadline - ZopfliGetTime()) * size / remaining;
+    partoptions->timelimit = share > MIN_TIME_SHARE ? share : MIN_TIME_SHARE;
   }
 }
 
@@ -539,15 +731,15 @@ static void DeflateBlock(const ZopfliOptions* options,
                          int btype, int final,
                          const unsigned char* in, size_t instart, size_t inend,
                          unsigned char* bp,
-                         unsigned char** out, size_t* outsize) {
+                         ZopfliOutput* out) {
   if (btype == 0) {
     DeflateNonCompressedBlock(
-        options, final, in, instart, inend, bp, out, outsize);
+        options, final, in, instart, inend, bp, out);
   } else if (btype == 1) {
-     DeflateFixedBlock(options, final, in, instart, inend, bp, out, outsize);
+     DeflateFixedBlock(options, final, in, instart, inend, bp, out);
   } else {
     assert (btype == 2);
-    DeflateDynamicBlock(options, final, in, instart, inend, bp, out, outsize);
+    DeflateDynamicBlock(options, final, in, instart, inend, bp, out);
   }
 }
 
@@ -561,25 +753,35 @@ static void DeflateSplittingFirst(const ZopfliOptions* options,
                                   const unsigned char* in,
                                   size_t instart, size_t inend,
                                   unsigned char* bp,
-                                  unsigned char** out, size_t* outsize) {
+                                  ZopfliOutput* out) {
   size_t i;
   size_t* splitpoints = 0;
   size_t npoints = 0;
+  ZopfliOptions blockoptions;
+  double deadline = ZopfliGetTime() + options->timelimit;
   if (btype == 0) {
     ZopfliBlockSplitSimple(in, instart, inend, 65535, &splitpoints, &npoints);
   } else if (btype == 1) {
     /* If all blocks are fixed tree, splitting into separate blocks only
     increases the total size. Leave npoints at 0, this represents 1 block. */
+  } else if (options->timelimit > 0 && options->timelimit <= MIN_TIME_SHARE) {
+    /* Out of time, don't spend any on block splitting. */
   } else {
+    ZopfliReportPhase(options, ZOPFLI_PHASE_BLOCKSPLIT, 0,
+                      instart, inend, -1, 0);
     ZopfliBlockSplit(options, in, instart, inend,
                      options->blocksplittingmax, &splitpoints, &npoints);
+    ZopfliReportPhase(options, ZOPFLI_PHASE_BLOCKSPLIT, 1,
+                      instart, inend, -1, 0);
   }
 
   for (i = 0; i <= npoints; i++) {
     size_t start = i == 0 ? instart : splitpoints[i - 1];
     size_t end = i == npoints ? inend : splitpoints[i];
-    DeflateBlock(options, btype, i == npoints && final, in, start, end,
-                 bp, out, outsize);
+    ShareTimeLimit(options, deadline, end - start, inend - start,
+                   &blockoptions);
+    DeflateBlock(&blockoptions, btype, i == npoints && final, in, start, end,
+                 bp, out);
   }
 
   free(splitpoints);
@@ -595,7 +797,7 @@ static void DeflateSplittingLast(const ZopfliOptions* options,
                                  const unsigned char* in,
                                  size_t instart, size_t inend,
                                  unsigned char* bp,
-                                 unsigned char** out, size_t* outsize) {
+                                 ZopfliOutput* out) {
   size_t i;
   ZopfliBlockState s;
   ZopfliLZ77Store store;
@@ -607,7 +809,7 @@ static void DeflateSplittingLast(const ZopfliOptions* options,
        supports the special case of noncompressed data. Punt it to that one. */
     DeflateSplittingFirst(options, btype, final,
                           in, instart, inend,
-                          bp, out, outsize);
+                          bp, out);
   }
   assert(btype == 1 || btype == 2);
 
@@ -620,6 +822,9 @@ static void DeflateSplittingLast(const ZopfliOptions* options,
   s.lmc = (ZopfliLongestMatchCache*)malloc(sizeof(ZopfliLongestMatchCache));
   ZopfliInitCache(inend - instart, s.lmc);
 #endif
+#ifdef ZOPFLI_COUNTERS
+  ZopfliInitCounters(&s.counters);
+#endif
 
   if (btype == 2) {
     ZopfliLZ77Optimal(&s, in, instart, inend, &store);
@@ -632,8 +837,12 @@ static void DeflateSplittingLast(const ZopfliOptions* options,
     /* If all blocks are fixed tree, splitting into separate blocks only
     increases the total size. Leave npoints at 0, this represents 1 block. */
   } else {
+    ZopfliReportPhase(options, ZOPFLI_PHASE_BLOCKSPLIT, 0,
+                      0, store.size, -1, 0);
     ZopfliBlockSplitLZ77(options, store.litlens, store.dists, store.size,
                          options->blocksplittingmax, &splitpoints, &npoints);
+    ZopfliReportPhase(options, ZOPFLI_PHASE_BLOCKSPLIT, 1,
+                      0, store.size, -1, 0);
   }
 
   for (i = 0; i <= npoints; i++) {
@@ -641,9 +850,14 @@ static void DeflateSplittingLast(const ZopfliOptions* options,
     size_t end = i == npoints ? store.size : splitpoints[i];
     AddLZ77Block(options, btype, i == npoints && final,
                  store.litlens, store.dists, start, end, 0,
-                 bp, out, outsize);
+                 bp, out);
   }
 
+#ifdef ZOPFLI_COUNTERS
+  if (options->verbose) {
+    ZopfliPrintCounters(&s.counters, instart, inend);
+  }
+#endif
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   ZopfliCleanCache(s.lmc);
   free(s.lmc);
@@ -661,52 +875,110 @@ previous bytes are used as the initial dictionary for LZ77.
 This function will usually output multiple deflate blocks. If final is 1, then
 the final bit will be set on the last block.
 */
-void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
-                       const unsigned char* in, size_t instart, size_t inend,
-                       unsigned char* bp, unsigned char** out,
-                       size_t* outsize) {
+static void DeflatePart(const ZopfliOptions* options, int btype, int final,
+                        const unsigned char* in, size_t instart, size_t inend,
+                        unsigned char* bp, ZopfliOutput* out) {
   if (options->blocksplitting) {
     if (options->blocksplittinglast) {
       DeflateSplittingLast(options, btype, final, in, instart, inend,
-                           bp, out, outsize);
+                           bp, out);
     } else {
       DeflateSplittingFirst(options, btype, final, in, instart, inend,
-                            bp, out, outsize);
+                            bp, out);
     }
   } else {
-    DeflateBlock(options, btype, final, in, instart, inend, bp, out, outsize);
+    DeflateBlock(options, btype, final, in, instart, inend, bp, out);
   }
 }
 
+void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
+                       const unsigned char* in, size_t instart, size_t inend,
+                       unsigned char* bp, unsigned char** out,
+                       size_t* outsize) {
+  ZopfliOutput output;
+  ZopfliInitAppendOutput(*out, *outsize, &output);
+  DeflatePart(options, btype, final, in, instart, inend, bp, &output);
+  ZopfliFinishAppendOutput(&output, out, outsize);
+}
+
 void ZopfliDeflate(const ZopfliOptions* options, int btype, int final,
                    const unsigned char* in, size_t insize,
                    unsigned char* bp, unsigned char** out, size_t* outsize) {
-#if ZOPFLI_MASTER_BLOCK_SIZE == 0
-  ZopfliDeflatePart(options, btype, final, in, 0, insize, bp, out, outsize);
-#else
+  ZopfliOutput output;
+  ZopfliInitAppendOutput(*out, *outsize, &output);
+  ZopfliDeflateChecksum(options, btype, final, in, insize, 0, 0,
+                        bp, &output);
+  ZopfliFinishAppendOutput(&output, out, outsize);
+}
+
+/*
+Compresses the insize bytes of input one master block at a time, sharing the
+time limit between the blocks. With in, the blocks are compressed in place and
+each is passed to checksum first, if given. Without in, each block is read with
+read into a buffer that also keeps the window before it.
+*/
+static void DeflateMasterBlocks(const ZopfliOptions* options, int btype,
+                                int final, const unsigned char* in,
+                                size_t insize, ZopfliChecksumFun* checksum,
+                                ZopfliReadFun* read, void* context,
+                                unsigned char* bp, ZopfliOutput* out) {
   size_t i = 0;
-  void (*fZopfliDeflatePart)(const ZopfliOptions*, int, int,
-                       const unsigned char*, size_t, size_t,
-                       unsigned char*, unsigned char**, size_t*);
-  if (options->blocksplitting) {
-    if (options->blocksplittinglast) {
-      fZopfliDeflatePart = DeflateSplittingLast;
-    } else {
-      fZopfliDeflatePart = DeflateSplittingFirst;
-    }
-  } else {
-    fZopfliDeflatePart = DeflateBlock;
+  size_t windowsize = 0;  /* Bytes before the master block in buffer. */
+  size_t masterblocksize = insize;
+  unsigned char* buffer = 0;
+  ZopfliOptions partoptions;
+  double deadline = ZopfliGetTime() + options->timelimit;
+#if ZOPFLI_MASTER_BLOCK_SIZE != 0
+  masterblocksize = options->masterblocksize
+      ? options->masterblocksize : ZOPFLI_MASTER_BLOCK_SIZE;
+  if (masterblocksize > insize) masterblocksize = insize;
+#endif
+
+  if (!in) {
+    buffer = (unsigned char*)malloc(ZOPFLI_WINDOW_SIZE + masterblocksize);
+    if (!buffer) exit(-1); /* Allocation failed. */
   }
+
   while (i < insize) {
-    int masterfinal = (i + ZOPFLI_MASTER_BLOCK_SIZE >= insize);
+    int masterfinal = (insize - i <= masterblocksize);
     int final2 = final && masterfinal;
-    size_t size = masterfinal ? insize - i : ZOPFLI_MASTER_BLOCK_SIZE;
-    fZopfliDeflatePart(options, btype, final2,
-                       in, i, i + size, bp, out, outsize);
+    size_t size = masterfinal ? insize - i : masterblocksize;
+    ShareTimeLimit(options, deadline, size, insize - i, &partoptions);
+    if (in) {
+      if (checksum) checksum(in + i, size, context);
+      DeflatePart(&partoptions, btype, final2, in, i, i + size, bp, out);
+    } else {
+      size_t keep;
+      read(buffer + windowsize, i, size, context);
+      DeflatePart(&partoptions, btype, final2,
+                  buffer, windowsize, windowsize + size, bp, out);
+
+      /* The end of this master block is the window of the next one. */
+      keep = windowsize + size;
+      if (keep > ZOPFLI_WINDOW_SIZE) keep = ZOPFLI_WINDOW_SIZE;
+      memmove(buffer, buffer + windowsize + size - keep, keep);
+      windowsize = keep;
+    }
     i += size;
   }
-#endif
+
+  free(buffer);
   if (options->verbose) {
-    ZopfliPrintSizeVerbose(insize, *outsize, "Deflate");
+    ZopfliPrintSizeVerbose(insize, out->size, "Deflate");
   }
 }
+
+void ZopfliDeflateChecksum(const ZopfliOptions* options, int btype, int final,
+                           const unsigned char* in, size_t insize,
+                           ZopfliChecksumFun* checksum, void* context,
+                           unsigned char* bp, ZopfliOutput* out) {
+  DeflateMasterBlocks(options, btype, final, in, insize, checksum, 0, context,
+                      bp, out);
+}
+
+void ZopfliDeflateStream(const ZopfliOptions* options, int btype, int final,
+                         size_t insize, ZopfliReadFun* read, void* context,
+                         unsigned char* bp, ZopfliOutput* out) {
+  DeflateMasterBlocks(options, btype, final, 0, insize, 0, read, context,
+                      bp, out);
+}
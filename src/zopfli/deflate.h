@@ -58,6 +58,47 @@ void ZopfliDeflate(const ZopfliOptions* options, int btype, int final,
                    const unsigned char* in, size_t insize,
                    unsigned char* bp, unsigned char** out, size_t* outsize);
 
+/*
+Called by ZopfliDeflateChecksum with consecutive pieces of the input, to
+compute a checksum of it.
+data: the next piece of the input
+size: size of the piece
+context: the context given to ZopfliDeflateChecksum
+*/
+typedef void ZopfliChecksumFun(const unsigned char* data, size_t size,
+                               void* context);
+
+/*
+Like ZopfliDeflate, but also passes the input to checksum, one master block at
+a time right before compressing it. This way the checksum of a container format
+does not need a separate pass over a possibly huge input, which then only has to
+be loaded from memory once per master block. checksum may be NULL.
+The result is appended to out, see ZopfliOutput in util.h.
+*/
+struct ZopfliOutput;
+void ZopfliDeflateChecksum(const ZopfliOptions* options, int btype, int final,
+                           const unsigned char* in, size_t insize,
+                           ZopfliChecksumFun* checksum, void* context,
+                           unsigned char* bp, struct ZopfliOutput* out);
+
+/*
+Called by ZopfliDeflateStream to get the input piece by piece.
+data: where to put the bytes pos to pos + size - 1 of the input
+pos: where the previous call ended, or 0 for the first call
+context: the context given to ZopfliDeflateStream
+*/
+typedef void ZopfliReadFun(unsigned char* data, size_t pos, size_t size,
+                           void* context);
+
+/*
+Like ZopfliDeflateChecksum, but reads the insize bytes of input with read, one
+master block at a time, so only that block and the window before it are in
+memory at once. The output is the same as with the whole input in memory.
+*/
+void ZopfliDeflateStream(const ZopfliOptions* options, int btype, int final,
+                         size_t insize, ZopfliReadFun* read, void* context,
+                         unsigned char* bp, struct ZopfliOutput* out);
+
 /*
 Like ZopfliDeflate, but allows to specify start and end byte with instart and
 inend. Only that part is compressed, but earlier bytes are still used for the
@@ -79,6 +120,47 @@ size_t ZopfliCalculateBlockSize(const unsigned short* litlens,
                                 const unsigned short* dists,
                                 size_t lstart, size_t lend, int btype);
 
+/*
+Calculates the size in bits of a dynamic block (btype 2) from its symbol counts
+alone, the same as ZopfliCalculateBlockSize gives for LZ77 data with these
+counts.
+ll_counts: count of each lit/len symbol, size 288, including the end symbol 256
+    once, as given by ZopfliLZ77Counts
+d_counts: count of each dist symbol, size 32
+*/
+size_t ZopfliCalculateDynamicBlockSize(const size_t* ll_counts,
+                                       const size_t* d_counts);
+
+/*
+Cost in bits of each lit/len and dist symbol, the entropy of the symbols of some
+LZ77 data, like the statistics the squeeze cost model uses.
+*/
+typedef struct ZopfliSymbolCosts {
+  double ll_symbols[288];
+  double d_symbols[32];
+} ZopfliSymbolCosts;
+
+/*
+Sets costs to the symbol statistics of a greedy LZ77 run on
+in[instart..inend-1], with the bytes before instart as starting dictionary.
+*/
+void ZopfliGetSymbolCosts(const ZopfliOptions* options,
+                          const unsigned char* in,
+                          size_t instart, size_t inend,
+                          ZopfliSymbolCosts* costs);
+
+/*
+Quickly estimates the size in bits that in[instart..inend-1] compresses to,
+with the bytes before instart as starting dictionary: the cost of a greedy LZ77
+run with the given symbol costs, or with the statistics of that run itself if
+costs is NULL. Tree and block headers are not counted. This is meant to compare
+alternatives for the same data, e.g. PNG filter types, not as an exact size.
+*/
+double ZopfliEstimateCost(const ZopfliOptions* options,
+                          const unsigned char* in,
+                          size_t instart, size_t inend,
+                          const ZopfliSymbolCosts* costs);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -21,48 +21,215 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "util.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "crc.h"
 #include "deflate.h"
 
+/*
+Updates the CRC of ZopfliGzipCompress with a piece of the input.
+type: ZopfliChecksumFun
+*/
+static void UpdateGzipCRC(const unsigned char* data, size_t size,
+                          void* context) {
+  unsigned long* crcvalue = (unsigned long*)context;
+  *crcvalue = UpdateCRC(*crcvalue, data, size);
+}
+
+/*
+A segment of the input for parallel compression, with its compressed data and
+its CRC.
+*/
+typedef struct GzipSegment {
+  size_t start;
+  size_t end;
+  unsigned char* data;  /* Dynamic array of ZOPFLI_APPEND_DATA. */
+  size_t size;
+  unsigned long crc;
+} GzipSegment;
+
+/*
+The work of one thread: the segments first, first + step, first + 2 * step...
+*/
+typedef struct GzipWorker {
+  const ZopfliOptions* options;
+  const unsigned char* in;
+  GzipSegment* segments;
+  size_t numsegments;
+  size_t first;
+  size_t step;
+  double deadline;
+} GzipWorker;
+
+/*
+Compresses the segments of a worker. Every segment but the last of the input
+ends with an empty non-final stored block, which pads it to a byte boundary so
+that the segments can simply be concatenated.
+type: ZopfliWorkerFun
+*/
+static void CompressSegments(void* context) {
+  GzipWorker* worker = (GzipWorker*)context;
+  const ZopfliOptions* options = worker->options;
+  ZopfliOptions partoptions = *options;
+  ZopfliOptions storedoptions = *options;
+  size_t remaining = 0;
+  size_t i;
+
+  /* A stored block of one size does not go through any block splitting. */
+  storedoptions.blocksplitting = 0;
+
+  for (i = worker->first; i < worker->numsegments; i += worker->step) {
+    remaining += worker->segments[i].end - worker->segments[i].start;
+  }
+  for (i = worker->first; i < worker->numsegments; i += worker->step) {
+    GzipSegment* segment = &worker->segments[i];
+    size_t size = segment->end - segment->start;
+    int final = i + 1 == worker->numsegments;
+    unsigned char bp = 0;
+    if (options->timelimit > 0) {
+      double share = (worker->deadline - ZopfliGetTime()) * size / remaining;
+      /* The same smallest share as deflate.c gives its parts. */
+      partoptions.timelimit = share > 1e-6 ? share : 1e-6;
+    }
+    segment->crc = UpdateCRC(0L, worker->in + segment->start, size);
+    ZopfliDeflatePart(&partoptions, 2 /* Dynamic block */, final, worker->in,
+                      segment->start, segment->end, &bp,
+                      &segment->data, &segment->size);
+    if (!final) {
+      ZopfliDeflatePart(&storedoptions, 0, 0, worker->in,
+                        segment->end, segment->end, &bp,
+                        &segment->data, &segment->size);
+    }
+    remaining -= size;
+  }
+}
+
+/*
+Compresses the input as deflate data in segments on options->numthreads
+threads, appends it to out and sets crcvalue to the CRC of the input. If a
+thread cannot be started, its segments are compressed on the calling thread.
+*/
+static void DeflateParallel(const ZopfliOptions* options,
+                            const unsigned char* in, size_t insize,
+                            size_t segmentsize, unsigned long* crcvalue,
+                            ZopfliOutput* out) {
+  size_t numsegments = (insize + segmentsize - 1) / segmentsize;
+  size_t numthreads = (size_t)options->numthreads < numsegments
+      ? (size_t)options->numthreads : numsegments;
+  GzipSegment* segments =
+      (GzipSegment*)malloc(numsegments * sizeof(*segments));
+  GzipWorker* workers = (GzipWorker*)malloc(numthreads * sizeof(*workers));
+  double deadline = ZopfliGetTime() + options->timelimit;
+  size_t i;
+
+  if (!segments || !workers) exit(-1);  /* Allocation failed. */
+
+  for (i = 0; i < numsegments; i++) {
+    segments[i].start = i * segmentsize;
+    segments[i].end = i + 1 == numsegments ? insize : (i + 1) * segmentsize;
+    segments[i].data = 0;
+    segments[i].size = 0;
+  }
+
+  for (i = 0; i < numthreads; i++) {
+    workers[i].options = options;
+    workers[i].in = in;
+    workers[i].segments = segments;
+    workers[i].numsegments = numsegments;
+    workers[i].first = i;
+    workers[i].step = numthreads;
+    workers[i].deadline = deadline;
+  }
+  ZopfliRunWorkers(CompressSegments, workers, sizeof(*workers), numthreads);
+
+  *crcvalue = 0;
+  for (i = 0; i < numsegments; i++) {
+    GzipSegment* segment = &segments[i];
+    *crcvalue = CombineCRC(*crcvalue, segment->crc,
+                           segment->end - segment->start);
+    if (ZopfliReserveOutput(out, segment->size)) {
+      memcpy(out->data + out->size, segment->data, segment->size);
+    }
+    out->size += segment->size;
+    free(segment->data);
+  }
+
+  free(segments);
+  free(workers);
+}
+
+/*
+Returns the size of the segments to compress the input in with numthreads, or
+0 to compress it on one thread.
+*/
+static size_t GzipSegmentSize(const ZopfliOptions* options, size_t insize) {
+  size_t size;
+  if (options->numthreads <= 1) return 0;
+  if (options->masterblocksize) {
+    size = options->masterblocksize;
+  } else {
+    size = (insize + options->numthreads - 1) / options->numthreads;
+    if (size < ZOPFLI_MIN_SEGMENT_SIZE) size = ZOPFLI_MIN_SEGMENT_SIZE;
+#if ZOPFLI_MASTER_BLOCK_SIZE != 0
+    if (size > ZOPFLI_MASTER_BLOCK_SIZE) size = ZOPFLI_MASTER_BLOCK_SIZE;
+#endif
+  }
+  return size < insize ? size : 0;
+}
+
 /*
 Compresses the data according to the gzip specification.
 */
-void ZopfliGzipCompress(const ZopfliOptions* options,
-                        const unsigned char* in, size_t insize,
-                        unsigned char** out, size_t* outsize) {
-  unsigned long crcvalue = lodepng_crc32(in, insize);
+void ZopfliGzipCompressOutput(const ZopfliOptions* options,
+                              const unsigned char* in, size_t insize,
+                              ZopfliOutput* out) {
+  unsigned long crcvalue = 0;
   unsigned char bp = 0;
+  size_t segmentsize = GzipSegmentSize(options, insize);
 
-  ZOPFLI_APPEND_DATA(31, out, outsize);  /* ID1 */
-  ZOPFLI_APPEND_DATA(139, out, outsize);  /* ID2 */
-  ZOPFLI_APPEND_DATA(8, out, outsize);  /* CM */
-  ZOPFLI_APPEND_DATA(0, out, outsize);  /* FLG */
+  ZopfliAppendOutput(31, out);  /* ID1 */
+  ZopfliAppendOutput(139, out);  /* ID2 */
+  ZopfliAppendOutput(8, out);  /* CM */
+  ZopfliAppendOutput(0, out);  /* FLG */
   /* MTIME */
-  ZOPFLI_APPEND_DATA(0, out, outsize);
-  ZOPFLI_APPEND_DATA(0, out, outsize);
-  ZOPFLI_APPEND_DATA(0, out, outsize);
-  ZOPFLI_APPEND_DATA(0, out, outsize);
+  ZopfliAppendOutput(0, out);
+  ZopfliAppendOutput(0, out);
+  ZopfliAppendOutput(0, out);
+  ZopfliAppendOutput(0, out);
 
-  ZOPFLI_APPEND_DATA(2, out, outsize);  /* XFL, 2 indicates best compression. */
-  ZOPFLI_APPEND_DATA(3, out, outsize);  /* OS follows Unix conventions. */
+  ZopfliAppendOutput(2, out);  /* XFL, 2 indicates best compression. */
+  ZopfliAppendOutput(3, out);  /* OS follows Unix conventions. */
 
-  ZopfliDeflate(options, 2 /* Dynamic block */, 1,
-                in, insize, &bp, out, outsize);
+  if (segmentsize) {
+    DeflateParallel(options, in, insize, segmentsize, &crcvalue, out);
+  } else {
+    ZopfliDeflateChecksum(options, 2 /* Dynamic block */, 1, in, insize,
+                          UpdateGzipCRC, &crcvalue, &bp, out);
+  }
 
   /* CRC */
-  ZOPFLI_APPEND_DATA(crcvalue % 256, out, outsize);
-  ZOPFLI_APPEND_DATA((crcvalue >> 8) % 256, out, outsize);
-  ZOPFLI_APPEND_DATA((crcvalue >> 16) % 256, out, outsize);
-  ZOPFLI_APPEND_DATA((crcvalue >> 24) % 256, out, outsize);
+  ZopfliAppendOutput(crcvalue % 256, out);
+  ZopfliAppendOutput((crcvalue >> 8) % 256, out);
+  ZopfliAppendOutput((crcvalue >> 16) % 256, out);
+  ZopfliAppendOutput((crcvalue >> 24) % 256, out);
 
   /* ISIZE */
-  ZOPFLI_APPEND_DATA(insize % 256, out, outsize);
-  ZOPFLI_APPEND_DATA((insize >> 8) % 256, out, outsize);
-  ZOPFLI_APPEND_DATA((insize >> 16) % 256, out, outsize);
-  ZOPFLI_APPEND_DATA((insize >> 24) % 256, out, outsize);
+  ZopfliAppendOutput(insize % 256, out);
+  ZopfliAppendOutput((insize >> 8) % 256, out);
+  ZopfliAppendOutput((insize >> 16) % 256, out);
+  ZopfliAppendOutput((insize >> 24) % 256, out);
 
   if (options->verbose) {
-    ZopfliPrintSizeVerbose(insize, *outsize, "Gzip");
+    ZopfliPrintSizeVerbose(insize, out->size, "Gzip");
   }
 }
+
+void ZopfliGzipCompress(const ZopfliOptions* options,
+                        const unsigned char* in, size_t insize,
+                        unsigned char** out, size_t* outsize) {
+  ZopfliOutput output;
+  ZopfliInitAppendOutput(*out, *outsize, &output);
+  ZopfliGzipCompressOutput(options, in, insize, &output);
+  ZopfliFinishAppendOutput(&output, out, outsize);
+}
@@ -43,6 +43,15 @@ void ZopfliGzipCompress(const ZopfliOptions* options,
                         const unsigned char* in, size_t insize,
                         unsigned char** out, size_t* outsize);
 
+/*
+Like ZopfliGzipCompress, but appends the result to out, see ZopfliOutput in
+util.h.
+*/
+struct ZopfliOutput;
+void ZopfliGzipCompressOutput(const ZopfliOptions* options,
+                              const unsigned char* in, size_t insize,
+                              struct ZopfliOutput* out);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -38,6 +38,9 @@ void ZopfliInitHash(size_t window_size, ZopfliHash* h) {
   unsigned short *pus;
 
   h->val = 0;
+#ifdef ZOPFLI_COUNTERS
+  h->counters = 0;
+#endif
   h->head = (int*)pul = (unsigned long*)malloc(sizeof(*h->head) * 65536);
   __stosd(pul, -1, 65536);  /* -1 indicates no head so far. */
   h->prev = pus = (unsigned short*)malloc(sizeof(*h->prev) * window_size);
@@ -97,6 +100,10 @@ void ZopfliUpdateHash(const unsigned char* array, size_t pos, size_t end,
   size_t amount = 0;
 #endif
 
+#ifdef ZOPFLI_COUNTERS
+  if (h->counters) h->counters->hashupdates++;
+#endif
+
   UpdateHashValue(h, pos + ZOPFLI_MIN_MATCH <= end ?
       array[pos + ZOPFLI_MIN_MATCH - 1] : 0);
   h->hashval[hpos] = h->val;
@@ -135,3 +142,28 @@ void ZopfliWarmupHash(const unsigned char* array, size_t pos, size_t end,
   UpdateHashValue(h, array[pos + 0]);
   UpdateHashValue(h, array[pos + 1]);
 }
+
+#ifdef ZOPFLI_COUNTERS
+void ZopfliInitCounters(ZopfliCounters* counters) {
+  memset(counters, 0, sizeof(*counters));
+}
+
+void ZopfliPrintCounters(const ZopfliCounters* counters,
+                         size_t blockstart, size_t blockend) {
+  fprintf(stderr, "counters for block %lu-%lu:\n",
+          (unsigned long)blockstart, (unsigned long)blockend);
+  fprintf(stderr, "  cache: %lu hits, %lu misses\n",
+          (unsigned long)counters->cachehits,
+          (unsigned long)counters->cachemisses);
+  fprintf(stderr, "  chains: %lu searches, %.1f average, %lu max,"
+          " %lu truncated\n",
+          (unsigned long)counters->searches,
+          counters->searches
+              ? (double)counters->chainsteps / counters->searches : 0.0,
+          (unsigned long)counters->maxchain,
+          (unsigned long)counters->chaintruncations);
+  fprintf(stderr, "  hash: %lu switches, %lu updates\n",
+          (unsigned long)counters->hashswitches,
+          (unsigned long)counters->hashupdates);
+}
+#endif
@@ -26,6 +26,27 @@ The hash for ZopfliFindLongestMatch of lz77.c.
 
 #include "util.h"
 
+#ifdef ZOPFLI_COUNTERS
+/* Counts of what the longest match search did, see ZOPFLI_COUNTERS. */
+typedef struct ZopfliCounters {
+  size_t cachehits;  /* Searches answered by the longest match cache. */
+  size_t cachemisses;  /* Searches the longest match cache could not answer. */
+  size_t searches;  /* Hash chain searches. */
+  size_t chainsteps;  /* Hash chain entries visited by all searches. */
+  size_t maxchain;  /* Most hash chain entries visited by one search. */
+  size_t chaintruncations;  /* Searches stopped by ZOPFLI_MAX_CHAIN_HITS. */
+  size_t hashswitches;  /* Switches to the ZOPFLI_HASH_SAME_HASH hash. */
+  size_t hashupdates;  /* Calls to ZopfliUpdateHash. */
+} ZopfliCounters;
+
+/* Sets all counts to 0. */
+void ZopfliInitCounters(ZopfliCounters* counters);
+
+/* Prints the counts for the block [blockstart, blockend) to stderr. */
+void ZopfliPrintCounters(const ZopfliCounters* counters,
+                         size_t blockstart, size_t blockend);
+#endif
+
 typedef struct ZopfliHash {
   int* head;  /* Hash value to index of its most recent occurance. */
   unsigned short* prev;  /* Index to index of prev. occurance of same hash. */
@@ -44,6 +65,10 @@ typedef struct ZopfliHash {
 #ifdef ZOPFLI_HASH_SAME
   unsigned short* same;  /* Amount of repetitions of same byte after this .*/
 #endif
+
+#ifdef ZOPFLI_COUNTERS
+  ZopfliCounters* counters;  /* Counts the hash updates, if not NULL. */
+#endif
 } ZopfliHash;
 
 /* Allocates and initializes all fields of ZopfliHash. */
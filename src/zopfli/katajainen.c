@@ -18,178 +18,202 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 */
 
 /*
-Bounded package merge algorithm, based on the paper
-"A Fast and Space-Economical Algorithm for Length-Limited Coding
-Jyrki Katajainen, Alistair Moffat, Andrew Turpin".
+Length limited Huffman code lengths. Plain Huffman code lengths are computed
+first, with the in-place algorithm from the paper "In-Place Calculation of
+Minimum-Redundancy Codes" by Alistair Moffat and Jyrki Katajainen. If they
+exceed the maximum length, the package-merge algorithm of Larmore and
+Hirschberg is used instead, as described in "A Fast and Space-Economical
+Algorithm for Length-Limited Coding" by Jyrki Katajainen, Alistair Moffat and
+Andrew Turpin.
+
+This is called for every block size estimate, so it uses no heap memory for
+the alphabets of deflate.
 */
 
 #include "katajainen.h"
 #include <assert.h>
 #include <stdlib.h>
 
-typedef struct Node Node;
-
-/*
-Nodes forming chains. Also used to represent leaves.
-*/
-struct Node {
-  size_t weight;  /* Total weight (symbol count) of this chain. */
-  Node* tail;  /* Previous node(s) of this chain, or 0 if none. */
-  int count;  /* Leaf symbol index, or number of leaves before this chain. */
-  char inuse;  /* Tracking for garbage collection. */
-};
-
 /*
-Memory pool for nodes.
+Largest alphabet and maximum bit length handled with stack memory only, larger
+ones allocate their work memory.
 */
-typedef struct NodePool {
-  Node* nodes;  /* The pool. */
-  Node* next;  /* Pointer to a possibly free node in the pool. */
-  int size;  /* Size of the memory pool. */
-} NodePool;
+#define STACK_SYMBOLS 288
+#define STACK_MAXBITS 15
 
 /*
-Initializes a chain node with the given values and marks it as in use.
+A symbol with non-zero frequency.
 */
-static void InitNode(size_t weight, int count, Node* tail, Node* node) {
-  node->weight = weight;
-  node->count = count;
-  node->tail = tail;
-  node->inuse = 1;
-}
+typedef struct Leaf {
+  size_t weight;  /* Frequency of the symbol. */
+  int symbol;  /* Index of the symbol. */
+} Leaf;
 
 /*
-Finds a free location in the memory pool. Performs garbage collection if needed.
-lists: If given, used to mark in-use nodes during garbage collection.
-maxbits: Size of lists.
-pool: Memory pool to get free node from.
+Sorts the leaves from lightest to heaviest, with an LSD radix sort on the bytes
+of the weights. It is stable, so leaves of equal weight stay in symbol order.
+temp: work memory of the same size as leaves.
 */
-static Node* GetFreeNode(Node* (*lists)[2], int maxbits, NodePool* pool) {
-  for (;;) {
-    if (pool->next >= &pool->nodes[pool->size]) {
-      /* Garbage collection. */
-      int i;
-      for (i = 0; i < pool->size; i++) {
-        pool->nodes[i].inuse = 0;
-      }
-      if (lists) {
-        for (i = 0; i < maxbits * 2; i++) {
-          Node* node;
-          for (node = lists[i / 2][i % 2]; node; node = node->tail) {
-            node->inuse = 1;
-          }
-        }
-      }
-      pool->next = &pool->nodes[0];
+static void SortLeaves(Leaf* leaves, int n, Leaf* temp) {
+  size_t maxweight = 0;
+  int shift;
+  int i;
+  for (i = 0; i < n; i++) {
+    if (leaves[i].weight > maxweight) maxweight = leaves[i].weight;
+  }
+  for (shift = 0; shift < (int)sizeof(size_t) * 8 && (maxweight >> shift);
+       shift += 8) {
+    size_t counts[256];
+    size_t sum = 0;
+    for (i = 0; i < 256; i++) counts[i] = 0;
+    for (i = 0; i < n; i++) counts[(leaves[i].weight >> shift) & 255]++;
+    for (i = 0; i < 256; i++) {
+      size_t count = counts[i];
+      counts[i] = sum;
+      sum += count;
+    }
+    for (i = 0; i < n; i++) {
+      temp[counts[(leaves[i].weight >> shift) & 255]++] = leaves[i];
     }
-    if (!pool->next->inuse) break;  /* Found one. */
-    pool->next++;
+    for (i = 0; i < n; i++) leaves[i] = temp[i];
   }
-  return pool->next++;
 }
 
-
 /*
-Performs a Boundary Package-Merge step. Puts a new chain in the given list. The
-new chain is, depending on the weights, a leaf or a combination of two chains
-from the previous list.
-lists: The lists of chains.
-maxbits: Number of lists.
-leaves: The leaves, one per symbol.
-numsymbols: Number of leaves.
-pool: the node memory pool.
-index: The index of the list in which a new chain or leaf is required.
-final: Whether this is the last time this function is called. If it is then it
-  is no more needed to recursively call self.
+Computes unlimited Huffman code lengths in place. On input, a contains the
+weights sorted from lightest to heaviest, on output the code length of each,
+which is then from longest to shortest. n must be at least 2.
 */
-static void BoundaryPM(Node* (*lists)[2], int maxbits,
-    Node* leaves, int numsymbols, NodePool* pool, int index, char final) {
-  Node* newchain;
-  Node* oldchain;
-  int lastcount = lists[index][1]->count;  /* Count of last chain of list. */
-
-  if (index == 0 && lastcount >= numsymbols) return;
-
-  newchain = GetFreeNode(lists, maxbits, pool);
-  oldchain = lists[index][1];
-
-  /* These are set up before the recursive calls below, so that there is a list
-  pointing to the new node, to let the garbage collection know it's in use. */
-  lists[index][0] = oldchain;
-  lists[index][1] = newchain;
-
-  if (index == 0) {
-    /* New leaf node in list 0. */
-    InitNode(leaves[lastcount].weight, lastcount + 1, 0, newchain);
-  } else {
-    size_t sum = lists[index - 1][0]->weight + lists[index - 1][1]->weight;
-    if (lastcount < numsymbols && sum > leaves[lastcount].weight) {
-      /* New leaf inserted in list, so count is incremented. */
-      InitNode(leaves[lastcount].weight, lastcount + 1, oldchain->tail,
-          newchain);
+static void HuffmanLengthsInPlace(size_t* a, int n) {
+  int root, leaf, next, avbl, used, dpth;
+
+  /* First pass, left to right, setting parent pointers. */
+  a[0] += a[1];
+  root = 0;
+  leaf = 2;
+  for (next = 1; next < n - 1; next++) {
+    /* Select first item for a pairing. */
+    if (leaf >= n || a[root] < a[leaf]) {
+      a[next] = a[root];
+      a[root++] = next;
     } else {
-      InitNode(sum, lastcount, lists[index - 1][1], newchain);
-      if (!final) {
-        /* Two lookahead chains of previous list used up, create new ones. */
-        BoundaryPM(lists, maxbits, leaves, numsymbols, pool, index - 1, 0);
-        BoundaryPM(lists, maxbits, leaves, numsymbols, pool, index - 1, 0);
-      }
+      a[next] = a[leaf++];
+    }
+    /* Add on the second item. */
+    if (leaf >= n || (root < next && a[root] < a[leaf])) {
+      a[next] += a[root];
+      a[root++] = next;
+    } else {
+      a[next] += a[leaf++];
     }
   }
-}
 
-/*
-Initializes each list with as lookahead chains the two leaves with lowest
-weights.
-*/
-static void InitLists(
-    NodePool* pool, const Node* leaves, int maxbits, Node* (*lists)[2]) {
-  int i;
-  Node* node0 = GetFreeNode(0, maxbits, pool);
-  Node* node1 = GetFreeNode(0, maxbits, pool);
-  InitNode(leaves[0].weight, 1, 0, node0);
-  InitNode(leaves[1].weight, 2, 0, node1);
-  for (i = 0; i < maxbits; i++) {
-    lists[i][0] = node0;
-    lists[i][1] = node1;
+  /* Second pass, right to left, setting internal depths. */
+  a[n - 2] = 0;
+  for (next = n - 3; next >= 0; next--) {
+    a[next] = a[a[next]] + 1;
   }
-}
 
-/*
-Converts result of boundary package-merge to the bitlengths. The result in the
-last chain of the last list contains the amount of active leaves in each list.
-chain: Chain to extract the bit length from (last chain from last list).
-*/
-static void ExtractBitLengths(Node* chain, Node* leaves, unsigned* bitlengths) {
-  Node* node;
-  for (node = chain; node; node = node->tail) {
-    int i;
-    for (i = 0; i < node->count; i++) {
-      bitlengths[leaves[i].count]++;
+  /* Third pass, right to left, setting leaf depths. */
+  avbl = 1;
+  used = dpth = 0;
+  root = n - 2;
+  next = n - 1;
+  while (avbl > 0) {
+    while (root >= 0 && a[root] == (size_t)dpth) {
+      used++;
+      root--;
     }
+    while (avbl > used) {
+      a[next--] = dpth;
+      avbl--;
+    }
+    avbl = 2 * used;
+    dpth++;
+    used = 0;
   }
 }
 
 /*
-Comparator for sorting the leaves. Has the function signature for qsort.
+Computes the length limited code lengths of the sorted leaves with the
+package-merge algorithm, and adds them to bitlengths.
+The list of level maxbits holds the leaves, the list of each level above it is
+the merge of the leaves with the packages (sums of pairs) of the list below,
+and only its first 2 * n - 2 items can ever be used. Each leaf gets one bit
+for each level where it is among the used items.
+isleaf: work memory for maxbits * (2 * n - 2) flags, for each level and
+  position whether the item is a leaf or a package.
+weights: work memory for 2 * (2 * n - 2) weights.
 */
-static int LeafComparator(const void* a, const void* b) {
-  return ((const Node*)a)->weight - ((const Node*)b)->weight;
+static void PackageMerge(const Leaf* leaves, int n, int maxbits,
+                         unsigned char* isleaf, size_t* weights,
+                         unsigned* bitlengths) {
+  int maxitems = 2 * n - 2;
+  size_t* prev = weights;  /* The list of the level below. */
+  size_t* cur = weights + maxitems;
+  int prevsize, cursize = 0;
+  int level, i;
+  int needed;
+
+  /* The deepest level only has leaves. */
+  for (i = 0; i < maxitems && i < n; i++) {
+    cur[i] = leaves[i].weight;
+    isleaf[(maxbits - 1) * maxitems + i] = 1;
+  }
+  cursize = i;
+
+  for (level = maxbits - 2; level >= 0; level--) {
+    unsigned char* flags = &isleaf[level * maxitems];
+    int leaf = 0, package = 0;
+    int numpackages;
+    size_t* swap = prev;
+    prev = cur;
+    cur = swap;
+    prevsize = cursize;
+    numpackages = prevsize / 2;
+    cursize = 0;
+    while (cursize < maxitems && (leaf < n || package < numpackages)) {
+      size_t sum = package < numpackages
+          ? prev[2 * package] + prev[2 * package + 1] : 0;
+      /* On equal weights the package goes first. */
+      if (package >= numpackages || (leaf < n && leaves[leaf].weight < sum)) {
+        cur[cursize] = leaves[leaf++].weight;
+        flags[cursize++] = 1;
+      } else {
+        cur[cursize] = sum;
+        flags[cursize++] = 0;
+        package++;
+      }
+    }
+  }
+
+  /* Walk back down, counting the used leaves of each level. */
+  needed = maxitems;
+  for (level = 0; level < maxbits && needed > 0; level++) {
+    const unsigned char* flags = &isleaf[level * maxitems];
+    int numleaves = 0;
+    for (i = 0; i < needed; i++) numleaves += flags[i];
+    for (i = 0; i < numleaves; i++) bitlengths[leaves[i].symbol]++;
+    needed = 2 * (needed - numleaves);
+  }
 }
 
 int ZopfliLengthLimitedCodeLengths(
     const size_t* frequencies, int n, int maxbits, unsigned* bitlengths) {
-  NodePool pool;
+  Leaf stackleaves[STACK_SYMBOLS * 2];
+  size_t stackweights[STACK_SYMBOLS * 4];
+  unsigned char stackisleaf[STACK_MAXBITS * STACK_SYMBOLS * 2];
+  Leaf* leaves = stackleaves;
+  size_t* weights = stackweights;
+  unsigned char* isleaf = stackisleaf;
   int i;
   int numsymbols = 0;  /* Amount of symbols with frequency > 0. */
-  int numBoundaryPMRuns;
-
-  /* Array of lists of chains. Each list requires only two lookahead chains at
-  a time, so each list is a array of two Node*'s. */
-  Node* (*lists)[2];
+  int maxlength;
 
-  /* One leaf per symbol. Only numsymbols leaves will be used. */
-  Node* leaves = (Node*)malloc(n * sizeof(*leaves));
+  if (n > STACK_SYMBOLS) {
+    leaves = (Leaf*)malloc(n * 2 * sizeof(*leaves));
+    if (!leaves) exit(-1); /* Allocation failed. */
+  }
 
   /* Initialize all bitlengths at 0. */
   for (i = 0; i < n; i++) {
@@ -200,52 +224,55 @@ int ZopfliLengthLimitedCodeLengths(
   for (i = 0; i < n; i++) {
     if (frequencies[i]) {
       leaves[numsymbols].weight = frequencies[i];
-      leaves[numsymbols].count = i;  /* Index of symbol this leaf represents. */
+      leaves[numsymbols].symbol = i;
       numsymbols++;
     }
   }
 
   /* Check special cases and error conditions. */
   if ((1 << maxbits) < numsymbols) {
-    free(leaves);
+    if (leaves != stackleaves) free(leaves);
     return 1;  /* Error, too few maxbits to represent symbols. */
   }
   if (numsymbols == 0) {
-    free(leaves);
+    if (leaves != stackleaves) free(leaves);
     return 0;  /* No symbols at all. OK. */
   }
   if (numsymbols == 1) {
-    bitlengths[leaves[0].count] = 1;
-    free(leaves);
+    bitlengths[leaves[0].symbol] = 1;
+    if (leaves != stackleaves) free(leaves);
     return 0;  /* Only one symbol, give it bitlength 1, not 0. OK. */
   }
 
   /* Sort the leaves from lightest to heaviest. */
-  qsort(leaves, numsymbols, sizeof(Node), LeafComparator);
-
-  /* Initialize node memory pool. */
-  pool.size = 2 * maxbits * (maxbits + 1);
-  pool.nodes = (Node*)malloc(pool.size * sizeof(*pool.nodes));
-  pool.next = pool.nodes;
-  for (i = 0; i < pool.size; i++) {
-    pool.nodes[i].inuse = 0;
+  SortLeaves(leaves, numsymbols, leaves + n);
+
+  /*
+  Fast path: plain Huffman code lengths, which are optimal if they fit in
+  maxbits. The lightest leaf has the longest code.
+  */
+  if (n > STACK_SYMBOLS) {
+    weights = (size_t*)malloc(n * 4 * sizeof(*weights));
+    if (!weights) exit(-1); /* Allocation failed. */
   }
+  for (i = 0; i < numsymbols; i++) weights[i] = leaves[i].weight;
+  HuffmanLengthsInPlace(weights, numsymbols);
+  maxlength = (int)weights[0];
 
-  lists = (Node* (*)[2])malloc(maxbits * sizeof(*lists));
-  InitLists(&pool, leaves, maxbits, lists);
-
-  /* In the last list, 2 * numsymbols - 2 active chains need to be created. Two
-  are already created in the initialization. Each BoundaryPM run creates one. */
-  numBoundaryPMRuns = 2 * numsymbols - 4;
-  for (i = 0; i < numBoundaryPMRuns; i++) {
-    char final = i == numBoundaryPMRuns - 1;
-    BoundaryPM(lists, maxbits, leaves, numsymbols, &pool, maxbits - 1, final);
+  if (maxlength <= maxbits) {
+    for (i = 0; i < numsymbols; i++) {
+      bitlengths[leaves[i].symbol] = (unsigned)weights[i];
+    }
+  } else {
+    if (n > STACK_SYMBOLS || maxbits > STACK_MAXBITS) {
+      isleaf = (unsigned char*)malloc(maxbits * (2 * numsymbols - 2));
+      if (!isleaf) exit(-1); /* Allocation failed. */
+    }
+    PackageMerge(leaves, numsymbols, maxbits, isleaf, weights, bitlengths);
+    if (isleaf != stackisleaf) free(isleaf);
   }
 
-  ExtractBitLengths(lists[maxbits - 1][1], leaves, bitlengths);
-
-  free(lists);
-  free(leaves);
-  free(pool.nodes);
+  if (weights != stackweights) free(weights);
+  if (leaves != stackleaves) free(leaves);
   return 0;  /* OK. */
 }
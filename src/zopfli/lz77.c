@@ -339,6 +339,9 @@ void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
 #if ZOPFLI_MAX_CHAIN_HITS < ZOPFLI_WINDOW_SIZE
   int chain_counter = ZOPFLI_MAX_CHAIN_HITS;  /* For quitting early. */
 #endif
+#ifdef ZOPFLI_COUNTERS
+  size_t chainsteps = 0;
+#endif
 
   unsigned dist = 0;  /* Not unsigned short on purpose. */
 
@@ -351,9 +354,15 @@ void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
   size_t lmcpos = pos - s->blockstart;
   ZopfliLongestMatchCache *lmc = s->lmc;
   if (lmc && TryGetFromLongestMatchCache(lmc, lmcpos, &limit, sublen, distance, length)) {
+#ifdef ZOPFLI_COUNTERS
+    s->counters.cachehits++;
+#endif
     assert(pos + *length <= size);
     return;
   }
+#ifdef ZOPFLI_COUNTERS
+  if (lmc) s->counters.cachemisses++;
+#endif
 #endif
 
   assert(limit <= ZOPFLI_MAX_MATCH);
@@ -386,6 +395,10 @@ void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
   while (dist < ZOPFLI_WINDOW_SIZE) {
     unsigned currentlength = 0;
 
+#ifdef ZOPFLI_COUNTERS
+    chainsteps++;
+#endif
+
     assert(p < ZOPFLI_WINDOW_SIZE);
     assert(p == hprev[pp]);
     assert(hhashval[p] == hval);
@@ -433,6 +446,9 @@ void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
     if (hhead != h->head2 && bestlength >= h->same[hpos] &&
         h->val2 == h->hashval2[p]) {
       /* Now use the hash that encodes the length and first byte. */
+#ifdef ZOPFLI_COUNTERS
+      s->counters.hashswitches++;
+#endif
       hhead = h->head2;
       hprev = h->prev2;
       hhashval = h->hashval2;
@@ -448,10 +464,21 @@ void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
 
 #if ZOPFLI_MAX_CHAIN_HITS < ZOPFLI_WINDOW_SIZE
     chain_counter--;
-    if (chain_counter <= 0) break;
+    if (chain_counter <= 0) {
+#ifdef ZOPFLI_COUNTERS
+      s->counters.chaintruncations++;
+#endif
+      break;
+    }
 #endif
   }
 
+#ifdef ZOPFLI_COUNTERS
+  s->counters.searches++;
+  s->counters.chainsteps += chainsteps;
+  if (chainsteps > s->counters.maxchain) s->counters.maxchain = chainsteps;
+#endif
+
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   if (lmc) StoreInLongestMatchCache(lmc, lmcpos, limit, sublen, bestdist, bestlength);
 #endif
@@ -487,11 +514,20 @@ void ZopfliLZ77Greedy(ZopfliBlockState* s, const unsigned char* in,
 
   if (instart == inend) return;
 
+  ZopfliReportPhase(s->options, ZOPFLI_PHASE_GREEDY, 0,
+                    instart, inend, -1, 0);
+  ZopfliReportPhase(s->options, ZOPFLI_PHASE_HASH, 0,
+                    windowstart, instart, -1, 0);
   ZopfliInitHash(ZOPFLI_WINDOW_SIZE, h);
+#ifdef ZOPFLI_COUNTERS
+  h->counters = &s->counters;
+#endif
   ZopfliWarmupHash(in, windowstart, inend, h);
   for (i = windowstart; i < instart; i++) {
     ZopfliUpdateHash(in, i, inend, h);
   }
+  ZopfliReportPhase(s->options, ZOPFLI_PHASE_HASH, 1,
+                    windowstart, instart, -1, 0);
 
   for (i = instart; i < inend; i++) {
     ZopfliUpdateHash(in, i, inend, h);
@@ -554,6 +590,8 @@ void ZopfliLZ77Greedy(ZopfliBlockState* s, const unsigned char* in,
   }
 
   ZopfliCleanHash(h);
+  ZopfliReportPhase(s->options, ZOPFLI_PHASE_GREEDY, 1,
+                    instart, inend, -1, 0);
 }
 
 void ZopfliLZ77Counts(const unsigned short* litlens,
@@ -580,3 +618,20 @@ void ZopfliLZ77Counts(const unsigned short* litlens,
 
   ll_count[256] = 1;  /* End symbol. */
 }
+
+void ZopfliLZ77UpdateCounts(const unsigned short* litlens,
+                            const unsigned short* dists,
+                            size_t start, size_t end, int remove,
+                            size_t* ll_count, size_t* d_count) {
+  size_t delta = remove ? (size_t)-1 : 1;  /* Adding -1 wraps around. */
+  size_t i;
+
+  for (i = start; i < end; i++) {
+    if (dists[i] == 0) {
+      ll_count[litlens[i]] += delta;
+    } else {
+      ll_count[ZopfliGetLengthSymbol(litlens[i])] += delta;
+      d_count[ZopfliGetDistSymbol(dists[i])] += delta;
+    }
+  }
+}
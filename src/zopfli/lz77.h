@@ -91,6 +91,10 @@ typedef struct ZopfliBlockState {
   /* The start (inclusive) and end (not inclusive) of the current block. */
   size_t blockstart;
   size_t blockend;
+#ifdef ZOPFLI_COUNTERS
+  /* Counts of what the longest match search did for this block. */
+  ZopfliCounters counters;
+#endif
 } ZopfliBlockState;
 
 /*
@@ -136,6 +140,17 @@ void ZopfliLZ77Counts(const unsigned short* litlens,
                       size_t start, size_t end,
                       size_t* ll_count, size_t* d_count);
 
+/*
+Updates counts as given by ZopfliLZ77Counts incrementally: adds the symbols of
+the lz77 arrays from start to end (not inclusive) to the counts, or removes them
+if remove is non-zero. The count of the end symbol is not changed. Moving the
+boundary of a range this way costs only the amount of symbols it moves over.
+*/
+void ZopfliLZ77UpdateCounts(const unsigned short* litlens,
+                            const unsigned short* dists,
+                            size_t start, size_t end, int remove,
+                            size_t* ll_count, size_t* d_count);
+
 /*
 Does LZ77 using an algorithm similar to gzip, with lazy matching, rather than
 with the slow but better "squeeze" implementation.
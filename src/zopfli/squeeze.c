@@ -281,11 +281,18 @@ static double GetBestLengths(ZopfliBlockState *s,
   costs = (float*)malloc(sizeof(float) * (blocksize + 1));
   if (!costs) exit(-1); /* Allocation failed. */
 
+  ZopfliReportPhase(s->options, ZOPFLI_PHASE_HASH, 0,
+                    windowstart, instart, -1, 0);
   ZopfliInitHash(ZOPFLI_WINDOW_SIZE, h);
+#ifdef ZOPFLI_COUNTERS
+  h->counters = &s->counters;
+#endif
   ZopfliWarmupHash(in, windowstart, inend, h);
   for (i = windowstart; i < instart; i++) {
     ZopfliUpdateHash(in, i, inend, h);
   }
+  ZopfliReportPhase(s->options, ZOPFLI_PHASE_HASH, 1,
+                    windowstart, instart, -1, 0);
 
   for (i = 1; i < blocksize + 1; i++) costs[i] = ZOPFLI_LARGE_FLOAT;
   costs[0] = 0;  /* Because it's the start. */
@@ -409,11 +416,18 @@ static void FollowPath(ZopfliBlockState* s,
 
   if (instart == inend) return;
 
+  ZopfliReportPhase(s->options, ZOPFLI_PHASE_HASH, 0,
+                    windowstart, instart, -1, 0);
   ZopfliInitHash(ZOPFLI_WINDOW_SIZE, h);
+#ifdef ZOPFLI_COUNTERS
+  h->counters = &s->counters;
+#endif
   ZopfliWarmupHash(in, windowstart, inend, h);
   for (i = windowstart; i < instart; i++) {
     ZopfliUpdateHash(in, i, inend, h);
   }
+  ZopfliReportPhase(s->options, ZOPFLI_PHASE_HASH, 1,
+                    windowstart, instart, -1, 0);
 
   pos = instart;
   for (i = 0; i < pathsize; i++) {
@@ -525,6 +539,19 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   /* Try randomizing the costs a bit once the size stabilizes. */
   RanState ran_state;
   int lastrandomstep = -1;
+  /* Early termination. */
+  const ZopfliOptions* options = s->options;
+  int stalled = 0;  /* Iterations in a row that did not improve bestcost. */
+  double deadline = 0;  /* ZopfliGetTime() at which to stop, 0 for never. */
+  size_t targetcost = (size_t)(options->targetbitsperbyte * blocksize);
+
+  if (options->blocktimelimit > 0 || options->timelimit > 0) {
+    double limit = options->blocktimelimit;
+    if (limit <= 0 || (options->timelimit > 0 && options->timelimit < limit)) {
+      limit = options->timelimit;
+    }
+    deadline = ZopfliGetTime() + limit;
+  }
 
   if (!length_array) exit(-1); /* Allocation failed. */
 
@@ -541,7 +568,15 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
 
   /* Repeat statistics with each time the cost model from the previous stat
   run. */
-  for (i = 0; i < s->options->numiterations; i++) {
+  for (i = 0; i < options->numiterations; i++) {
+    if (deadline > 0 && ZopfliGetTime() >= deadline) {
+      if (options->verbose) {
+        fprintf(stderr, "Time limit reached after %d iterations\n", i);
+      }
+      break;
+    }
+    ZopfliReportPhase(options, ZOPFLI_PHASE_ITERATION, 0,
+                      instart, inend, i, 0);
     ZopfliCleanLZ77Store(&currentstore);
     ZopfliInitLZ77Store(&currentstore);
     LZ77OptimalRun(s, in, instart, inend, &path, &pathsize,
@@ -549,7 +584,9 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
                    &currentstore);
     cost = ZopfliCalculateBlockSize(currentstore.litlens, currentstore.dists,
                                     0, currentstore.size, 2);
-    if (s->options->verbose_more || (s->options->verbose && cost < bestcost)) {
+    ZopfliReportPhase(options, ZOPFLI_PHASE_ITERATION, 1,
+                      instart, inend, i, cost);
+    if (options->verbose_more || (options->verbose && cost < bestcost)) {
       fprintf(stderr, "Iteration %d: %u bit\n", i, cost);
     }
     if (cost < bestcost) {
@@ -557,6 +594,17 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
       ZopfliCopyLZ77Store(&currentstore, store);
       CopyStats(&stats, &beststats);
       bestcost = cost;
+      stalled = 0;
+    } else {
+      stalled++;
+    }
+    if (bestcost <= targetcost ||
+        (options->maxstalliterations > 0 &&
+         stalled >= options->maxstalliterations)) {
+      if (options->verbose) {
+        fprintf(stderr, "Converged after %d iterations\n", i + 1);
+      }
+      break;
     }
     CopyStats(&stats, &laststats);
     ClearStatFreqs(&stats);
@@ -577,6 +625,11 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
     lastcost = cost;
   }
 
+  if (bestcost == (size_t)-1) {
+    /* Out of time before the first iteration, use the greedy result. */
+    ZopfliCopyLZ77Store(&currentstore, store);
+  }
+
   free(length_array);
   free(path);
   ZopfliCleanLZ77Store(&currentstore);
@@ -602,10 +655,87 @@ void ZopfliLZ77OptimalFixed(ZopfliBlockState *s,
   /* Shortest path for fixed tree This one should give the shortest possible
   result for fixed tree, no repeated runs are needed since the tree is known. */
   /* manually inline LZ77OptimalRun because path == pathsize == 0 */
+  ZopfliReportPhase(s->options, ZOPFLI_PHASE_ITERATION, 0,
+                    instart, inend, 0, 0);
   GetBestLengths(s, in, instart, inend, GetCostFixed, 0, length_array);
   TraceBackwards(inend - instart, length_array, &path, &pathsize);
   FollowPath(s, in, instart, inend, path, pathsize, store);
+  ZopfliReportPhase(s->options, ZOPFLI_PHASE_ITERATION, 1,
+                    instart, inend, 0, 0);
 
   free(length_array);
   free(path);
 }
+
+/* Does greedy LZ77 without longest match cache, for the cost estimates. */
+static void LZ77GreedyUncached(const ZopfliOptions* options,
+                               const unsigned char* in,
+                               size_t instart, size_t inend,
+                               ZopfliLZ77Store* store) {
+  ZopfliBlockState s;
+  s.options = options;
+  s.blockstart = instart;
+  s.blockend = inend;
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+  s.lmc = 0;
+#endif
+#ifdef ZOPFLI_COUNTERS
+  ZopfliInitCounters(&s.counters);
+#endif
+  ZopfliLZ77Greedy(&s, in, instart, inend, store);
+}
+
+void ZopfliGetSymbolCosts(const ZopfliOptions* options,
+                          const unsigned char* in,
+                          size_t instart, size_t inend,
+                          ZopfliSymbolCosts* costs) {
+  ZopfliLZ77Store store;
+  SymbolStats stats;
+  ZopfliInitLZ77Store(&store);
+  InitStats(&stats);
+  LZ77GreedyUncached(options, in, instart, inend, &store);
+  GetStatistics(&store, &stats);
+  memcpy(costs->ll_symbols, stats.ll_symbols, sizeof(costs->ll_symbols));
+  memcpy(costs->d_symbols, stats.d_symbols, sizeof(costs->d_symbols));
+  ZopfliCleanLZ77Store(&store);
+}
+
+double ZopfliEstimateCost(const ZopfliOptions* options,
+                          const unsigned char* in,
+                          size_t instart, size_t inend,
+                          const ZopfliSymbolCosts* costs) {
+  ZopfliLZ77Store store;
+  SymbolStats stats;
+  const double* ll_symbols;
+  const double* d_symbols;
+  double cost = 0;
+  size_t i;
+
+  ZopfliInitLZ77Store(&store);
+  LZ77GreedyUncached(options, in, instart, inend, &store);
+  if (costs) {
+    ll_symbols = costs->ll_symbols;
+    d_symbols = costs->d_symbols;
+  } else {
+    InitStats(&stats);
+    GetStatistics(&store, &stats);
+    ll_symbols = stats.ll_symbols;
+    d_symbols = stats.d_symbols;
+  }
+
+  /* The same as GetCostStat, for each symbol of the greedy run. */
+  for (i = 0; i < store.size; i++) {
+    unsigned litlen = store.litlens[i];
+    unsigned dist = store.dists[i];
+    if (dist == 0) {
+      cost += ll_symbols[litlen];
+    } else {
+      cost += ll_symbols[ZopfliGetLengthSymbol(litlen)] +
+          d_symbols[ZopfliGetDistSymbol(dist)] +
+          (ZopfliGetLengthExtraBits(litlen) + ZopfliGetDistExtraBits(dist));
+    }
+  }
+
+  ZopfliCleanLZ77Store(&store);
+  return cost;
+}
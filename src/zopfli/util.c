@@ -17,6 +17,10 @@ Author: lode.vandevenne@gmail.com (Lode Vandevenne)
 Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 */
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L  /* For clock_gettime. */
+#endif
+
 #include "util.h"
 
 #include "zopfli.h"
@@ -24,73 +28,81 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
-
-const unsigned short ZopfliGetLengthSymbolTable[259] = {
-  0, 0, 0, 257, 258, 259, 260, 261, 262, 263, 264,
-  265, 265, 266, 266, 267, 267, 268, 268,
-  269, 269, 269, 269, 270, 270, 270, 270,
-  271, 271, 271, 271, 272, 272, 272, 272,
-  273, 273, 273, 273, 273, 273, 273, 273,
-  274, 274, 274, 274, 274, 274, 274, 274,
-  275, 275, 275, 275, 275, 275, 275, 275,
-  276, 276, 276, 276, 276, 276, 276, 276,
-  277, 277, 277, 277, 277, 277, 277, 277,
-  277, 277, 277, 277, 277, 277, 277, 277,
-  278, 278, 278, 278, 278, 278, 278, 278,
-  278, 278, 278, 278, 278, 278, 278, 278,
-  279, 279, 279, 279, 279, 279, 279, 279,
-  279, 279, 279, 279, 279, 279, 279, 279,
-  280, 280, 280, 280, 280, 280, 280, 280,
-  280, 280, 280, 280, 280, 280, 280, 280,
-  281, 281, 281, 281, 281, 281, 281, 281,
-  281, 281, 281, 281, 281, 281, 281, 281,
-  281, 281, 281, 281, 281, 281, 281, 281,
-  281, 281, 281, 281, 281, 281, 281, 281,
-  282, 282, 282, 282, 282, 282, 282, 282,
-  282, 282, 282, 282, 282, 282, 282, 282,
-  282, 282, 282, 282, 282, 282, 282, 282,
-  282, 282, 282, 282, 282, 282, 282, 282,
-  283, 283, 283, 283, 283, 283, 283, 283,
-  283, 283, 283, 283, 283, 283, 283, 283,
-  283, 283, 283, 283, 283, 283, 283, 283,
-  283, 283, 283, 283, 283, 283, 283, 283,
-  284, 284, 284, 284, 284, 284, 284, 284,
-  284, 284, 284, 284, 284, 284, 284, 284,
-  284, 284, 284, 284, 284, 284, 284, 284,
-  284, 284, 284, 284, 284, 284, 284, 285
-};
-const unsigned char ZopfliGetLengthExtraBitsTable[259] = {
-  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
-  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
-  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
-  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 0
-};
-const unsigned char ZopfliGetLengthExtraBitsValueTable[259] = {
-  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 2, 3, 0,
-  1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5,
-  6, 7, 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6,
-  7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
-  13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2,
-  3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
-  10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28,
-  29, 30, 31, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17,
-  18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 0, 1, 2, 3, 4, 5, 6,
-  7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26,
-  27, 28, 29, 30, 31, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-  16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 0
-};
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+const unsigned short ZopfliGetLengthSymbolTable[259] = {
+  0, 0, 0, 257, 258, 259, 260, 261, 262, 263, 264,
+  265, 265, 266, 266, 267, 267, 268, 268,
+  269, 269, 269, 269, 270, 270, 270, 270,
+  271, 271, 271, 271, 272, 272, 272, 272,
+  273, 273, 273, 273, 273, 273, 273, 273,
+  274, 274, 274, 274, 274, 274, 274, 274,
+  275, 275, 275, 275, 275, 275, 275, 275,
+  276, 276, 276, 276, 276, 276, 276, 276,
+  277, 277, 277, 277, 277, 277, 277, 277,
+  277, 277, 277, 277, 277, 277, 277, 277,
+  278, 278, 278, 278, 278, 278, 278, 278,
+  278, 278, 278, 278, 278, 278, 278, 278,
+  279, 279, 279, 279, 279, 279, 279, 279,
+  279, 279, 279, 279, 279, 279, 279, 279,
+  280, 280, 280, 280, 280, 280, 280, 280,
+  280, 280, 280, 280, 280, 280, 280, 280,
+  281, 281, 281, 281, 281, 281, 281, 281,
+  281, 281, 281, 281, 281, 281, 281, 281,
+  281, 281, 281, 281, 281, 281, 281, 281,
+  281, 281, 281, 281, 281, 281, 281, 281,
+  282, 282, 282, 282, 282, 282, 282, 282,
+  282, 282, 282, 282, 282, 282, 282, 282,
+  282, 282, 282, 282, 282, 282, 282, 282,
+  282, 282, 282, 282, 282, 282, 282, 282,
+  283, 283, 283, 283, 283, 283, 283, 283,
+  283, 283, 283, 283, 283, 283, 283, 283,
+  283, 283, 283, 283, 283, 283, 283, 283,
+  283, 283, 283, 283, 283, 283, 283, 283,
+  284, 284, 284, 284, 284, 284, 284, 284,
+  284, 284, 284, 284, 284, 284, 284, 284,
+  284, 284, 284, 284, 284, 284, 284, 284,
+  284, 284, 284, 284, 284, 284, 284, 285
+};
+const unsigned char ZopfliGetLengthExtraBitsTable[259] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 0
+};
+const unsigned char ZopfliGetLengthExtraBitsValueTable[259] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 2, 3, 0,
+  1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5,
+  6, 7, 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6,
+  7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+  13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2,
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+  10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28,
+  29, 30, 31, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17,
+  18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 0, 1, 2, 3, 4, 5, 6,
+  7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26,
+  27, 28, 29, 30, 31, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+  16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 0
+};
 
 /*
 Table of distances that have a different distance symbol in the deflate
@@ -101,7 +113,7 @@ See RFC 1951 section 3.2.5. Compressed blocks (length and distance codes).
 const unsigned int DistSymbols[30] = {
   1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
   769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
-};
+};
 
 #if defined(__GUNC__) || defined(_MSC_VER)
 #else
@@ -200,6 +212,14 @@ void ZopfliInitOptions(ZopfliOptions* options) {
   options->blocksplitting = 1;
   options->blocksplittinglast = 0;
   options->blocksplittingmax = 15;
+  options->maxstalliterations = 0;
+  options->blocktimelimit = 0;
+  options->targetbitsperbyte = 0;
+  options->timelimit = 0;
+  options->masterblocksize = 0;
+  options->numthreads = 1;
+  options->phasecallback = 0;
+  options->phasecontext = 0;
 }
 #endif
 
@@ -207,4 +227,170 @@ int ZopfliPrintSizeVerbose(size_t insize, size_t outsize, const char *name) {
   return fprintf(stderr,
                  "Original Size: %u, %s: %u, Compression: %f%% Removed\n",
                  insize, name, outsize, 100.0 * (insize - outsize) / insize);
-}
\ No newline at end of file
+}
+
+void ZopfliReportPhase(const ZopfliOptions* options, ZopfliPhase phase,
+                       int end, size_t rangestart, size_t rangeend,
+                       int iteration, double cost) {
+  ZopfliPhaseEvent event;
+  if (!options->phasecallback) return;
+  event.phase = phase;
+  event.end = end;
+  event.time = ZopfliGetTime();
+  event.rangestart = rangestart;
+  event.rangeend = rangeend;
+  event.iteration = iteration;
+  event.cost = cost;
+  options->phasecallback(&event, options->phasecontext);
+}
+
+double ZopfliGetTime(void) {
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/*
+Grows a dynamic array of ZOPFLI_APPEND_DATA to the next power of two that fits.
+type: ZopfliGrowFun
+*/
+static unsigned char* GrowAppendData(unsigned char* data, size_t size,
+                                     size_t needed, size_t* capacity,
+                                     void* context) {
+  size_t newcapacity = *capacity ? *capacity : 1;
+  (void)size;
+  (void)context;
+  while (newcapacity < needed) newcapacity <<= 1;
+  data = (unsigned char*)realloc(data, newcapacity);
+  if (!data) exit(-1); /* Allocation failed. */
+  *capacity = newcapacity;
+  return data;
+}
+
+void ZopfliInitAppendOutput(unsigned char* data, size_t size,
+                            ZopfliOutput* output) {
+  output->data = data;
+  output->size = size;
+  output->capacity = 0;
+  if (size > 0) {
+    output->capacity = 1;
+    while (output->capacity < size) output->capacity <<= 1;
+  }
+  output->grow = GrowAppendData;
+  output->growcontext = 0;
+}
+
+void ZopfliFinishAppendOutput(const ZopfliOutput* output,
+                              unsigned char** data, size_t* size) {
+  *data = output->data;
+  *size = output->size;
+}
+
+int ZopfliReserveOutput(ZopfliOutput* output, size_t n) {
+  unsigned char* data;
+  if (output->size + n <= output->capacity) return 1;
+  if (!output->grow || output->size > output->capacity) return 0;
+  data = output->grow(output->data, output->size, output->size + n,
+                      &output->capacity, output->growcontext);
+  if (!data || output->capacity < output->size + n) {
+    /* Out of room for good, count the rest of the output only. */
+    if (data) output->data = data;
+    output->grow = 0;
+    return 0;
+  }
+  output->data = data;
+  return 1;
+}
+
+void ZopfliAppendOutput(unsigned char value, ZopfliOutput* output) {
+  if (ZopfliReserveOutput(output, 1)) output->data[output->size] = value;
+  output->size++;
+}
+
+/* A worker of ZopfliRunWorkers with the function to run on it. */
+typedef struct ZopfliWorkerTask {
+  ZopfliWorkerFun* fun;
+  void* worker;
+} ZopfliWorkerTask;
+
+#ifdef _WIN32
+static unsigned __stdcall WorkerThread(void* task) {
+  ((ZopfliWorkerTask*)task)->fun(((ZopfliWorkerTask*)task)->worker);
+  return 0;
+}
+#else
+static void* WorkerThread(void* task) {
+  ((ZopfliWorkerTask*)task)->fun(((ZopfliWorkerTask*)task)->worker);
+  return 0;
+}
+#endif
+
+void ZopfliRunWorkers(ZopfliWorkerFun* fun, void* workers, size_t stride,
+                      size_t numworkers) {
+  ZopfliWorkerTask* tasks;
+#ifdef _WIN32
+  HANDLE* threads;
+#else
+  pthread_t* threads;
+  int* started;
+#endif
+  size_t i;
+
+  if (numworkers == 0) return;
+  if (numworkers == 1) {
+    fun(workers);
+    return;
+  }
+
+  tasks = (ZopfliWorkerTask*)malloc(numworkers * sizeof(*tasks));
+#ifdef _WIN32
+  threads = (HANDLE*)malloc(numworkers * sizeof(*threads));
+#else
+  threads = (pthread_t*)malloc(numworkers * sizeof(*threads));
+  started = (int*)malloc(numworkers * sizeof(*started));
+  if (!started) exit(-1);  /* Allocation failed. */
+#endif
+  if (!tasks || !threads) exit(-1);  /* Allocation failed. */
+
+  for (i = 0; i < numworkers; i++) {
+    tasks[i].fun = fun;
+    tasks[i].worker = (char*)workers + i * stride;
+  }
+  for (i = 1; i < numworkers; i++) {
+#ifdef _WIN32
+    threads[i] = (HANDLE)_beginthreadex(0, 0, WorkerThread, &tasks[i], 0, 0);
+#else
+    started[i] = pthread_create(&threads[i], 0, WorkerThread, &tasks[i]) == 0;
+#endif
+  }
+  fun(tasks[0].worker);
+  for (i = 1; i < numworkers; i++) {
+#ifdef _WIN32
+    if (threads[i]) {
+      WaitForSingleObject(threads[i], INFINITE);
+      CloseHandle(threads[i]);
+    } else {
+      fun(tasks[i].worker);
+    }
+#else
+    if (started[i]) {
+      pthread_join(threads[i], 0);
+    } else {
+      fun(tasks[i].worker);
+    }
+#endif
+  }
+
+  free(tasks);
+  free(threads);
+#ifndef _WIN32
+  free(started);
+#endif
+}
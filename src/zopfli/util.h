@@ -28,6 +28,8 @@ basic deflate specification values and generic program options.
 #include <string.h>
 #include <stdlib.h>
 
+#include "zopfli.h"
+
 /* Minimum and maximum length that can be encoded in deflate. */
 #define ZOPFLI_MAX_MATCH 258
 #define ZOPFLI_MIN_MATCH 3
@@ -55,6 +57,14 @@ Set this to, for example, 20MB (20000000). Set it to 0 to disable master blocks.
 */
 #define ZOPFLI_MASTER_BLOCK_SIZE 20000000
 
+/*
+Smallest segment the input is divided into for gzip output with more than one
+thread, see the numthreads option. Each segment costs its own block headers and
+a few bytes to end it at a byte boundary, and loses the matches into the
+previous segment that are further away than the window.
+*/
+#define ZOPFLI_MIN_SEGMENT_SIZE 131072
+
 /*
 Used to initialize costs for example
 */
@@ -102,6 +112,16 @@ This has no effect on the compression result, only on speed.
 */
 #define ZOPFLI_HASH_SAME_HASH
 
+/*
+Enable to count what the longest match search does: longest match cache hits
+and misses, hash chain lengths, searches cut short by ZOPFLI_MAX_CHAIN_HITS,
+switches to the ZOPFLI_HASH_SAME_HASH hash and hash updates. The counts are
+printed per block in verbose mode, to tune ZOPFLI_CACHE_LENGTH and the chain
+limit for a corpus. This has no effect on the compression result, and no cost
+when disabled.
+*/
+/* #define ZOPFLI_COUNTERS */
+
 /*
 Enable this, to avoid slowness for files which are a repetition of the same
 character more than a multiple of ZOPFLI_MAX_MATCH times. This should not affect
@@ -217,8 +237,72 @@ ZOPFLI_UTIL_INLINE int ZopfliGetDistExtraBitsValue(int d) {
 }
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 int ZopfliPrintSizeVerbose(size_t insize, size_t outsize, const char *name);
 
+/*
+Returns a monotonic wall clock time in seconds, for time limits and timing. Only
+differences between two calls are meaningful.
+*/
+double ZopfliGetTime(void);
+
+/*
+Reports a phase event to options->phasecallback, does nothing if it is NULL.
+See ZopfliPhaseEvent for the meaning of the parameters.
+*/
+void ZopfliReportPhase(const ZopfliOptions* options, ZopfliPhase phase,
+                       int end, size_t rangestart, size_t rangeend,
+                       int iteration, double cost);
+
+/*
+An output array the compressed data is written to. It is grown with the grow
+function when it is full. If that gives no more room, further writes are
+dropped, but still counted in size, so that the size needed is known at the end.
+*/
+typedef struct ZopfliOutput {
+  unsigned char* data;
+  size_t size;  /* Amount of bytes output, including the dropped ones. */
+  size_t capacity;  /* Allocated size of data. */
+  ZopfliGrowFun* grow;  /* NULL if data cannot grow (anymore). */
+  void* growcontext;  /* Passed as context to grow. */
+} ZopfliOutput;
+
+/*
+Sets up output to append to a dynamic array of ZOPFLI_APPEND_DATA, growing it in
+the same power of two steps. ZopfliFinishAppendOutput gives the array back.
+*/
+void ZopfliInitAppendOutput(unsigned char* data, size_t size,
+                            ZopfliOutput* output);
+void ZopfliFinishAppendOutput(const ZopfliOutput* output,
+                              unsigned char** data, size_t* size);
+
+/*
+Returns whether there is room for n more bytes in the output, growing it if
+needed. Returns 0 once writes are being dropped.
+*/
+int ZopfliReserveOutput(ZopfliOutput* output, size_t n);
+
+/* Appends a byte to the output. */
+void ZopfliAppendOutput(unsigned char value, ZopfliOutput* output);
+
+/* Does the work of one worker of ZopfliRunWorkers. */
+typedef void ZopfliWorkerFun(void* worker);
+
+/*
+Runs fun on each of the numworkers workers, which are stride bytes apart, each
+on its own thread. The calling thread does the work of the first worker itself,
+and of any worker whose thread cannot be started. Returns when all are done.
+*/
+void ZopfliRunWorkers(ZopfliWorkerFun* fun, void* workers, size_t stride,
+                      size_t numworkers);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
 /*
 Appends value to dynamically allocated memory, doubling its allocation size
 whenever needed.
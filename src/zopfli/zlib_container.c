@@ -22,36 +22,24 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 #include <stdio.h>
 
+#include "adler.h"
 #include "deflate.h"
 
-
-/* Calculates the adler32 checksum of the data */
-static unsigned adler32(const unsigned char* data, size_t size)
-{
-  static const unsigned sums_overflow = 5550;
-  unsigned s1 = 1;
-  unsigned s2 = 1 >> 16;
-
-  while (size > 0) {
-    size_t amount = size > sums_overflow ? sums_overflow : size;
-    size -= amount;
-    while (amount > 0) {
-      s1 += (*data++);
-      s2 += s1;
-      amount--;
-    }
-    s1 %= 65521;
-    s2 %= 65521;
-  }
-
-  return (s2 << 16) | s1;
+/*
+Updates the Adler-32 checksum of ZopfliZlibCompress with a piece of the input.
+type: ZopfliChecksumFun
+*/
+static void UpdateZlibAdler32(const unsigned char* data, size_t size,
+                              void* context) {
+  unsigned* checksum = (unsigned*)context;
+  *checksum = UpdateAdler32(*checksum, data, size);
 }
 
-void ZopfliZlibCompress(const ZopfliOptions* options,
-                        const unsigned char* in, size_t insize,
-                        unsigned char** out, size_t* outsize) {
+void ZopfliZlibCompressOutput(const ZopfliOptions* options,
+                              const unsigned char* in, size_t insize,
+                              ZopfliOutput* out) {
   unsigned char bitpointer = 0;
-  unsigned checksum = adler32(in, (unsigned)insize);
+  unsigned checksum = 1;
   unsigned cmf = 120;  /* CM 8, CINFO 7. See zlib spec.*/
   unsigned flevel = 0;
   unsigned fdict = 0;
@@ -59,18 +47,28 @@ void ZopfliZlibCompress(const ZopfliOptions* options,
   unsigned fcheck = 31 - cmfflg % 31;
   cmfflg += fcheck;
 
-  ZOPFLI_APPEND_DATA(cmfflg / 256, out, outsize);
-  ZOPFLI_APPEND_DATA(cmfflg % 256, out, outsize);
+  ZopfliAppendOutput(cmfflg / 256, out);
+  ZopfliAppendOutput(cmfflg % 256, out);
 
-  ZopfliDeflate(options, 2 /* dynamic block */, 1 /* final */,
-                in, insize, &bitpointer, out, outsize);
+  ZopfliDeflateChecksum(options, 2 /* dynamic block */, 1 /* final */,
+                        in, insize, UpdateZlibAdler32, &checksum,
+                        &bitpointer, out);
 
-  ZOPFLI_APPEND_DATA((checksum >> 24) % 256, out, outsize);
-  ZOPFLI_APPEND_DATA((checksum >> 16) % 256, out, outsize);
-  ZOPFLI_APPEND_DATA((checksum >> 8) % 256, out, outsize);
-  ZOPFLI_APPEND_DATA(checksum % 256, out, outsize);
+  ZopfliAppendOutput((checksum >> 24) % 256, out);
+  ZopfliAppendOutput((checksum >> 16) % 256, out);
+  ZopfliAppendOutput((checksum >> 8) % 256, out);
+  ZopfliAppendOutput(checksum % 256, out);
 
   if (options->verbose) {
-    ZopfliPrintSizeVerbose(insize, *outsize, "Zlib");
+    ZopfliPrintSizeVerbose(insize, out->size, "Zlib");
   }
 }
+
+void ZopfliZlibCompress(const ZopfliOptions* options,
+                        const unsigned char* in, size_t insize,
+                        unsigned char** out, size_t* outsize) {
+  ZopfliOutput output;
+  ZopfliInitAppendOutput(*out, *outsize, &output);
+  ZopfliZlibCompressOutput(options, in, insize, &output);
+  ZopfliFinishAppendOutput(&output, out, outsize);
+}
@@ -43,6 +43,15 @@ void ZopfliZlibCompress(const ZopfliOptions* options,
                         const unsigned char* in, size_t insize,
                         unsigned char** out, size_t* outsize);
 
+/*
+Like ZopfliZlibCompress, but appends the result to out, see ZopfliOutput in
+util.h.
+*/
+struct ZopfliOutput;
+void ZopfliZlibCompressOutput(const ZopfliOptions* options,
+                              const unsigned char* in, size_t insize,
+                              struct ZopfliOutput* out);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
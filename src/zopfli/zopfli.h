@@ -27,6 +27,51 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 extern "C" {
 #endif
 
+/*
+Phases of the compression, reported to ZopfliOptions.phasecallback. Phases can
+nest: e.g. a hash warmup happens inside a greedy pass or an iteration, and a
+block split starts with a greedy pass.
+*/
+typedef enum {
+  ZOPFLI_PHASE_HASH,        /* Setting up the hash with the preceding window */
+  ZOPFLI_PHASE_GREEDY,      /* Greedy LZ77 pass */
+  ZOPFLI_PHASE_ITERATION,   /* One shortest path iteration of the LZ77 */
+  ZOPFLI_PHASE_BLOCKSPLIT,  /* Finding the block split points */
+  ZOPFLI_PHASE_TREE,        /* Huffman code lengths and tree encoding */
+  ZOPFLI_PHASE_OUTPUT       /* Writing the LZ77 data of a block */
+} ZopfliPhase;
+
+/* A phase event, see ZopfliOptions.phasecallback. */
+typedef struct ZopfliPhaseEvent {
+  ZopfliPhase phase;
+
+  /* 0 when the phase begins, 1 when it ends. */
+  int end;
+
+  /* ZopfliGetTime() at the event. */
+  double time;
+
+  /*
+  The range processed by the phase: input bytes, except for the phases that
+  work on LZ77 data (block split after the LZ77, tree and output), for which
+  it is the range in the LZ77 store.
+  */
+  size_t rangestart;
+  size_t rangeend;
+
+  /* Index of the iteration for ZOPFLI_PHASE_ITERATION, -1 otherwise. */
+  int iteration;
+
+  /*
+  Size in bits at the end of the phase: the block size found by an iteration,
+  the size of the tree header, or of the LZ77 data written by the output phase.
+  0 if not known or at the begin.
+  */
+  double cost;
+} ZopfliPhaseEvent;
+
+typedef void ZopfliPhaseCallback(const ZopfliPhaseEvent* event, void* context);
+
 /*
 Options used throughout the program.
 */
@@ -64,6 +109,65 @@ typedef struct ZopfliOptions {
   extreme results that hurt compression on some files). Default value: 15.
   */
   int blocksplittingmax;
+
+  /*
+  Stop the iterations of a block once this many iterations in a row did not
+  improve on the best result found so far. This lets high iteration counts give
+  up early on blocks that stopped converging, such as incompressible data.
+  0 for no limit. Default: 0.
+  */
+  int maxstalliterations;
+
+  /*
+  Maximum wall time in seconds to spend on the iterations of a single block.
+  The best result found when the time is up is used. 0 for no limit.
+  Default: 0.
+  */
+  double blocktimelimit;
+
+  /*
+  Stop the iterations of a block once its size is at or below this many bits
+  per input byte, e.g. 2.0 for a 4:1 ratio. 0 to disable. Default: 0.
+  */
+  double targetbitsperbyte;
+
+  /*
+  Maximum wall time in seconds for a whole compression call. The budget is
+  distributed over master blocks, split blocks and iterations, and the best
+  result found so far is output when the time is up. This does not bound the
+  time of the fast parts such as the initial greedy pass, so the real time can
+  be slightly more. 0 for no limit. Default: 0.
+  */
+  double timelimit;
+
+  /*
+  Size in bytes of the master blocks the input is divided into, each compressed
+  independently, see ZOPFLI_MASTER_BLOCK_SIZE. 0 to use that default. Set it to
+  at least the input size for a single master block. Ignored if
+  ZOPFLI_MASTER_BLOCK_SIZE is 0. Default: 0.
+  */
+  size_t masterblocksize;
+
+  /*
+  Number of threads to compress ZOPFLI_FORMAT_GZIP output with. If more than 1,
+  the input is divided into segments of masterblocksize bytes, or by default
+  into one segment per thread of at least ZOPFLI_MIN_SEGMENT_SIZE bytes, which
+  are compressed in parallel, each with the 32K of input before it as window.
+  The result is a single standard gzip stream, slightly larger than with one
+  thread. The phase callback may then be called from several threads at once.
+  Default: 1.
+  */
+  int numthreads;
+
+  /*
+  If not NULL, called at the begin and end of every compression phase, for
+  progress reporting and timing. Must not be slow, some phases are short.
+  Default: NULL.
+  */
+  ZopfliPhaseCallback* phasecallback;
+
+  /* Passed as context to phasecallback. Default: NULL. */
+  void* phasecontext;
 } ZopfliOptions;
 
 #if defined(__GNUC__)
@@ -85,9 +189,28 @@ ZOPFLI_INLINE void ZopfliInitOptions(ZopfliOptions* options) {
   options->blocksplitting = 1;
   options->blocksplittinglast = 0;
   options->blocksplittingmax = 15;
+  options->maxstalliterations = 0;
+  options->blocktimelimit = 0;
+  options->targetbitsperbyte = 0;
+  options->timelimit = 0;
+  options->masterblocksize = 0;
+  options->numthreads = 1;
+  options->phasecallback = 0;
+  options->phasecontext = 0;
 }
 #endif
 
+/*
+Grows the output buffer of ZopfliCompressBuffer when it is full. Must return a
+buffer of at least needed bytes that starts with the size bytes of data, e.g.
+data resized with realloc, and set *capacity to its size. Return NULL if no
+more room can be given: the compression then goes on without writing, to find
+the size it needs.
+*/
+typedef unsigned char* ZopfliGrowFun(unsigned char* data, size_t size,
+                                     size_t needed, size_t* capacity,
+                                     void* context);
+
 /* Output format */
 typedef enum {
   ZOPFLI_FORMAT_GZIP,
@@ -109,6 +232,36 @@ void ZopfliCompress(const ZopfliOptions* options, ZopfliFormat output_type,
                     const unsigned char* in, size_t insize,
                     unsigned char** out, size_t* outsize);
 
+/*
+Like ZopfliCompress, but writes into a buffer given by the caller rather than
+a dynamic array, e.g. one of ZopfliCompressBound bytes, which is always enough.
+
+out: the buffer to write the result to
+outcapacity: size of out in bytes
+grow: called if out is full to get a larger buffer, may be NULL
+growcontext: passed as context to grow
+result: set to the buffer holding the result, which is out unless grow replaced
+  it, may be NULL
+outsize: set to the size of the result, or to the size that would have been
+  needed if the buffer was too small
+return: 1 if the result fit in the buffer, 0 if not
+*/
+int ZopfliCompressBuffer(const ZopfliOptions* options,
+                         ZopfliFormat output_type,
+                         const unsigned char* in, size_t insize,
+                         unsigned char* out, size_t outcapacity,
+                         ZopfliGrowFun* grow, void* growcontext,
+                         unsigned char** result, size_t* outsize);
+
+/*
+Returns the largest size ZopfliCompress and ZopfliCompressBuffer can output for
+insize bytes of input with these options. Zopfli does not fall back to stored
+blocks, so this allows for the worst case of 9 bits per byte, as for a literal
+in the fixed code, which is about 1.125 times insize plus the block headers.
+*/
+size_t ZopfliCompressBound(const ZopfliOptions* options,
+                           ZopfliFormat output_type, size_t insize);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -0,0 +1,442 @@
+/*
+Copyright 2011 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Author: lode.vandevenne@gmail.com (Lode Vandevenne)
+Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
+*/
+
+/*
+Zopfli benchmark program. Compresses a corpus of files, given as files and
+directories, with every combination of a grid of options, and prints the
+speed, output size, peak memory and the time spent in each compression phase
+as JSON on stdout, to compare the performance of different versions.
+*/
+
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 500  /* For opendir, stat and getrusage with -ansi. */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#endif
+
+#include "util.h"
+#include "crc.h"
+#include "zopfli.h"
+
+/* Maximum amount of values of each option in the grid. */
+#define MAX_GRID 16
+
+#define NUM_PHASES (ZOPFLI_PHASE_OUTPUT + 1)
+
+static const char* const kPhaseNames[NUM_PHASES] = {
+  "hash", "greedy", "iteration", "blocksplit", "tree", "output"
+};
+
+static const char* const kSplitNames[3] = { "none", "first", "last" };
+
+/* A file of the corpus, loaded in memory so that reading it is not timed. */
+typedef struct BenchFile {
+  char* name;
+  unsigned char* data;
+  size_t size;
+} BenchFile;
+
+/*
+Time spent in each phase, accumulated from the ZopfliOptions.phasecallback
+events. Phases nest, so these are inclusive: e.g. the greedy time includes the
+hash time of the greedy passes.
+*/
+typedef struct PhaseTimes {
+  double begin[NUM_PHASES];
+  double total[NUM_PHASES];
+} PhaseTimes;
+
+static void PhaseCallback(const ZopfliPhaseEvent* event, void* context) {
+  PhaseTimes* times = (PhaseTimes*)context;
+  if (event->end) {
+    times->total[event->phase] += event->time - times->begin[event->phase];
+  } else {
+    times->begin[event->phase] = event->time;
+  }
+}
+
+/* Returns the peak resident memory of the process so far, in KiB. */
+static size_t PeakMemoryKiB(void) {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(),
+                            &counters, sizeof(counters))) {
+    return 0;
+  }
+  return counters.PeakWorkingSetSize / 1024;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return (size_t)usage.ru_maxrss / 1024;  /* In bytes on Mac OS X. */
+#else
+  return (size_t)usage.ru_maxrss;
+#endif
+#endif
+}
+
+/*
+Loads a file into a memory array. Returns 0 if it can't be read.
+*/
+static int LoadFile(const char* filename,
+                    unsigned char** out, size_t* outsize) {
+  FILE* file;
+  long size;
+
+  *out = 0;
+  *outsize = 0;
+  file = fopen(filename, "rb");
+  if (!file) return 0;
+
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  rewind(file);
+  if (size < 0) {
+    fclose(file);
+    return 0;
+  }
+
+  *outsize = (size_t)size;
+  *out = (unsigned char*)malloc(*outsize ? *outsize : 1);
+  if (!*out) exit(-1); /* Allocation failed. */
+
+  if (fread(*out, 1, *outsize, file) != *outsize) {
+    free(*out);
+    *out = 0;
+    *outsize = 0;
+    fclose(file);
+    return 0;
+  }
+
+  fclose(file);
+  return 1;
+}
+
+/* Returns a copy of the string. Result must be freed. */
+static char* CopyString(const char* str) {
+  char* result = (char*)malloc(strlen(str) + 1);
+  if (!result) exit(-1); /* Allocation failed. */
+  strcpy(result, str);
+  return result;
+}
+
+/*
+Add two strings together with a path separator in between. Result must be
+freed.
+*/
+static char* JoinPath(const char* dir, const char* name) {
+  size_t len = strlen(dir) + 1 + strlen(name);
+  char* result = (char*)malloc(len + 1);
+  if (!result) exit(-1); /* Allocation failed. */
+  strcpy(result, dir);
+#ifdef _WIN32
+  strcat(result, "\\");
+#else
+  strcat(result, "/");
+#endif
+  strcat(result, name);
+  return result;
+}
+
+/* Loads the file and appends it to the corpus. Takes ownership of name. */
+static void AddFile(char* name, BenchFile** files, size_t* numfiles) {
+  BenchFile file;
+  if (!LoadFile(name, &file.data, &file.size)) {
+    fprintf(stderr, "Error: could not read %s\n", name);
+    free(name);
+    return;
+  }
+  file.name = name;
+  ZOPFLI_APPEND_DATA(file, files, numfiles);
+}
+
+/*
+Appends the regular files directly in the directory to the corpus, or the
+path itself if it is not a directory.
+*/
+static void AddPath(const char* path, BenchFile** files, size_t* numfiles) {
+#ifdef _WIN32
+  WIN32_FIND_DATAA found;
+  HANDLE handle;
+  char* pattern;
+  DWORD attributes = GetFileAttributesA(path);
+  if (attributes == INVALID_FILE_ATTRIBUTES ||
+      !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+    AddFile(CopyString(path), files, numfiles);
+    return;
+  }
+  pattern = JoinPath(path, "*");
+  handle = FindFirstFileA(pattern, &found);
+  free(pattern);
+  if (handle == INVALID_HANDLE_VALUE) return;
+  do {
+    if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+    AddFile(JoinPath(path, found.cFileName), files, numfiles);
+  } while (FindNextFileA(handle, &found));
+  FindClose(handle);
+#else
+  struct dirent* entry;
+  DIR* dir = opendir(path);
+  if (!dir) {
+    AddFile(CopyString(path), files, numfiles);
+    return;
+  }
+  while ((entry = readdir(dir)) != 0) {
+    struct stat st;
+    char* name = JoinPath(path, entry->d_name);
+    if (stat(name, &st) != 0 || !S_ISREG(st.st_mode)) {
+      free(name);
+      continue;
+    }
+    AddFile(name, files, numfiles);
+  }
+  closedir(dir);
+#endif
+}
+
+/*
+Parses a comma separated list of numbers into values. Returns the amount of
+values, or 0 if the list is invalid.
+*/
+static int ParseList(const char* list, size_t* values) {
+  int n = 0;
+  while (*list) {
+    char* end;
+    unsigned long value = strtoul(list, &end, 10);
+    if (end == list || n == MAX_GRID) return 0;
+    values[n++] = value;
+    if (*end == ',') end++;
+    else if (*end) return 0;
+    list = end;
+  }
+  return n;
+}
+
+/*
+Parses a comma separated list of block splitting modes, by index in
+kSplitNames. Returns the amount of values, or 0 if the list is invalid.
+*/
+static int ParseSplitList(const char* list, size_t* values) {
+  int n = 0;
+  while (*list) {
+    size_t len = strcspn(list, ",");
+    size_t i;
+    if (n == MAX_GRID) return 0;
+    for (i = 0; i < 3; i++) {
+      if (strlen(kSplitNames[i]) == len &&
+          strncmp(list, kSplitNames[i], len) == 0) break;
+    }
+    if (i == 3) return 0;
+    values[n++] = i;
+    list += len;
+    if (*list == ',') list++;
+  }
+  return n;
+}
+
+/* Prints the string as a JSON string literal. */
+static void PrintJsonString(const char* str) {
+  putchar('"');
+  for (; *str; str++) {
+    unsigned char c = (unsigned char)*str;
+    if (c == '"' || c == '\\') printf("\\%c", c);
+    else if (c < 0x20) printf("\\u%04x", c);
+    else putchar(c);
+  }
+  putchar('"');
+}
+
+static char StringsEqual(const char* str1, const char* str2) {
+  return strcmp(str1, str2) == 0;
+}
+
+int main(int argc, char* argv[]) {
+  ZopfliFormat output_type = ZOPFLI_FORMAT_DEFLATE;
+  const char* formatname = "deflate";
+  size_t iterations[MAX_GRID] = { 15 };
+  size_t splits[MAX_GRID] = { 1 };
+  size_t masters[MAX_GRID] = { 0 };
+  int numiterations = 1, numsplits = 1, nummasters = 1;
+  int verbose = 0;
+  BenchFile* files = 0;
+  size_t numfiles = 0;
+  int firstrun = 1;
+  int i, j, k, p;
+  size_t f;
+
+  for (i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (StringsEqual(arg, "-v")) verbose = 1;
+    else if (StringsEqual(arg, "--deflate")) {
+      output_type = ZOPFLI_FORMAT_DEFLATE;
+      formatname = "deflate";
+    } else if (StringsEqual(arg, "--zlib")) {
+      output_type = ZOPFLI_FORMAT_ZLIB;
+      formatname = "zlib";
+    } else if (StringsEqual(arg, "--gzip")) {
+      output_type = ZOPFLI_FORMAT_GZIP;
+      formatname = "gzip";
+    } else if (strncmp(arg, "--i=", 4) == 0) {
+      numiterations = ParseList(arg + 4, iterations);
+    } else if (strncmp(arg, "--split=", 8) == 0) {
+      numsplits = ParseSplitList(arg + 8, splits);
+    } else if (strncmp(arg, "--master=", 9) == 0) {
+      nummasters = ParseList(arg + 9, masters);
+    } else if (StringsEqual(arg, "-h")) {
+      fprintf(stderr,
+          "Usage: zopfli_bench [OPTION]... FILE|DIRECTORY...\n"
+          "Compresses every file, and every file directly in each directory,"
+          " with each combination of the options and prints the results as"
+          " JSON.\n"
+          "  -h    gives this help\n"
+          "  -v    print progress on standard error\n"
+          "  --i=#,#...          iteration counts to run (default 15)\n"
+          "  --split=MODE,...    block splitting: none, first or last"
+          " (default first)\n"
+          "  --master=#,#...     master block sizes in bytes, 0 for the"
+          " default (default 0)\n");
+      fprintf(stderr,
+          "  --deflate           output deflate format (default)\n"
+          "  --zlib              output zlib format\n"
+          "  --gzip              output gzip format\n"
+          "Peak memory is that of the whole process so far, run one"
+          " combination at a time to compare it.\n");
+      return 0;
+    } else if (arg[0] == '-') {
+      fprintf(stderr, "Error: unknown option %s\n", arg);
+      return 1;
+    }
+  }
+
+  if (numiterations == 0 || numsplits == 0 || nummasters == 0) {
+    fprintf(stderr, "Error: invalid option list\n");
+    return 1;
+  }
+  for (i = 0; i < numiterations; i++) {
+    if (iterations[i] < 1) {
+      fprintf(stderr, "Error: must have 1 or more iterations\n");
+      return 1;
+    }
+  }
+
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] != '-') AddPath(argv[i], &files, &numfiles);
+  }
+  if (numfiles == 0) {
+    fprintf(stderr,
+            "Please provide files or directories\nFor help, type: %s -h\n",
+            argv[0]);
+    return 1;
+  }
+
+  MakeCRCTable();
+
+  printf("{\n  \"format\": \"%s\",\n  \"runs\": [", formatname);
+  for (i = 0; i < numiterations; i++) {
+    for (j = 0; j < numsplits; j++) {
+      for (k = 0; k < nummasters; k++) {
+        ZopfliOptions options;
+        PhaseTimes times;
+        size_t totalin = 0, totalout = 0;
+        double totaltime = 0;
+
+        ZopfliInitOptions(&options);
+        options.numiterations = (int)iterations[i];
+        options.blocksplitting = splits[j] != 0;
+        options.blocksplittinglast = splits[j] == 2;
+        options.masterblocksize = masters[k];
+        options.phasecallback = PhaseCallback;
+        options.phasecontext = &times;
+        memset(&times, 0, sizeof(times));
+
+        printf("%s\n    {\n", firstrun ? "" : ",");
+        firstrun = 0;
+        printf("      \"iterations\": %d,\n", options.numiterations);
+        printf("      \"splitting\": \"%s\",\n", kSplitNames[splits[j]]);
+        printf("      \"masterblocksize\": %lu,\n", (unsigned long)masters[k]);
+        printf("      \"files\": [");
+
+        for (f = 0; f < numfiles; f++) {
+          unsigned char* out = 0;
+          size_t outsize = 0;
+          double start, seconds;
+          if (verbose) {
+            fprintf(stderr, "i%d %s m%lu: %s\n", options.numiterations,
+                    kSplitNames[splits[j]], (unsigned long)masters[k],
+                    files[f].name);
+          }
+          start = ZopfliGetTime();
+          ZopfliCompress(&options, output_type,
+                         files[f].data, files[f].size, &out, &outsize);
+          seconds = ZopfliGetTime() - start;
+          free(out);
+
+          totalin += files[f].size;
+          totalout += outsize;
+          totaltime += seconds;
+          printf("%s\n        {\"name\": ", f == 0 ? "" : ",");
+          PrintJsonString(files[f].name);
+          printf(", \"inputbytes\": %lu, \"outputbytes\": %lu,"
+                 " \"seconds\": %.6f}",
+                 (unsigned long)files[f].size, (unsigned long)outsize,
+                 seconds);
+        }
+
+        printf("\n      ],\n");
+        printf("      \"inputbytes\": %lu,\n", (unsigned long)totalin);
+        printf("      \"outputbytes\": %lu,\n", (unsigned long)totalout);
+        printf("      \"seconds\": %.6f,\n", totaltime);
+        printf("      \"mbps\": %.6f,\n",
+               totaltime > 0 ? totalin / 1000000.0 / totaltime : 0.0);
+        printf("      \"peakmemorykib\": %lu,\n",
+               (unsigned long)PeakMemoryKiB());
+        printf("      \"phaseseconds\": {");
+        for (p = 0; p < NUM_PHASES; p++) {
+          printf("%s\"%s\": %.6f", p == 0 ? "" : ", ",
+                 kPhaseNames[p], times.total[p]);
+        }
+        printf("}\n    }");
+        fflush(stdout);
+      }
+    }
+  }
+  printf("\n  ]\n}\n");
+
+  for (f = 0; f < numfiles; f++) {
+    free(files[f].name);
+    free(files[f].data);
+  }
+  free(files);
+
+  return 0;
+}
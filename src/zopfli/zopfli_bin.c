@@ -24,11 +24,27 @@ decompress. Decompression can be done by any standard gzip, zlib or deflate
 decompressor.
 */
 
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 600  /* For mmap and posix_madvise with -ansi. */
+#endif
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "crc.h"
 #include "deflate.h"
 #include "gzip_container.h"
 #include "zlib_container.h"
@@ -65,6 +81,88 @@ static void LoadFile(const char* filename,
   fclose(file);
 }
 
+/*
+A file mapped into memory by MapFile, or loaded with LoadFile if mapping it
+failed.
+*/
+typedef struct MappedFile {
+  unsigned char* data;
+  size_t size;
+  int mapped;  /* Whether data is mapped, rather than allocated by LoadFile. */
+#ifdef _WIN32
+  HANDLE mapping;
+#endif
+} MappedFile;
+
+/*
+Maps a file into memory read-only, so that it does not take memory of its own
+besides the page cache, and only is read from disk as the compression gets to
+it. Falls back to LoadFile for what cannot be mapped, such as pipes or empty
+files. file->size is 0 if the file could not be read at all.
+*/
+static void MapFile(const char* filename, MappedFile* file) {
+#ifdef _WIN32
+  HANDLE handle;
+  LARGE_INTEGER size;
+  file->mapped = 0;
+  file->mapping = 0;
+  handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (handle != INVALID_HANDLE_VALUE) {
+    if (GetFileSizeEx(handle, &size) && size.QuadPart > 0 &&
+        (unsigned __int64)size.QuadPart <= (size_t)-1) {
+      file->mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY,
+                                         0, 0, NULL);
+      if (file->mapping) {
+        file->data = (unsigned char*)MapViewOfFile(file->mapping,
+                                                   FILE_MAP_READ, 0, 0, 0);
+        if (file->data) {
+          file->size = (size_t)size.QuadPart;
+          file->mapped = 1;
+        } else {
+          CloseHandle(file->mapping);
+        }
+      }
+    }
+    CloseHandle(handle);
+  }
+#else
+  int fd;
+  struct stat st;
+  file->mapped = 0;
+  fd = open(filename, O_RDONLY);
+  if (fd >= 0) {
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        st.st_size == (off_t)(size_t)st.st_size) {
+      void* data = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        file->data = (unsigned char*)data;
+        file->size = (size_t)st.st_size;
+        file->mapped = 1;
+        /* Master blocks are compressed front to back. */
+        posix_madvise(data, file->size, POSIX_MADV_SEQUENTIAL);
+      }
+    }
+    close(fd);
+  }
+#endif
+  if (!file->mapped) LoadFile(filename, &file->data, &file->size);
+}
+
+/* Releases a file of MapFile. */
+static void UnmapFile(MappedFile* file) {
+  if (!file->mapped) {
+    free(file->data);
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(file->data);
+  CloseHandle(file->mapping);
+#else
+  munmap(file->data, file->size);
+#endif
+}
+
 /*
 Saves a file from a memory array, overwriting the file if it existed.
 */
@@ -83,30 +181,31 @@ static void CompressFile(const ZopfliOptions* options,
                          ZopfliFormat output_type,
                          const char* infilename,
                          const char* outfilename) {
-  unsigned char* in;
-  size_t insize;
+  MappedFile in;
   unsigned char* out = 0;
   size_t outsize = 0;
-  LoadFile(infilename, &in, &insize);
-  if (insize == 0) {
+  MapFile(infilename, &in);
+  if (in.size == 0) {
     fprintf(stderr, "Invalid filename: %s\n", infilename);
+    UnmapFile(&in);
     return;
   }
 
-  ZopfliCompress(options, output_type, in, insize, &out, &outsize);
+  ZopfliCompress(options, output_type, in.data, in.size, &out, &outsize);
 
   if (outfilename) {
     SaveFile(outfilename, out, outsize);
   } else {
-    size_t i;
-    for (i = 0; i < outsize; i++) {
-      /* Works only if terminal does not convert newlines. */
-      printf("%c", out[i]);
-    }
+#ifdef _WIN32
+    /* Do not convert newlines. */
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    fwrite(out, 1, outsize, stdout);
+    fflush(stdout);
   }
 
   free(out);
-  free(in);
+  UnmapFile(&in);
 }
 
 /*
@@ -148,6 +247,18 @@ int main(int argc, char* argv[]) {
         && arg[3] >= '0' && arg[3] <= '9') {
       options.numiterations = atoi(arg + 3);
     }
+    else if (strncmp(arg, "--stall", 7) == 0
+        && arg[7] >= '0' && arg[7] <= '9') {
+      options.maxstalliterations = atoi(arg + 7);
+    }
+    else if (strncmp(arg, "--time", 6) == 0
+        && arg[6] >= '0' && arg[6] <= '9') {
+      options.timelimit = atof(arg + 6);
+    }
+    else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 't'
+        && arg[3] >= '0' && arg[3] <= '9') {
+      options.numthreads = atoi(arg + 3);
+    }
     else if (StringsEqual(arg, "-h")) {
       fprintf(stderr,
           "Usage: zopfli [OPTION]... FILE\n"
@@ -157,12 +268,18 @@ int main(int argc, char* argv[]) {
           "  -v    verbose mode\n"
           "  --i#  perform # iterations (default 15). More gives"
           " more compression but is slower."
-          " Examples: --i10, --i50, --i1000\n");
+          " Examples: --i10, --i50, --i1000\n"
+          "  --stall#  stop iterating a block after # iterations without"
+          " improvement (default 0: never)\n"
+          "  --time#   compress each file in at most about # seconds, keeping"
+          " the best result found so far (default 0: no limit)\n");
       fprintf(stderr,
           "  --gzip        output to gzip format (default)\n"
           "  --zlib        output to zlib format instead of gzip\n"
           "  --deflate     output to deflate format instead of gzip\n"
-          "  --splitlast   do block splitting last instead of first\n");
+          "  --splitlast   do block splitting last instead of first\n"
+          "  --t#          compress gzip output on # threads (default 1),"
+          " slightly less compression\n");
       return 0;
     }
   }
@@ -21,22 +21,104 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 #include "deflate.h"
 #include "gzip_container.h"
+#include "util.h"
 #include "zlib_container.h"
 
 #include <assert.h>
 
-void ZopfliCompress(const ZopfliOptions* options, ZopfliFormat output_type,
-                    const unsigned char* in, size_t insize,
-                    unsigned char** out, size_t* outsize) {
+/*
+Compresses according to the given output format and appends the result to out.
+*/
+static void Compress(const ZopfliOptions* options, ZopfliFormat output_type,
+                     const unsigned char* in, size_t insize,
+                     ZopfliOutput* out) {
   if (output_type == ZOPFLI_FORMAT_GZIP) {
-    ZopfliGzipCompress(options, in, insize, out, outsize);
+    ZopfliGzipCompressOutput(options, in, insize, out);
   } else if (output_type == ZOPFLI_FORMAT_ZLIB) {
-    ZopfliZlibCompress(options, in, insize, out, outsize);
+    ZopfliZlibCompressOutput(options, in, insize, out);
   } else if (output_type == ZOPFLI_FORMAT_DEFLATE) {
     unsigned char bp = 0;
-    ZopfliDeflate(options, 2 /* Dynamic block */, 1,
-                  in, insize, &bp, out, outsize);
+    ZopfliDeflateChecksum(options, 2 /* Dynamic block */, 1,
+                          in, insize, 0, 0, &bp, out);
   } else {
     assert(0);
   }
 }
+
+void ZopfliCompress(const ZopfliOptions* options, ZopfliFormat output_type,
+                    const unsigned char* in, size_t insize,
+                    unsigned char** out, size_t* outsize) {
+  ZopfliOutput output;
+  ZopfliInitAppendOutput(*out, *outsize, &output);
+  Compress(options, output_type, in, insize, &output);
+  ZopfliFinishAppendOutput(&output, out, outsize);
+}
+
+int ZopfliCompressBuffer(const ZopfliOptions* options,
+                         ZopfliFormat output_type,
+                         const unsigned char* in, size_t insize,
+                         unsigned char* out, size_t outcapacity,
+                         ZopfliGrowFun* grow, void* growcontext,
+                         unsigned char** result, size_t* outsize) {
+  ZopfliOutput output;
+  output.data = out;
+  output.size = 0;
+  output.capacity = outcapacity;
+  output.grow = grow;
+  output.growcontext = growcontext;
+  Compress(options, output_type, in, insize, &output);
+  if (result) *result = output.data;
+  *outsize = output.size;
+  return output.size <= output.capacity;
+}
+
+size_t ZopfliCompressBound(const ZopfliOptions* options,
+                           ZopfliFormat output_type, size_t insize) {
+  size_t masterblocksize = options->masterblocksize
+      ? options->masterblocksize : ZOPFLI_MASTER_BLOCK_SIZE;
+  size_t numparts = 1;
+  size_t numblocks;
+  size_t result;
+#if ZOPFLI_MASTER_BLOCK_SIZE != 0
+  if (insize > 0) numparts = (insize + masterblocksize - 1) / masterblocksize;
+#endif
+  (void)masterblocksize;
+  if (output_type == ZOPFLI_FORMAT_GZIP && options->numthreads > 1) {
+    /* The segments of parallel compression, see GzipSegmentSize. */
+    size_t numsegments = insize / ZOPFLI_MIN_SEGMENT_SIZE + 1;
+    if (options->masterblocksize) {
+      numsegments = insize / options->masterblocksize + 1;
+    }
+    if (numsegments > numparts) numparts = numsegments;
+  }
+  numblocks = numparts;
+  if (options->blocksplitting) {
+    /* Split blocks have at least 2 LZ77 symbols, so 2 bytes, each. */
+    numblocks *= options->blocksplittingmax > 0
+        ? (size_t)options->blocksplittingmax : insize / 2 + 1;
+  }
+
+  /*
+  Per block: 3 header bits and a tree of at most 2283 bits (14 bits of counts,
+  19 * 3 bits of code length code lengths, and 316 code lengths of at most 7
+  bits). The symbols of a block cost no more than in the fixed code, since the
+  dynamic code is an optimal length-limited code for their counts and the fixed
+  code is one such code. In the fixed code the end symbol costs 7 bits and a
+  literal at most 9 bits. A match costs less than 9 bits per byte: at most
+  7 + 5 + 13 = 25 bits for length 3, and no more than 8 + 5 + 5 + 13 = 31 bits
+  for the longer lengths from 11 on. So a block is at most 2293 bits, within 287
+  bytes, plus 9 bits per input byte.
+  */
+  result = numblocks * 287 + insize + (insize + 7) / 8;
+
+  if (output_type == ZOPFLI_FORMAT_GZIP) {
+    result += 18;  /* Header and trailer. */
+    if (options->numthreads > 1) {
+      /* Each segment ends with an empty stored block of at most 6 bytes. */
+      result += numparts * 6;
+    }
+  } else if (output_type == ZOPFLI_FORMAT_ZLIB) {
+    result += 6;  /* Header and Adler-32. */
+  }
+  return result;
+}
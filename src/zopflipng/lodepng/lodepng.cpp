@@ -32,6 +32,7 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef _MSC_VER
 #ifdef __cplusplus
@@ -65,6 +66,19 @@ unsigned long __cdecl _byteswap_ulong(unsigned long)
 #include <fstream>
 #endif /*LODEPNG_COMPILE_CPP*/
 
+/*vector instructions for filtering and unfiltering, see filterVector and unfilterVector*/
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LODEPNG_NEON
+#include <arm_neon.h>
+#elif (defined(_MSC_VER) && _MSC_VER >= 1500 && (defined(_M_IX86) || defined(_M_X64))) || \
+      (defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)))
+#define LODEPNG_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
 #define VERSION_STRING "20130415"
 
 /*
@@ -243,6 +257,15 @@ static void ucvector_init_buffer(ucvector* p, unsigned char* buffer, size_t size
 }
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
+#ifdef LODEPNG_COMPILE_DECODER
+/*a piece of compressed data, data that is split over several spans is decompressed as if it were concatenated*/
+typedef struct InflateSpan
+{
+  const unsigned char* data;
+  size_t size;
+} InflateSpan;
+#endif /*LODEPNG_COMPILE_DECODER*/
+
 #if (defined(LODEPNG_COMPILE_PNG) && defined(LODEPNG_COMPILE_ANCILLARY_CHUNKS)) || defined(LODEPNG_COMPILE_ENCODER)
 /*returns 1 if success, 0 if failure ==> nothing done*/
 static unsigned ucvector_push_back(ucvector* p, unsigned char c)
@@ -476,25 +499,121 @@ static void addBitsToStream(size_t* bitpointer, ucvector* bitstream, unsigned va
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-#define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
+/*
+Bit reader of the decoder. The input is loaded a byte at a time into a buffer
+of the size of a pointer, from which the bits are taken lsb first, so that most
+symbols and their extra bits can be read without going back to the input.
+The input may be scattered over several spans, such as the IDAT chunks of a PNG,
+which are read one after the other without copying them together first.
+Past the end of the input, zero bits are loaded and counted in overrun, so that
+reading too far is detected afterwards, see BITREADER_PAST_END.
+*/
+typedef struct BitReader
+{
+  const unsigned char* data; /*the span that is being read*/
+  size_t size; /*size of data in bytes*/
+  size_t pos; /*next byte of data to load into the buffer*/
+  const InflateSpan* next; /*the spans after data*/
+  size_t numnext; /*amount of spans in next*/
+  size_t buffer; /*loaded bits that are not used yet, the next one is the lsb*/
+  unsigned bits; /*amount of loaded bits in buffer*/
+  unsigned overrun; /*amount of zero bits loaded past the end of data*/
+} BitReader;
+
+/*the amount of bits that can always be read after ensureBits: 25 or 57*/
+#define BITREADER_MIN_BITS (sizeof(size_t) * 8 - 7)
+
+/*whether bits past the end of the input were read*/
+#define BITREADER_PAST_END(reader) ((reader)->overrun > (reader)->bits)
 
-static unsigned char readBitFromStream(size_t* bitpointer, const unsigned char* bitstream)
+/*goes on with the next span of the input, there must be one*/
+static void BitReader_nextSpan(BitReader* reader)
 {
-  unsigned char result = (unsigned char)(READBIT(*bitpointer, bitstream));
-  (*bitpointer)++;
-  return result;
+  reader->data = reader->next->data;
+  reader->size = reader->next->size;
+  reader->pos = 0;
+  reader->next++;
+  reader->numnext--;
 }
 
-static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bitstream, size_t nbits)
+/*loads as many whole bytes as fit in the buffer*/
+static void fillBits(BitReader* reader)
 {
-  unsigned result = 0, i;
-  for(i = 0; i < nbits; i++)
+  while(reader->bits <= sizeof(size_t) * 8 - 8)
   {
-    result += ((unsigned)READBIT(*bitpointer, bitstream)) << i;
-    (*bitpointer)++;
+    if(reader->pos < reader->size) reader->buffer |= (size_t)reader->data[reader->pos++] << reader->bits;
+    else if(reader->numnext)
+    {
+      BitReader_nextSpan(reader);
+      continue;
+    }
+    else reader->overrun += 8;
+    reader->bits += 8;
   }
+}
+
+/*makes sure there are at least nbits in the buffer, nbits must be at most BITREADER_MIN_BITS*/
+#define ensureBits(reader, nbits) { if((reader)->bits < (nbits)) fillBits(reader); }
+
+/*starts reading the numspans spans one after the other*/
+static void BitReader_init(BitReader* reader, const InflateSpan* spans, size_t numspans)
+{
+  reader->data = 0;
+  reader->size = 0;
+  reader->pos = 0;
+  reader->next = spans;
+  reader->numnext = numspans;
+  reader->buffer = 0;
+  reader->bits = 0;
+  reader->overrun = 0;
+  fillBits(reader);
+}
+
+/*takes nbits (at most 25) from the buffer, which must have been ensured before*/
+static unsigned readBits(BitReader* reader, unsigned nbits)
+{
+  unsigned result = (unsigned)reader->buffer & ((1u << nbits) - 1u);
+  reader->buffer >>= nbits;
+  reader->bits -= nbits;
   return result;
 }
+
+/*skips the bits up to the next byte boundary*/
+static void BitReader_alignToByte(BitReader* reader)
+{
+  readBits(reader, reader->bits & 7u);
+}
+
+/*
+copies the next num bytes to out, the reader must be at a byte boundary.
+The bytes still in the buffer come first, the others are copied from the
+spans directly. Returns 0 if the input ends before that.
+*/
+static unsigned BitReader_readBytes(BitReader* reader, unsigned char* out, size_t num)
+{
+  while(num > 0 && reader->bits > reader->overrun)
+  {
+    *out++ = (unsigned char)readBits(reader, 8);
+    num--;
+  }
+  /*the buffer is empty now if any bytes are left to copy*/
+  while(num > 0)
+  {
+    size_t amount = reader->size - reader->pos;
+    if(amount == 0)
+    {
+      if(!reader->numnext) return 0;
+      BitReader_nextSpan(reader);
+      continue;
+    }
+    if(amount > num) amount = num;
+    __movsb(out, &reader->data[reader->pos], amount);
+    out += amount;
+    reader->pos += amount;
+    num -= amount;
+  }
+  return 1;
+}
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -543,11 +662,16 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+  /*
+  the lookup table used by the decoder, indexed by the next FIRSTBITS bits of
+  the input, with subtables for longer codes behind it, see HuffmanTree_makeTable
+  */
+  unsigned char* table_len; /*length of the code, or the total length for a subtable*/
+  unsigned short* table_value; /*the symbol, or the start of the subtable*/
 } HuffmanTree;
 
 /*function used for debug purposes to draw the tree in ascii art with C++*/
@@ -565,73 +689,131 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
   lodepng_free(tree->tree1d);
   lodepng_free(tree->lengths);
+  lodepng_free(tree->table_len);
+  lodepng_free(tree->table_value);
+}
+
+/*amount of input bits the first lookup of the decoder is done with*/
+#define FIRSTBITS 9u
+
+/*marks an entry of the lookup table for which there is no code*/
+#define INVALIDSYMBOL 65535u
+
+/*returns the lowest num bits of bits in reverse order, num is at most 16*/
+static unsigned reverseBits(unsigned bits, unsigned num)
+{
+  bits = ((bits & 0x5555u) << 1) | ((bits >> 1) & 0x5555u);
+  bits = ((bits & 0x3333u) << 2) | ((bits >> 2) & 0x3333u);
+  bits = ((bits & 0x0f0fu) << 4) | ((bits >> 4) & 0x0f0fu);
+  bits = ((bits & 0x00ffu) << 8) | ((bits >> 8) & 0x00ffu);
+  return bits >> (16 - num);
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+/*
+The tree representation used by the decoder, a lookup table. return value is
+error.
+The first 2^FIRSTBITS entries are indexed by the next FIRSTBITS bits of the
+input, which is the code in reverse since the bits come lsb first. An entry for
+a code of at most FIRSTBITS bits gives its length and symbol. Codes that are
+longer share their first FIRSTBITS bits with others, the entry for those gives
+the longest length among them and the start of a subtable that is indexed by
+the bits after the first FIRSTBITS.
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
+  static const unsigned headsize = 1u << FIRSTBITS;
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  unsigned maxlens[1u << FIRSTBITS];
+  unsigned long kraft = 0;
+  size_t i, size, pointer;
+
+  /*an oversubscribed code has no tree, see comment in lodepng_error_text*/
+  for(i = 0; i < tree->numcodes; i++)
+  {
+    if(tree->lengths[i]) kraft += 1ul << (15 - tree->lengths[i]);
+  }
+  if(kraft > (1ul << 15)) return 55;
+
+  /*the subtables are as large as needed for the longest code that uses them*/
+  for(i = 0; i < headsize; i++) maxlens[i] = 0;
+  for(i = 0; i < tree->numcodes; i++)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned index;
+    if(l <= FIRSTBITS) continue;
+    index = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+    if(l > maxlens[index]) maxlens[index] = l;
+  }
+  size = headsize;
+  for(i = 0; i < headsize; i++)
+  {
+    if(maxlens[i] > FIRSTBITS) size += 1u << (maxlens[i] - FIRSTBITS);
+  }
 
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
+  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(*tree->table_len));
+  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(*tree->table_value));
+  if(!tree->table_len || !tree->table_value) return 83; /*alloc fail*/
 
   /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
+  entries without a code take no bits and give INVALIDSYMBOL, also in the
+  subtables, whose bits are only taken after the first FIRSTBITS
   */
-  for(n = 0; n < tree->numcodes * 2; n++)
+  for(i = 0; i < size; i++)
+  {
+    tree->table_len[i] = i < headsize ? 0 : FIRSTBITS;
+    tree->table_value[i] = INVALIDSYMBOL;
+  }
+
+  pointer = headsize;
+  for(i = 0; i < headsize; i++)
   {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+    unsigned l = maxlens[i];
+    if(l <= FIRSTBITS) continue;
+    tree->table_len[i] = l;
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += 1u << (l - FIRSTBITS);
   }
 
-  for(n = 0; n < tree->numcodes; n++) /*the codes*/
+  for(i = 0; i < tree->numcodes; i++)
   {
-    for(i = 0; i < tree->lengths[n]; i++) /*the bits for this code*/
+    unsigned l = tree->lengths[i];
+    unsigned reverse, j, num;
+    if(!l) continue;
+    reverse = reverseBits(tree->tree1d[i], l);
+    if(l <= FIRSTBITS)
     {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      if(treepos > tree->numcodes - 2) return 55; /*oversubscribed, see comment in lodepng_error_text*/
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+      /*all entries of which the first l bits are the code*/
+      num = 1u << (FIRSTBITS - l);
+      for(j = 0; j < num; j++)
       {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          nodefilled++;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
+        unsigned index = reverse | (j << l);
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      unsigned start = tree->table_value[reverse & mask];
+      unsigned sublen = tree->table_len[reverse & mask] - FIRSTBITS;
+      unsigned rest = reverse >> FIRSTBITS;
+      num = 1u << (sublen - (l - FIRSTBITS));
+      for(j = 0; j < num; j++)
+      {
+        unsigned index = start + (rest | (j << (l - FIRSTBITS)));
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
       }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
     }
-  }
-
-  for(n = 0;  n < tree->numcodes * 2; n++)
-  {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
   }
 
   return 0;
@@ -684,7 +866,7 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
 
     uivector_cleanup(&nextcode);
     uivector_cleanup(&blcount);
-    return HuffmanTree_make2DTree(tree);
+    return HuffmanTree_makeTable(tree);
   } else {
     uivector_cleanup(&blcount);
     return 83;
@@ -1020,27 +1202,24 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 #ifdef LODEPNG_COMPILE_DECODER
 
 /*
-returns the code, or (unsigned)(-1) if error happened
-inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
+returns the symbol, or INVALIDSYMBOL if the input has a code that is not in the
+tree. There must be at least 15 bits in the buffer of reader.
 */
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-                                    const HuffmanTree* codetree, size_t inbitlength)
+static unsigned huffmanDecodeSymbol(BitReader* reader, const HuffmanTree* codetree)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
+  unsigned index = (unsigned)reader->buffer & ((1u << FIRSTBITS) - 1u);
+  unsigned l = codetree->table_len[index];
+  unsigned value = codetree->table_value[index];
+  if(l <= FIRSTBITS)
   {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    (*bp)++;
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+    readBits(reader, l);
+    return value;
   }
+  /*a longer code, look up the rest of it in the subtable*/
+  readBits(reader, FIRSTBITS);
+  index = value + ((unsigned)reader->buffer & ((1u << (l - FIRSTBITS)) - 1u));
+  readBits(reader, codetree->table_len[index] - FIRSTBITS);
+  return codetree->table_value[index];
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -1060,12 +1239,11 @@ static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
 static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-                                      const unsigned char* in, size_t* bp, size_t inlength)
+                                      BitReader* reader)
 {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
   unsigned error = 0;
   unsigned n, HLIT, HDIST, HCLEN, i;
-  size_t inbitlength = inlength * 8;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
   unsigned* bitlen_ll = 0; /*lit,len code lengths*/
@@ -1074,14 +1252,14 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   unsigned* bitlen_cl = 0;
   HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
-  if((*bp) >> 3 >= inlength - 2) return 49; /*error: the bit pointer is or will go past the memory*/
-
+  ensureBits(reader, 14);
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
-  HLIT =  readBitsFromStream(bp, in, 5) + 257;
+  HLIT =  readBits(reader, 5) + 257;
   /*number of distance codes. Unlike the spec, the value 1 is added to it here already*/
-  HDIST = readBitsFromStream(bp, in, 5) + 1;
+  HDIST = readBits(reader, 5) + 1;
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
-  HCLEN = readBitsFromStream(bp, in, 4) + 4;
+  HCLEN = readBits(reader, 4) + 4;
+  if(BITREADER_PAST_END(reader)) return 49; /*error: the bit pointer is or will go past the memory*/
 
   HuffmanTree_init(&tree_cl);
 
@@ -1094,9 +1272,14 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
     for(i = 0; i < NUM_CODE_LENGTH_CODES; i++)
     {
-      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
+      if(i < HCLEN)
+      {
+        ensureBits(reader, 3);
+        bitlen_cl[CLCL_ORDER[i]] = readBits(reader, 3);
+      }
       else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
     }
+    if(BITREADER_PAST_END(reader)) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
     error = HuffmanTree_makeFromLengths(&tree_cl, bitlen_cl, NUM_CODE_LENGTH_CODES, 7);
     if(error) break;
@@ -1112,7 +1295,11 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST)
     {
-      unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+      unsigned code;
+      /*the code length code and its extra bits are at most 7 + 7 bits*/
+      ensureBits(reader, 14);
+      code = huffmanDecodeSymbol(reader, &tree_cl);
+      if(BITREADER_PAST_END(reader)) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
       if(code <= 15) /*a length code*/
       {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -1124,10 +1311,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
         unsigned replength = 3; /*read in the 2 bits that indicate repeat length (3-6)*/
         unsigned value; /*set value to the previous code*/
 
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
         if (i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
-        replength += readBitsFromStream(bp, in, 2);
+        replength += readBits(reader, 2);
+        if(BITREADER_PAST_END(reader)) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
         if(i < HLIT + 1) value = bitlen_ll[i - 1];
         else value = bitlen_d[i - HLIT - 1];
@@ -1143,9 +1330,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 17) /*repeat "0" 3-10 times*/
       {
         unsigned replength = 3; /*read in the bits that indicate repeat length*/
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-
-        replength += readBitsFromStream(bp, in, 3);
+        replength += readBits(reader, 3);
+        if(BITREADER_PAST_END(reader)) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; n++)
@@ -1160,9 +1346,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 18) /*repeat "0" 11-138 times*/
       {
         unsigned replength = 11; /*read in the bits that indicate repeat length*/
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-
-        replength += readBitsFromStream(bp, in, 7);
+        replength += readBits(reader, 7);
+        if(BITREADER_PAST_END(reader)) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; n++)
@@ -1174,14 +1359,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
           i++;
         }
       }
-      else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+      else /*if(code == INVALIDSYMBOL)*/
       {
-        if(code == (unsigned)(-1))
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inbitlength ? 10 : 11;
-        }
+        if(code == INVALIDSYMBOL) error = 11; /*error: a code that is not in the tree*/
         else error = 16; /*unexisting code, this can never happen*/
         break;
       }
@@ -1206,119 +1386,144 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   return error;
 }
 
-/*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+/*
+decode the symbols of a block until the end code. This works on local copies of
+the reader, the trees and the output position: otherwise they could not stay
+in registers, since any byte written to the output might change them.
+*/
+static unsigned inflateHuffmanSymbols(ucvector* out, BitReader* reader, size_t* pos,
+                                      const HuffmanTree* codetree_ll, const HuffmanTree* codetree_d)
 {
   unsigned error = 0;
-  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
-  HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  size_t inbitlength = inlength * 8;
-
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
+  BitReader r = *reader;
+  HuffmanTree tree_ll = *codetree_ll; /*the huffman tree for literal and length codes*/
+  HuffmanTree tree_d = *codetree_d; /*the huffman tree for distance codes*/
+  size_t p = *pos; /*byte position in the out buffer*/
+  unsigned char* data = out->data;
+  size_t size = out->size;
 
-  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
-  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
-
-  while(!error) /*decode all symbols until end reached, breaks at end code*/
+  for(;;) /*decode all symbols until end reached, breaks at end code*/
   {
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    unsigned code_ll;
+    /*the code and the extra bits of a length are at most 15 + 5 bits*/
+    ensureBits(&r, 20);
+    code_ll = huffmanDecodeSymbol(&r, &tree_ll);
+    if(BITREADER_PAST_END(&r)) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
     if(code_ll <= 255) /*literal symbol*/
     {
-      if((*pos) >= out->size)
+      if(p >= size)
       {
         /*reserve more room at once*/
-        if(!ucvector_resize(out, ((*pos) + 1) * 2)) ERROR_BREAK(83 /*alloc fail*/);
+        if(!ucvector_resize(out, (p + 1) * 2)) ERROR_BREAK(83 /*alloc fail*/);
+        data = out->data;
+        size = out->size;
       }
-      out->data[(*pos)] = (unsigned char)(code_ll);
-      (*pos)++;
+      data[p++] = (unsigned char)(code_ll);
     }
     else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/
     {
       unsigned code_d, distance;
-      unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
-      size_t start, forward, backward, length;
+      size_t length, i;
+      unsigned char* dst;
 
-      /*part 1: get length base*/
-      length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
+      /*part 1: get length base, and add the value of the extra bits to it*/
+      length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX]
+             + readBits(&r, LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX]);
 
-      /*part 2: get extra bits and add the value of that to length*/
-      numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if(*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
-
-      /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      /*part 2: get distance code*/
+      ensureBits(&r, 15);
+      code_d = huffmanDecodeSymbol(&r, &tree_d);
       if(code_d > 29)
       {
-        if(code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
-        }
+        if(code_d == INVALIDSYMBOL) error = 11; /*error: a code that is not in the tree*/
         else error = 18; /*error: invalid distance code (30-31 are never used)*/
         break;
       }
-      distance = DistSymbols[code_d];
-
-      /*part 4: get extra bits from distance*/
-      numextrabits_d = DISTANCEEXTRA[code_d];
-      if(*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
 
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      /*part 3: get distance base, and add the value of the extra bits to it*/
+      ensureBits(&r, 13);
+      distance = DistSymbols[code_d] + readBits(&r, DISTANCEEXTRA[code_d]);
+      if(BITREADER_PAST_END(&r)) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
 
-      /*part 5: fill in all the out[n] values based on the length and dist*/
-      start = (*pos);
-      if(distance > start) ERROR_BREAK(52); /*too long backward distance*/
-      backward = start - distance;
-      if((*pos) + length >= out->size)
+      /*part 4: fill in all the out[n] values based on the length and dist*/
+      if(distance > p) ERROR_BREAK(52); /*too long backward distance*/
+      /*room for the copies of whole words below, which may go past the end*/
+      if(p + length + sizeof(size_t) >= size)
       {
         /*reserve more room at once*/
-        if(!ucvector_resize(out, ((*pos) + length) * 2)) ERROR_BREAK(83 /*alloc fail*/);
+        if(!ucvector_resize(out, (p + length) * 2 + sizeof(size_t))) ERROR_BREAK(83 /*alloc fail*/);
+        data = out->data;
+        size = out->size;
       }
 
-      for(forward = 0; forward < length; forward++)
+      dst = &data[p];
+      if(distance >= sizeof(size_t))
+      {
+        /*each word only overlaps with data before it that is already copied*/
+        for(i = 0; i < length; i += sizeof(size_t)) memcpy(dst + i, dst + i - distance, sizeof(size_t));
+      }
+      else if(distance == 1)
       {
-        out->data[(*pos)] = out->data[backward];
-        (*pos)++;
-        backward++;
-        if(backward >= start) backward = start - distance;
+        __stosb(dst, dst[-1], length);
       }
+      else
+      {
+        for(i = 0; i < length; i++) dst[i] = dst[i - distance];
+      }
+      p += length;
     }
     else if(code_ll == 256)
     {
       break; /*end code, break the loop*/
     }
-    else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+    else /*if(code_ll == INVALIDSYMBOL)*/
     {
-      /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-      (10=no endcode, 11=wrong jump outside of tree)*/
-      error = (*bp) > inlength * 8 ? 10 : 11;
+      error = 11; /*error: a code that is not in the tree*/
       break;
     }
   }
 
+  *reader = r;
+  *pos = p;
+  return error;
+}
+
+/*inflate a block with dynamic of fixed Huffman tree*/
+static unsigned inflateHuffmanBlock(ucvector* out, BitReader* reader,
+                                    size_t* pos, unsigned btype)
+{
+  unsigned error = 0;
+  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
+  HuffmanTree tree_d; /*the huffman tree for distance codes*/
+
+  HuffmanTree_init(&tree_ll);
+  HuffmanTree_init(&tree_d);
+
+  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
+  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
+
+  if(!error) error = inflateHuffmanSymbols(out, reader, pos, &tree_ll, &tree_d);
+
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
 
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+static unsigned inflateNoCompression(ucvector* out, BitReader* reader, size_t* pos)
 {
+  unsigned LEN, NLEN;
+
   /*go to first boundary of byte*/
-  size_t p;
-  unsigned LEN, NLEN, n, error = 0;
-  while(((*bp) & 0x7) != 0) (*bp)++;
-  p = (*bp) / 8; /*byte position*/
+  BitReader_alignToByte(reader);
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
-  if(p >= inlength - 4) return 52; /*error, bit pointer will jump past memory*/
-  LEN = in[p] + 256 * in[p + 1]; p += 2;
-  NLEN = in[p] + 256 * in[p + 1]; p += 2;
+  ensureBits(reader, 16);
+  LEN = readBits(reader, 16);
+  ensureBits(reader, 16);
+  NLEN = readBits(reader, 16);
+  if(BITREADER_PAST_END(reader)) return 52; /*error, bit pointer will jump past memory*/
 
   /*check if 16-bit NLEN is really the one's complement of LEN*/
   if(LEN + NLEN != 65535) return 21; /*error: NLEN is not one's complement of LEN*/
@@ -1329,38 +1534,31 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
   }
 
   /*read the literal data: LEN bytes are now stored in the out buffer*/
-  if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
-  for(n = 0; n < LEN; n++) out->data[(*pos)++] = in[p++];
-
-  (*bp) = p * 8;
+  if(!BitReader_readBytes(reader, &out->data[(*pos)], LEN)) return 23; /*error: reading outside of in buffer*/
+  (*pos) += LEN;
 
-  return error;
+  return 0;
 }
 
-static unsigned lodepng_inflatev(ucvector* out,
-                                 const unsigned char* in, size_t insize,
-                                 const LodePNGDecompressSettings* settings)
+/*inflates the input of the reader, which starts with the first block*/
+static unsigned inflateReader(ucvector* out, BitReader* reader)
 {
-  /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
-  size_t bp = 0;
   unsigned BFINAL = 0;
   size_t pos = 0; /*byte position in the out buffer*/
 
   unsigned error = 0;
 
-  (void)settings;
-
   while(!BFINAL)
   {
     unsigned BTYPE;
-    if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
-    BFINAL = readBitFromStream(&bp, in);
-    BTYPE = 1 * readBitFromStream(&bp, in);
-    BTYPE += 2 * readBitFromStream(&bp, in);
+    ensureBits(reader, 3);
+    BFINAL = readBits(reader, 1);
+    BTYPE = readBits(reader, 2);
+    if(BITREADER_PAST_END(reader)) return 52; /*error, bit pointer will jump past memory*/
 
     if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+    else if(BTYPE == 0) error = inflateNoCompression(out, reader, &pos); /*no compression*/
+    else error = inflateHuffmanBlock(out, reader, &pos, BTYPE); /*compression, BTYPE 01 or 10*/
 
     if(error) return error;
   }
@@ -1371,6 +1569,21 @@ static unsigned lodepng_inflatev(ucvector* out,
   return error;
 }
 
+static unsigned lodepng_inflatev(ucvector* out,
+                                 const unsigned char* in, size_t insize,
+                                 const LodePNGDecompressSettings* settings)
+{
+  BitReader reader;
+  InflateSpan span;
+
+  (void)settings;
+
+  span.data = in;
+  span.size = insize;
+  BitReader_init(&reader, &span, 1);
+  return inflateReader(out, &reader);
+}
+
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGDecompressSettings* settings)
@@ -2231,33 +2444,10 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                  */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
-{
-   unsigned s1 = adler & 0xffff;
-   unsigned s2 = (adler >> 16) & 0xffff;
-
-  while(len > 0)
-  {
-    /*at least 5550 sums can be done before the sums overflow, saving a lot of module divisions*/
-    unsigned amount = len > 5550 ? 5550 : len;
-    len -= amount;
-    while(amount > 0)
-    {
-      s1 += (*data++);
-      s2 += s1;
-      amount--;
-    }
-    s1 %= 65521;
-    s2 %= 65521;
-  }
-
-  return (s2 << 16) | s1;
-}
-
 /*Return the adler32 of the bytes data[0..len-1]*/
 static unsigned adler32(const unsigned char* data, unsigned len)
 {
-  return update_adler32(1L, data, len);
+  return UpdateAdler32(1L, data, len);
 }
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -2266,25 +2456,23 @@ static unsigned adler32(const unsigned char* data, unsigned len)
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                 size_t insize, const LodePNGDecompressSettings* settings)
+/*checks the two bytes CMF and FLG of the zlib header, returns the error code*/
+static unsigned zlibHeaderError(unsigned CMF, unsigned FLG)
 {
-  unsigned error = 0;
   unsigned CM, CINFO, FDICT;
 
-  if(insize < 2) return 53; /*error, size of zlib data too small*/
   /*read information from zlib header*/
-  if((in[0] * 256 + in[1]) % 31 != 0)
+  if((CMF * 256 + FLG) % 31 != 0)
   {
     /*error: 256 * in[0] + in[1] must be a multiple of 31, the FCHECK value is supposed to be made that way*/
     return 24;
   }
 
-  CM = in[0] & 15;
-  CINFO = (in[0] >> 4) & 15;
-  /*FCHECK = in[1] & 31;*/ /*FCHECK is already tested above*/
-  FDICT = (in[1] >> 5) & 1;
-  /*FLEVEL = (in[1] >> 6) & 3;*/ /*FLEVEL is not used here*/
+  CM = CMF & 15;
+  CINFO = (CMF >> 4) & 15;
+  /*FCHECK = FLG & 31;*/ /*FCHECK is already tested above*/
+  FDICT = (FLG >> 5) & 1;
+  /*FLEVEL = (FLG >> 6) & 3;*/ /*FLEVEL is not used here*/
 
   if(CM != 8 || CINFO > 7)
   {
@@ -2297,6 +2485,17 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
       "The additional flags shall not specify a preset dictionary."*/
     return 26;
   }
+  return 0;
+}
+
+unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error = 0;
+
+  if(insize < 2) return 53; /*error, size of zlib data too small*/
+  error = zlibHeaderError(in[0], in[1]);
+  if(error) return error;
 
   error = inflate(out, outsize, in + 2, insize - 2, settings);
   if(error) return error;
@@ -2320,10 +2519,66 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
     return lodepng_zlib_decompress(out, outsize, in, insize, settings);
 }
 
+/*
+lodepng_zlib_decompress of the concatenation of the spans, which are read one
+after the other. The adler32 checksum is the one right after the deflate data.
+*/
+static unsigned zlibDecompressSpans(unsigned char** out, size_t* outsize,
+                                    const InflateSpan* spans, size_t numspans,
+                                    const LodePNGDecompressSettings* settings)
+{
+  unsigned error, CMF;
+  BitReader reader;
+  ucvector v;
+
+  BitReader_init(&reader, spans, numspans);
+  ensureBits(&reader, 16);
+  if(BITREADER_PAST_END(&reader)) return 53; /*error, size of zlib data too small*/
+  CMF = readBits(&reader, 8);
+  error = zlibHeaderError(CMF, readBits(&reader, 8));
+  if(error) return error;
+
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = inflateReader(&v, &reader);
+  *out = v.data;
+  *outsize = v.size;
+  if(error) return error;
+
+  if(!settings->ignore_adler32)
+  {
+    unsigned ADLER32, i;
+    BitReader_alignToByte(&reader);
+    ADLER32 = 0;
+    for(i = 0; i < 4; i++)
+    {
+      ensureBits(&reader, 8);
+      ADLER32 = (ADLER32 << 8) | readBits(&reader, 8);
+    }
+    if(BITREADER_PAST_END(&reader)) return 58; /*error, no adler checksum after the data*/
+    if(adler32(*out, (unsigned)(*outsize)) != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
+  }
+
+  return 0; /*no error*/
+}
+
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
+static void addZlibHeader(ucvector* out)
+{
+  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
+  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
+  unsigned FLEVEL = 0;
+  unsigned FDICT = 0;
+  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
+  unsigned FCHECK = 31 - CMFFLG % 31;
+  CMFFLG += FCHECK;
+
+  ucvector_push_back(out, (unsigned char)(CMFFLG / 256));
+  ucvector_push_back(out, (unsigned char)(CMFFLG % 256));
+}
+
 unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                size_t insize, const LodePNGCompressSettings* settings)
 {
@@ -2336,19 +2591,11 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   size_t deflatesize = 0;
 
   unsigned ADLER32;
-  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
-  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
-  unsigned FLEVEL = 0;
-  unsigned FDICT = 0;
-  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
-  unsigned FCHECK = 31 - CMFFLG % 31;
-  CMFFLG += FCHECK;
 
   /*ucvector-controlled version of the output buffer, for dynamic array*/
   ucvector_init_buffer(&outv, *out, *outsize);
 
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG / 256));
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG % 256));
+  addZlibHeader(&outv);
 
   error = deflate(&deflatedata, &deflatesize, in, insize, settings);
 
@@ -2366,6 +2613,57 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   return error;
 }
 
+/*the read function given to custom_deflate_stream, computing the adler32 of the data on the way*/
+typedef struct AdlerReader
+{
+  void (*read)(unsigned char*, size_t, size_t, void*);
+  void* context;
+  unsigned adler;
+} AdlerReader;
+
+static void adlerRead(unsigned char* data, size_t pos, size_t size, void* context)
+{
+  AdlerReader* reader = (AdlerReader*)context;
+  if(pos == 0) reader->adler = 1;
+  reader->read(data, pos, size, reader->context);
+  reader->adler = UpdateAdler32(reader->adler, data, size);
+}
+
+/*like lodepng_zlib_compress, with custom_deflate_stream reading the insize bytes of input with read*/
+static unsigned zlib_compress_stream(unsigned char** out, size_t* outsize, size_t insize,
+                                     void (*read)(unsigned char*, size_t, size_t, void*), void* readcontext,
+                                     const LodePNGCompressSettings* settings)
+{
+  ucvector outv;
+  size_t i;
+  unsigned error;
+  unsigned char* deflatedata = 0;
+  size_t deflatesize = 0;
+  AdlerReader reader;
+
+  reader.read = read;
+  reader.context = readcontext;
+  reader.adler = 1;
+
+  ucvector_init_buffer(&outv, *out, *outsize);
+
+  addZlibHeader(&outv);
+
+  error = settings->custom_deflate_stream(&deflatedata, &deflatesize, insize, adlerRead, &reader, settings);
+
+  if(!error)
+  {
+    for(i = 0; i < deflatesize; i++) ucvector_push_back(&outv, deflatedata[i]);
+    lodepng_free(deflatedata);
+    lodepng_add32bitInt(&outv, reader.adler);
+  }
+
+  *out = outv.data;
+  *outsize = outv.size;
+
+  return error;
+}
+
 /* compress using the default or custom zlib function */
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                               size_t insize, const LodePNGCompressSettings* settings)
@@ -2403,6 +2701,44 @@ static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsign
 
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
+#if defined(LODEPNG_COMPILE_PNG) && defined(LODEPNG_COMPILE_DECODER)
+/*
+zlib_decompress of the concatenation of the spans. They are only copied
+together first if a custom function needs the data in one piece.
+*/
+static unsigned zlib_decompress_spans(unsigned char** out, size_t* outsize,
+                                      const InflateSpan* spans, size_t numspans,
+                                      const LodePNGDecompressSettings* settings)
+{
+  unsigned error = 0;
+  size_t i, size = 0;
+  ucvector in;
+
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(!settings->custom_zlib && !settings->custom_inflate)
+  {
+    return zlibDecompressSpans(out, outsize, spans, numspans, settings);
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+  for(i = 0; i < numspans; i++) size += spans[i].size;
+  ucvector_init(&in);
+  if(!ucvector_resize(&in, size)) error = 83; /*alloc fail*/
+  if(!error)
+  {
+    size = 0;
+    for(i = 0; i < numspans; i++)
+    {
+      __movsb(&in.data[size], spans[i].data, spans[i].size);
+      size += spans[i].size;
+    }
+    error = zlib_decompress(out, outsize, in.data, in.size, settings);
+  }
+  ucvector_cleanup(&in);
+  return error;
+}
+#endif /*defined(LODEPNG_COMPILE_PNG) && defined(LODEPNG_COMPILE_DECODER)*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -2422,10 +2758,11 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
+  settings->custom_deflate_stream = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -3091,82 +3428,77 @@ static void addColorBits(unsigned char* out, size_t index, unsigned bits, unsign
   else out[index * bits / 8] |= in;
 }
 
-typedef struct ColorTree ColorTree;
+#ifdef LODEPNG_SSE2
+/*whether the CPU has SSE2: 1 if so, 0 if not, -1 if not checked yet*/
+static int has_sse2 = -1;
+
+static int detectSSE2(void)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+  return 1; /*every x64 CPU has it*/
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] & (1 << 26)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2") != 0;
+#endif
+}
+#endif /*LODEPNG_SSE2*/
 
 /*
-One node of a color tree
+A hash table with open addressing of up to 257 RGBA colors and their index.
 This is the data structure used to count the number of unique colors and to get a palette
-index for a color. It's like an octree, but because the alpha channel is used too, each
-node has 16 instead of 8 children.
+index for a color. It has twice as many slots as colors, so probes are short.
 */
-struct ColorTree
+#define COLOR_TABLE_SIZE 512
+
+typedef struct ColorTable
 {
-  ColorTree* children[16]; /*up to 16 pointers to ColorTree of next level*/
-  int index; /*the payload. Only has a meaningful value if this is in the last level*/
-};
+  unsigned colors[COLOR_TABLE_SIZE]; /*the RGBA colors, with r in the lowest byte*/
+  int index[COLOR_TABLE_SIZE]; /*the payload, -1 for an empty slot*/
+} ColorTable;
 
-static void color_tree_init(ColorTree* tree)
+static void color_table_init(ColorTable* table)
 {
   int i;
-  for(i = 0; i < 16; i++) tree->children[i] = 0;
-  tree->index = -1;
+  for(i = 0; i < COLOR_TABLE_SIZE; i++) table->index[i] = -1;
 }
 
-static void color_tree_cleanup(ColorTree* tree)
+/*returns the slot of the color, or the empty slot where it belongs if it isn't present*/
+static unsigned color_table_slot(const ColorTable* table, unsigned color)
 {
-  int i;
-  for(i = 0; i < 16; i++)
-  {
-    if(tree->children[i])
-    {
-      color_tree_cleanup(tree->children[i]);
-      lodepng_free(tree->children[i]);
-    }
-  }
+  unsigned slot = ((color * 2654435761u) >> 23) & (COLOR_TABLE_SIZE - 1);
+  while(table->index[slot] >= 0 && table->colors[slot] != color) slot = (slot + 1) & (COLOR_TABLE_SIZE - 1);
+  return slot;
 }
 
-/*returns -1 if color not present, its index otherwise*/
-static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+static unsigned color_table_key(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
-  int bit = 0;
-  for(bit = 0; bit < 8; bit++)
-  {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i]) return -1;
-    else tree = tree->children[i];
-  }
-  return tree ? tree->index : -1;
+  return r | ((unsigned)g << 8) | ((unsigned)b << 16) | ((unsigned)a << 24);
 }
 
-#ifdef LODEPNG_COMPILE_ENCODER
-static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+/*returns -1 if color not present, its index otherwise*/
+static int color_table_get(const ColorTable* table, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
-  return color_tree_get(tree, r, g, b, a) >= 0;
+  return table->index[color_table_slot(table, color_table_key(r, g, b, a))];
 }
-#endif /*LODEPNG_COMPILE_ENCODER*/
 
-/*color is not allowed to already exist.
-Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")*/
-static void color_tree_add(ColorTree* tree,
-                           unsigned char r, unsigned char g, unsigned char b, unsigned char a, int index)
+/*Adds the color, or changes its index if it already exists. There may not be more than
+257 colors. Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")*/
+static void color_table_add(ColorTable* table,
+                            unsigned char r, unsigned char g, unsigned char b, unsigned char a, int index)
 {
-  int bit;
-  for(bit = 0; bit < 8; bit++)
-  {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i])
-    {
-      tree->children[i] = (ColorTree*)lodepng_malloc(sizeof(ColorTree));
-      color_tree_init(tree->children[i]);
-    }
-    tree = tree->children[i];
-  }
-  tree->index = index;
+  unsigned color = color_table_key(r, g, b, a);
+  unsigned slot = color_table_slot(table, color);
+  table->colors[slot] = color;
+  table->index[slot] = index;
 }
 
 /*put a pixel, given its RGBA color, into image of any color type*/
 static unsigned rgba8ToPixel(unsigned char* out, size_t i,
-                             const LodePNGColorMode* mode, ColorTree* tree /*for palette*/,
+                             const LodePNGColorMode* mode, const ColorTable* table /*for palette*/,
                              unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
   if(mode->colortype == LCT_GREY)
@@ -3198,7 +3530,7 @@ static unsigned rgba8ToPixel(unsigned char* out, size_t i,
   }
   else if(mode->colortype == LCT_PALETTE)
   {
-    int index = color_tree_get(tree, r, g, b, a);
+    int index = color_table_get(table, r, g, b, a);
     if(index < 0) return 82; /*color not in palette*/
     if(mode->bitdepth == 8) out[i] = index;
     else addColorBits(out, i, mode->bitdepth, index);
@@ -3582,7 +3914,7 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
 {
   unsigned error = 0;
   size_t i;
-  ColorTree tree;
+  ColorTable table;
   size_t numpixels = w * h;
 
   if(lodepng_color_mode_equal(mode_out, mode_in))
@@ -3596,11 +3928,11 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
   {
     size_t palsize = 1 << mode_out->bitdepth;
     if(mode_out->palettesize < palsize) palsize = mode_out->palettesize;
-    color_tree_init(&tree);
+    color_table_init(&table);
     for(i = 0; i < palsize; i++)
     {
       unsigned char* p = &mode_out->palette[i * 4];
-      color_tree_add(&tree, p[0], p[1], p[2], p[3], i);
+      color_table_add(&table, p[0], p[1], p[2], p[3], i);
     }
   }
 
@@ -3630,16 +3962,11 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
     {
       error = getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in, fix_png);
       if(error) break;
-      error = rgba8ToPixel(out, i, mode_out, &tree, r, g, b, a);
+      error = rgba8ToPixel(out, i, mode_out, &table, r, g, b, a);
       if(error) break;
     }
   }
 
-  if(mode_out->colortype == LCT_PALETTE)
-  {
-    color_tree_cleanup(&tree);
-  }
-
   return error;
 }
 
@@ -3662,8 +3989,8 @@ typedef struct ColorProfile
   unsigned char alpha_done;
 
   unsigned numcolors;
-  ColorTree tree; /*for listing the counted colors, up to 256*/
-  unsigned char* palette; /*size 1024. Remember up to the first 256 RGBA colors*/
+  ColorTable table; /*for listing the counted colors, up to 257*/
+  unsigned char palette[1024]; /*Remember up to the first 256 RGBA colors*/
   unsigned maxnumcolors; /*if more than that amount counted*/
   unsigned char numcolors_done;
 
@@ -3685,8 +4012,7 @@ static void color_profile_init(ColorProfile* profile, LodePNGColorMode* mode)
   profile->alpha_done = lodepng_can_have_alpha(mode) ? 0 : 1;
 
   profile->numcolors = 0;
-  color_tree_init(&profile->tree);
-  profile->palette = (unsigned char*)lodepng_malloc(1024);
+  color_table_init(&profile->table);
   profile->maxnumcolors = 257;
   if(lodepng_get_bpp(mode) <= 8)
   {
@@ -3699,12 +4025,6 @@ static void color_profile_init(ColorProfile* profile, LodePNGColorMode* mode)
   profile->greybits_done = lodepng_get_bpp(mode) == 1 ? 1 : 0;
 }
 
-static void color_profile_cleanup(ColorProfile* profile)
-{
-  color_tree_cleanup(&profile->tree);
-  lodepng_free(profile->palette);
-}
-
 /*function used for debug purposes with C++*/
 /*void printColorProfile(ColorProfile* p)
 {
@@ -3734,6 +4054,162 @@ unsigned getValueRequiredBits(unsigned short value)
   return 8;
 }
 
+#ifdef LODEPNG_SSE2
+/*like skip_color_profile_rgba8, for groups of 4 pixels, returns the amount of pixels skipped*/
+#if defined(__GNUC__)
+__attribute__ ((target("sse2")))
+#endif
+static size_t skipRGBA8SSE2(const unsigned char* in, size_t i, size_t numpixels,
+                            int quiet, int alpha_done, int colored_done)
+{
+  const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+  const __m128i gb = _mm_set1_epi32(0x00ffff00);
+  const __m128i ones = _mm_set1_epi32(-1);
+  const __m128i quietv = _mm_set1_epi32(quiet ? -1 : 0);
+  const __m128i alphav = _mm_set1_epi32(alpha_done ? -1 : 0);
+  const __m128i coloredv = _mm_set1_epi32(colored_done ? -1 : 0);
+  size_t start = i;
+  for(; i + 4 <= numpixels; i += 4)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&in[i * 4]);
+    __m128i same = _mm_cmpeq_epi32(x, _mm_loadu_si128((const __m128i*)&in[i * 4 - 4]));
+    __m128i opaque = _mm_cmpeq_epi32(_mm_or_si128(x, rgb), ones);
+    /*r == g and g == b, by comparing g and b with r and g shifted into their place*/
+    __m128i grey = _mm_cmpeq_epi32(_mm_and_si128(x, gb), _mm_and_si128(_mm_slli_epi32(x, 8), gb));
+    __m128i ok = _mm_and_si128(quietv, _mm_and_si128(_mm_or_si128(alphav, opaque), _mm_or_si128(coloredv, grey)));
+    if(_mm_movemask_epi8(_mm_or_si128(same, ok)) != 0xffff) break;
+  }
+  return i - start;
+}
+#endif /*LODEPNG_SSE2*/
+
+#ifdef LODEPNG_NEON
+/*like skipRGBA8SSE2, with NEON*/
+static size_t skipRGBA8NEON(const unsigned char* in, size_t i, size_t numpixels,
+                            int quiet, int alpha_done, int colored_done)
+{
+  const uint32x4_t rgb = vdupq_n_u32(0x00ffffff);
+  const uint32x4_t gb = vdupq_n_u32(0x00ffff00);
+  const uint32x4_t ones = vdupq_n_u32(0xffffffff);
+  const uint32x4_t quietv = vdupq_n_u32(quiet ? 0xffffffff : 0);
+  const uint32x4_t alphav = vdupq_n_u32(alpha_done ? 0xffffffff : 0);
+  const uint32x4_t coloredv = vdupq_n_u32(colored_done ? 0xffffffff : 0);
+  size_t start = i;
+  for(; i + 4 <= numpixels; i += 4)
+  {
+    uint32x4_t x = vreinterpretq_u32_u8(vld1q_u8(&in[i * 4]));
+    uint32x4_t same = vceqq_u32(x, vreinterpretq_u32_u8(vld1q_u8(&in[i * 4 - 4])));
+    uint32x4_t opaque = vceqq_u32(vorrq_u32(x, rgb), ones);
+    uint32x4_t grey = vceqq_u32(vandq_u32(x, gb), vandq_u32(vshlq_n_u32(x, 8), gb));
+    uint32x4_t ok = vorrq_u32(same, vandq_u32(quietv, vandq_u32(vorrq_u32(alphav, opaque), vorrq_u32(coloredv, grey))));
+    uint32x2_t m = vand_u32(vget_low_u32(ok), vget_high_u32(ok));
+    if((vget_lane_u32(m, 0) & vget_lane_u32(m, 1)) != 0xffffffff) break;
+  }
+  return i - start;
+}
+#endif /*LODEPNG_NEON*/
+
+/*updates the profile of a < 16-bit image with one more pixel*/
+static void color_profile_add_rgba8(ColorProfile* profile,
+                                    unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+{
+  if(!profile->colored_done && (r != g || r != b))
+  {
+    profile->colored = 1;
+    profile->colored_done = 1;
+    profile->greybits_done = 1; /*greybits is not applicable anymore*/
+  }
+
+  if(!profile->alpha_done && a != 255)
+  {
+    if(a == 0 && !(profile->key && (r != profile->key_r || g != profile->key_g || b != profile->key_b)))
+    {
+      if(!profile->key)
+      {
+        profile->key = 1;
+        profile->key_r = r;
+        profile->key_g = g;
+        profile->key_b = b;
+      }
+    }
+    else
+    {
+      profile->alpha = 1;
+      profile->alpha_done = 1;
+      profile->greybits_done = 1; /*greybits is not applicable anymore*/
+    }
+  }
+
+  /* Color key cannot be used if an opaque pixel also has that RGB color. */
+  if(!profile->alpha_done && a == 255 && profile->key
+      && r == profile->key_r && g == profile->key_g && b == profile->key_b)
+  {
+      profile->alpha = 1;
+      profile->alpha_done = 1;
+      profile->greybits_done = 1; /*greybits is not applicable anymore*/
+  }
+
+  if(!profile->greybits_done)
+  {
+    unsigned bits = getValueRequiredBits(r);
+    if(bits > profile->greybits) profile->greybits = bits;
+    if(profile->greybits >= 8) profile->greybits_done = 1;
+  }
+
+  if(!profile->numcolors_done)
+  {
+    if(color_table_get(&profile->table, r, g, b, a) < 0)
+    {
+      color_table_add(&profile->table, r, g, b, a, profile->numcolors);
+      if(profile->numcolors < 256)
+      {
+        unsigned char* p = profile->palette;
+        unsigned i = profile->numcolors;
+        p[i * 4 + 0] = r;
+        p[i * 4 + 1] = g;
+        p[i * 4 + 2] = b;
+        p[i * 4 + 3] = a;
+      }
+      profile->numcolors++;
+      if(profile->numcolors >= profile->maxnumcolors) profile->numcolors_done = 1;
+    }
+  }
+}
+
+static int color_profile_done_rgba8(const ColorProfile* profile)
+{
+  return profile->alpha_done && profile->numcolors_done && profile->colored_done && profile->greybits_done;
+}
+
+/*
+Returns how many pixels of the RGBA8 image, starting at pixel i > 0, can't change the
+profile: pixels with the same color as the one before them, and once no more colors or
+grey bits are needed, opaque pixels that are grey as far as that is still unknown.
+Checks 4 pixels at once with SSE2 or NEON.
+*/
+static size_t skip_color_profile_rgba8(const ColorProfile* profile, const unsigned char* in,
+                                       size_t i, size_t numpixels)
+{
+  size_t start = i;
+  /*whether pixels can only still change whether the image is colored or has alpha*/
+  int quiet = profile->numcolors_done && profile->greybits_done && (profile->alpha_done || !profile->key);
+#if defined(LODEPNG_SSE2)
+  if(has_sse2 < 0) has_sse2 = detectSSE2();
+  if(has_sse2) i += skipRGBA8SSE2(in, i, numpixels, quiet, profile->alpha_done, profile->colored_done);
+#elif defined(LODEPNG_NEON)
+  i += skipRGBA8NEON(in, i, numpixels, quiet, profile->alpha_done, profile->colored_done);
+#endif
+  for(; i < numpixels; i++)
+  {
+    const unsigned char* p = &in[i * 4];
+    if(p[0] == p[-4] && p[1] == p[-3] && p[2] == p[-2] && p[3] == p[-1]) continue;
+    if(!quiet) break;
+    if(!profile->alpha_done && p[3] != 255) break;
+    if(!profile->colored_done && (p[0] != p[1] || p[0] != p[2])) break;
+  }
+  return i - start;
+}
+
 /*profile must already have been inited with mode.
 It's ok to set some parameters of profile to done already.*/
 static unsigned get_color_profile(ColorProfile* profile,
@@ -3812,9 +4288,9 @@ static unsigned get_color_profile(ColorProfile* profile,
       if(!profile->numcolors_done)
       {
         /*assuming 8-bit rgba, this test does not care about 16-bit*/
-        if(!color_tree_has(&profile->tree, (unsigned char)r, (unsigned char)g, (unsigned char)b, (unsigned char)a))
+        if(color_table_get(&profile->table, (unsigned char)r, (unsigned char)g, (unsigned char)b, (unsigned char)a) < 0)
         {
-          color_tree_add(&profile->tree, (unsigned char)r, (unsigned char)g, (unsigned char)b, (unsigned char)a,
+          color_table_add(&profile->table, (unsigned char)r, (unsigned char)g, (unsigned char)b, (unsigned char)a,
             profile->numcolors);
           if(profile->numcolors < 256)
           {
@@ -3837,81 +4313,32 @@ static unsigned get_color_profile(ColorProfile* profile,
       }
     };
   }
+  else if(mode->colortype == LCT_RGBA && mode->bitdepth == 8)
+  {
+    for(i = 0; i < numpixels; i++)
+    {
+      const unsigned char* p;
+      if(i > 0) i += skip_color_profile_rgba8(profile, in, i, numpixels);
+      if(i >= numpixels) break;
+      p = &in[i * 4];
+      color_profile_add_rgba8(profile, p[0], p[1], p[2], p[3]);
+      if(color_profile_done_rgba8(profile)) break;
+    }
+  }
   else /* < 16-bit */
   {
+    unsigned char pr = 0, pg = 0, pb = 0, pa = 0; /*the previous pixel*/
     for(i = 0; i < numpixels; i++)
     {
       unsigned char r = 0, g = 0, b = 0, a = 0;
       error = getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode, fix_png);
       if(error) break;
+      /*a repeated color can't change the profile*/
+      if(i > 0 && r == pr && g == pg && b == pb && a == pa) continue;
+      pr = r; pg = g; pb = b; pa = a;
 
-      if(!profile->colored_done && (r != g || r != b))
-      {
-        profile->colored = 1;
-        profile->colored_done = 1;
-        profile->greybits_done = 1; /*greybits is not applicable anymore*/
-      }
-
-      if(!profile->alpha_done && a != 255)
-      {
-        if(a == 0 && !(profile->key && (r != profile->key_r || g != profile->key_g || b != profile->key_b)))
-        {
-          if(!profile->key)
-          {
-            profile->key = 1;
-            profile->key_r = r;
-            profile->key_g = g;
-            profile->key_b = b;
-          }
-        }
-        else
-        {
-          profile->alpha = 1;
-          profile->alpha_done = 1;
-          profile->greybits_done = 1; /*greybits is not applicable anymore*/
-        }
-      }
-
-      /* Color key cannot be used if an opaque pixel also has that RGB color. */
-      if(!profile->alpha_done && a == 255 && profile->key
-          && r == profile->key_r && g == profile->key_g && b == profile->key_b)
-      {
-          profile->alpha = 1;
-          profile->alpha_done = 1;
-          profile->greybits_done = 1; /*greybits is not applicable anymore*/
-      }
-
-      if(!profile->greybits_done)
-      {
-        unsigned bits = getValueRequiredBits(r);
-        if(bits > profile->greybits) profile->greybits = bits;
-        if(profile->greybits >= 8) profile->greybits_done = 1;
-      }
-
-      if(!profile->numcolors_done)
-      {
-        if(!color_tree_has(&profile->tree, r, g, b, a))
-        {
-
-          color_tree_add(&profile->tree, r, g, b, a, profile->numcolors);
-          if(profile->numcolors < 256)
-          {
-            unsigned char* p = profile->palette;
-            unsigned i = profile->numcolors;
-            p[i * 4 + 0] = r;
-            p[i * 4 + 1] = g;
-            p[i * 4 + 2] = b;
-            p[i * 4 + 3] = a;
-          }
-          profile->numcolors++;
-          if(profile->numcolors >= profile->maxnumcolors) profile->numcolors_done = 1;
-        }
-      }
-
-      if(profile->alpha_done && profile->numcolors_done && profile->colored_done && profile->greybits_done)
-      {
-        break;
-      }
+      color_profile_add_rgba8(profile, r, g, b, a);
+      if(color_profile_done_rgba8(profile)) break;
     };
   }
 
@@ -4035,8 +4462,6 @@ static unsigned doAutoChooseColor(LodePNGColorMode* mode_out,
     }
   }
 
-  color_profile_cleanup(&profile);
-
   if(mode_out->colortype == LCT_PALETTE && mode_in->palettesize == mode_out->palettesize)
   {
     /*In this case keep the palette order of the input, so that the user can choose an optimal one*/
@@ -4074,6 +4499,50 @@ static unsigned char paethPredictor(short a, short b, short c)
   else return (unsigned char)a;
 }
 
+#ifdef LODEPNG_SSE2
+/*paethPredictor of 8 bytes at once, given in 16-bit lanes, without branches*/
+#if defined(__GNUC__)
+__attribute__ ((target("sse2")))
+#endif
+static __m128i paethSSE2(__m128i a, __m128i b, __m128i c)
+{
+  const __m128i zero = _mm_setzero_si128();
+  /*pa = |b - c|, pb = |a - c|, pc = |a + b - c - c|, the absolute values as max(v, -v)*/
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = _mm_add_epi16(pa, pb);
+  __m128i mask, pred;
+  pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+  pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+  pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+  /*same choice as paethPredictor: c if pc is smallest, else b if pb < pa, else a*/
+  mask = _mm_cmplt_epi16(pb, pa);
+  pred = _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, a));
+  mask = _mm_and_si128(_mm_cmplt_epi16(pc, pa), _mm_cmplt_epi16(pc, pb));
+  return _mm_or_si128(_mm_and_si128(mask, c), _mm_andnot_si128(mask, pred));
+}
+#endif /*LODEPNG_SSE2*/
+
+#ifdef LODEPNG_NEON
+/*paethPredictor of 8 bytes at once, without branches*/
+static uint8x8_t paethNEON(uint8x8_t a, uint8x8_t b, uint8x8_t c)
+{
+  int16x8_t a16 = vreinterpretq_s16_u16(vmovl_u8(a));
+  int16x8_t b16 = vreinterpretq_s16_u16(vmovl_u8(b));
+  int16x8_t c16 = vreinterpretq_s16_u16(vmovl_u8(c));
+  int16x8_t pa = vsubq_s16(b16, c16);
+  int16x8_t pb = vsubq_s16(a16, c16);
+  int16x8_t pc = vabsq_s16(vaddq_s16(pa, pb));
+  int16x8_t pred;
+  pa = vabsq_s16(pa);
+  pb = vabsq_s16(pb);
+  /*same choice as paethPredictor: c if pc is smallest, else b if pb < pa, else a*/
+  pred = vbslq_s16(vcltq_s16(pb, pa), b16, a16);
+  pred = vbslq_s16(vandq_u16(vcltq_s16(pc, pa), vcltq_s16(pc, pb)), c16, pred);
+  return vmovn_u16(vreinterpretq_u16_s16(pred));
+}
+#endif /*LODEPNG_NEON*/
+
 /*shared values used by multiple Adam7 related functions*/
 
 static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
@@ -4188,6 +4657,158 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
+#ifdef LODEPNG_SSE2
+/*the Up filter 16 bytes at a time, returns the amount of bytes done*/
+#if defined(__GNUC__)
+__attribute__ ((target("sse2")))
+#endif
+static size_t unfilterUpSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                             size_t length)
+{
+  size_t i;
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&precon[i]);
+    _mm_storeu_si128((__m128i*)&recon[i], _mm_add_epi8(x, b));
+  }
+  return i;
+}
+
+/*
+Sub, Average or Paeth a pixel of bytewidth (3 to 8) bytes at a time, the first
+pixel must be done already. Every pixel is loaded and stored as 8 bytes: the
+bytes after the pixel are stored unchanged, since recon may be scanline.
+Returns the position of the first byte that is not done.
+*/
+#if defined(__GNUC__)
+__attribute__ ((target("sse2")))
+#endif
+static size_t unfilterPixelsSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, unsigned char filterType, size_t length)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  /*the bytes of the pixel*/
+  const __m128i mask = _mm_cmplt_epi8(_mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                      _mm_set1_epi8((char)bytewidth));
+  __m128i a, b, c, x, r;
+  size_t i = bytewidth;
+
+  if(length < bytewidth + 8) return i;
+  a = _mm_loadl_epi64((const __m128i*)recon); /*the pixel to the left*/
+
+  for(; i + 8 <= length; i += bytewidth)
+  {
+    x = _mm_loadl_epi64((const __m128i*)&scanline[i]);
+    if(filterType == 1)
+    {
+      r = _mm_add_epi8(x, a);
+    }
+    else if(filterType == 3)
+    {
+      /*avg_epu8 rounds up, while the filter rounds down*/
+      b = _mm_loadl_epi64((const __m128i*)&precon[i]);
+      r = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+      r = _mm_add_epi8(x, r);
+    }
+    else
+    {
+      __m128i pred;
+      b = _mm_loadl_epi64((const __m128i*)&precon[i]);
+      c = _mm_loadl_epi64((const __m128i*)&precon[i - bytewidth]);
+      pred = paethSSE2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+      r = _mm_add_epi8(x, _mm_packus_epi16(pred, pred));
+    }
+    _mm_storel_epi64((__m128i*)&recon[i], _mm_or_si128(_mm_and_si128(mask, r), _mm_andnot_si128(mask, x)));
+    a = r;
+  }
+  return i;
+}
+#endif /*LODEPNG_SSE2*/
+
+#ifdef LODEPNG_NEON
+/*the Up filter 16 bytes at a time, returns the amount of bytes done*/
+static size_t unfilterUpNEON(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                             size_t length)
+{
+  size_t i;
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    vst1q_u8(&recon[i], vaddq_u8(vld1q_u8(&scanline[i]), vld1q_u8(&precon[i])));
+  }
+  return i;
+}
+
+/*like unfilterPixelsSSE2*/
+static size_t unfilterPixelsNEON(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, unsigned char filterType, size_t length)
+{
+  /*the bytes of the pixel*/
+  const uint8x8_t mask = vclt_u8(vcreate_u8(0x0706050403020100ULL), vdup_n_u8((unsigned char)bytewidth));
+  uint8x8_t a, x, r;
+  size_t i = bytewidth;
+
+  if(length < bytewidth + 8) return i;
+  a = vld1_u8(recon); /*the pixel to the left*/
+
+  for(; i + 8 <= length; i += bytewidth)
+  {
+    x = vld1_u8(&scanline[i]);
+    if(filterType == 1)
+    {
+      r = vadd_u8(x, a);
+    }
+    else if(filterType == 3)
+    {
+      r = vadd_u8(x, vhadd_u8(a, vld1_u8(&precon[i])));
+    }
+    else
+    {
+      r = vadd_u8(x, paethNEON(a, vld1_u8(&precon[i]), vld1_u8(&precon[i - bytewidth])));
+    }
+    vst1_u8(&recon[i], vbsl_u8(mask, r, x));
+    a = r;
+  }
+  return i;
+}
+#endif /*LODEPNG_NEON*/
+
+/*
+Unfilters the start of the scanline with vector instructions where possible.
+This is the whole scanline but a tail for the Up filter (filterType 2), and
+for Sub, Average and Paeth (1, 3, 4) with pixels of 3 to 8 bytes, from after
+the first pixel, which must be done already. precon must not be NULL for 2, 3
+and 4. Returns the position of the first byte that is not unfiltered yet.
+The pixels are stored 8 bytes at a time, which would overwrite bytes of scanline
+that are not read yet if recon overlaps it at a lower address, as for Adam7
+where the passes are unfiltered in place. Those are done one byte at a time.
+*/
+static size_t unfilterVector(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                             size_t bytewidth, unsigned char filterType, size_t length)
+{
+  int pixels = bytewidth >= 3 && bytewidth <= 8
+      && (recon == scanline || recon + length <= scanline || scanline + length <= recon);
+#if defined(LODEPNG_SSE2)
+  if(has_sse2 < 0) has_sse2 = detectSSE2();
+  if(has_sse2)
+  {
+    if(filterType == 2) return unfilterUpSSE2(recon, scanline, precon, length);
+    if(pixels) return unfilterPixelsSSE2(recon, scanline, precon, bytewidth, filterType, length);
+  }
+#elif defined(LODEPNG_NEON)
+  if(filterType == 2) return unfilterUpNEON(recon, scanline, precon, length);
+  if(pixels) return unfilterPixelsNEON(recon, scanline, precon, bytewidth, filterType, length);
+#else
+  (void)pixels;
+  (void)recon;
+  (void)scanline;
+  (void)precon;
+  (void)length;
+#endif
+  return filterType == 2 ? 0 : bytewidth;
+}
+
 static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
                                  size_t bytewidth, unsigned char filterType, size_t length)
 {
@@ -4208,12 +4829,14 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
       break;
     case 1:
       for(i = 0; i < bytewidth; i++) recon[i] = scanline[i];
-      for(i = bytewidth; i < length; i++) recon[i] = scanline[i] + recon[i - bytewidth];
+      i = unfilterVector(recon, scanline, precon, bytewidth, 1, length);
+      for(; i < length; i++) recon[i] = scanline[i] + recon[i - bytewidth];
       break;
     case 2:
       if(precon)
       {
-        for(i = 0; i < length; i++) recon[i] = scanline[i] + precon[i];
+        i = unfilterVector(recon, scanline, precon, bytewidth, 2, length);
+        for(; i < length; i++) recon[i] = scanline[i] + precon[i];
       }
       else
       {
@@ -4224,7 +4847,8 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
       if(precon)
       {
         for(i = 0; i < bytewidth; i++) recon[i] = scanline[i] + precon[i] / 2;
-        for(i = bytewidth; i < length; i++) recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) / 2);
+        i = unfilterVector(recon, scanline, precon, bytewidth, 3, length);
+        for(; i < length; i++) recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) / 2);
       }
       else
       {
@@ -4239,7 +4863,8 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
         {
           recon[i] = (scanline[i] + precon[i]); /*paethPredictor(0, precon[i], 0) is always precon[i]*/
         }
-        for(i = bytewidth; i < length; i++)
+        i = unfilterVector(recon, scanline, precon, bytewidth, 4, length);
+        for(; i < length; i++)
         {
           recon[i] = (scanline[i] + paethPredictor(recon[i - bytewidth], precon[i], precon[i - bytewidth]));
         }
@@ -4250,9 +4875,10 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
         {
           recon[i] = scanline[i];
         }
-        for(i = bytewidth; i < length; i++)
+        /*paethPredictor(recon[i - bytewidth], 0, 0) is always recon[i - bytewidth]: the Sub filter*/
+        i = unfilterVector(recon, scanline, precon, bytewidth, 1, length);
+        for(; i < length; i++)
         {
-          /*paethPredictor(recon[i - bytewidth], 0, 0) is always recon[i - bytewidth]*/
           recon[i] = (scanline[i] + recon[i - bytewidth]);
         }
       }
@@ -4748,8 +5374,8 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
 {
   unsigned char IEND = 0;
   const unsigned char* chunk;
-  size_t i;
-  ucvector idat; /*the data from idat chunks*/
+  InflateSpan* idat = 0; /*the data of the idat chunks, which is not copied out of the in buffer*/
+  size_t numidat = 0, allocidat = 0;
 
   /*for unknown chunk order*/
   unsigned unknown = 0;
@@ -4763,7 +5389,6 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
   if(state->error) return;
 
-  ucvector_init(&idat);
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
@@ -4791,9 +5416,17 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     /*IDAT chunk, containing compressed image data*/
     if(lodepng_chunk_type_equals(chunk, "IDAT"))
     {
-      size_t oldsize = idat.size;
-      if(!ucvector_resize(&idat, oldsize + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
-      for(i = 0; i < chunkLength; i++) idat.data[oldsize + i] = data[i];
+      if(numidat == allocidat)
+      {
+        size_t newalloc = allocidat ? allocidat * 2 : 8;
+        void* newidat = lodepng_realloc(idat, newalloc * sizeof(InflateSpan));
+        if(!newidat) CERROR_BREAK(state->error, 83 /*alloc fail*/);
+        idat = (InflateSpan*)newidat;
+        allocidat = newalloc;
+      }
+      idat[numidat].data = data;
+      idat[numidat].size = chunkLength;
+      numidat++;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
       critical_pos = 3;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
@@ -4900,8 +5533,8 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     if(!state->error)
     {
       /*decompress with the Zlib decompressor*/
-      state->error = zlib_decompress(&scanlines.data, &scanlines.size, idat.data,
-                                     idat.size, &state->decoder.zlibsettings);
+      state->error = zlib_decompress_spans(&scanlines.data, &scanlines.size, idat,
+                                           numidat, &state->decoder.zlibsettings);
     }
 
     if(!state->error)
@@ -4916,7 +5549,7 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     ucvector_cleanup(&scanlines);
   }
 
-  ucvector_cleanup(&idat);
+  lodepng_free(idat);
 }
 
 unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
@@ -5346,72 +5979,253 @@ static unsigned addChunk_pHYs(ucvector* out, const LodePNGInfo* info)
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
-                           size_t length, size_t bytewidth, unsigned char filterType)
+#ifdef LODEPNG_SSE2
+/*like filterVector, with SSE2*/
+#if defined(__GNUC__)
+__attribute__ ((target("sse2")))
+#endif
+static size_t filterSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                         size_t length, size_t bytewidth, unsigned char filterType)
 {
-  size_t i;
-  switch(filterType)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  size_t i = filterType == 2 ? 0 : bytewidth;
+
+  for(; i + 16 <= length; i += 16)
   {
-    case 0: /*None*/
-      for(i = 0; i < length; i++) out[i] = scanline[i];
-      break;
-    case 1: /*Sub*/
-      if(prevline)
-      {
-        for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
-        for(i = bytewidth; i < length; i++) out[i] = scanline[i] - scanline[i - bytewidth];
-      }
-      else
-      {
-        for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
-        for(i = bytewidth; i < length; i++) out[i] = scanline[i] - scanline[i - bytewidth];
-      }
-      break;
-    case 2: /*Up*/
-      if(prevline)
-      {
-        for(i = 0; i < length; i++) out[i] = scanline[i] - prevline[i];
-      }
-      else
-      {
-        for(i = 0; i < length; i++) out[i] = scanline[i];
-      }
-      break;
-    case 3: /*Average*/
-      if(prevline)
-      {
-        for(i = 0; i < bytewidth; i++) out[i] = scanline[i] - prevline[i] / 2;
-        for(i = bytewidth; i < length; i++) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) / 2);
-      }
-      else
-      {
-        for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
-        for(i = bytewidth; i < length; i++) out[i] = scanline[i] - scanline[i - bytewidth] / 2;
-      }
-      break;
-    case 4: /*Paeth*/
-      if(prevline)
-      {
-        /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
-        for(i = 0; i < bytewidth; i++) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; i++)
-        {
-          out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
-        }
-      }
-      else
-      {
-        for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
-        /*paethPredictor(scanline[i - bytewidth], 0, 0) is always scanline[i - bytewidth]*/
-        for(i = bytewidth; i < length; i++) out[i] = (scanline[i] - scanline[i - bytewidth]);
-      }
-      break;
-    default: return; /*unexisting filter type given*/
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i a, b, c, pred;
+    if(filterType == 1)
+    {
+      pred = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+    }
+    else if(filterType == 2)
+    {
+      pred = _mm_loadu_si128((const __m128i*)&prevline[i]);
+    }
+    else if(filterType == 3)
+    {
+      /*avg_epu8 rounds up, while the filter rounds down*/
+      a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+      b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+      pred = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    }
+    else
+    {
+      a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+      b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+      c = _mm_loadu_si128((const __m128i*)&prevline[i - bytewidth]);
+      pred = _mm_packus_epi16(paethSSE2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero),
+                                        _mm_unpacklo_epi8(c, zero)),
+                              paethSSE2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero),
+                                        _mm_unpackhi_epi8(c, zero)));
+    }
+    _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, pred));
   }
+  return i;
 }
 
-/* log2 approximation. A slight bit faster than std::log. */
-static float flog2(float f)
+/*like filterSum, with SSE2, for the first length / 16 * 16 bytes, returns the amount of bytes done*/
+#if defined(__GNUC__)
+__attribute__ ((target("sse2")))
+#endif
+static size_t filterSumSSE2(size_t* sum, const unsigned char* data, size_t length, unsigned char filterType)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero; /*two sums of 64 bits*/
+  size_t i;
+
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)&data[i]);
+    /*the absolute value of a signed byte is the smaller of it and its negation as unsigned bytes*/
+    if(filterType != 0) v = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+  }
+#if defined(_M_X64) || defined(__x86_64__)
+  *sum = (size_t)_mm_cvtsi128_si64(acc) + (size_t)_mm_cvtsi128_si64(_mm_srli_si128(acc, 8));
+#else /*size_t has 32 bits here, so the low half of each sum is all it keeps anyway*/
+  *sum = (size_t)(unsigned)_mm_cvtsi128_si32(acc) + (size_t)(unsigned)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+  return i;
+}
+#endif /*LODEPNG_SSE2*/
+
+#ifdef LODEPNG_NEON
+/*like filterVector, with NEON*/
+static size_t filterNEON(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                         size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i = filterType == 2 ? 0 : bytewidth;
+
+  for(; i + 16 <= length; i += 16)
+  {
+    uint8x16_t pred;
+    if(filterType == 1)
+    {
+      pred = vld1q_u8(&scanline[i - bytewidth]);
+    }
+    else if(filterType == 2)
+    {
+      pred = vld1q_u8(&prevline[i]);
+    }
+    else if(filterType == 3)
+    {
+      pred = vhaddq_u8(vld1q_u8(&scanline[i - bytewidth]), vld1q_u8(&prevline[i]));
+    }
+    else
+    {
+      uint8x16_t a = vld1q_u8(&scanline[i - bytewidth]);
+      uint8x16_t b = vld1q_u8(&prevline[i]);
+      uint8x16_t c = vld1q_u8(&prevline[i - bytewidth]);
+      pred = vcombine_u8(paethNEON(vget_low_u8(a), vget_low_u8(b), vget_low_u8(c)),
+                         paethNEON(vget_high_u8(a), vget_high_u8(b), vget_high_u8(c)));
+    }
+    vst1q_u8(&out[i], vsubq_u8(vld1q_u8(&scanline[i]), pred));
+  }
+  return i;
+}
+
+/*like filterSumSSE2, with NEON*/
+static size_t filterSumNEON(size_t* sum, const unsigned char* data, size_t length, unsigned char filterType)
+{
+  const uint8x16_t zero = vdupq_n_u8(0);
+  uint64x2_t acc = vdupq_n_u64(0); /*two sums of 64 bits, like filterSumSSE2*/
+  size_t i;
+
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    uint8x16_t v = vld1q_u8(&data[i]);
+    /*the absolute value of a signed byte is the smaller of it and its negation as unsigned bytes*/
+    if(filterType != 0) v = vminq_u8(v, vsubq_u8(zero, v));
+    acc = vpadalq_u32(acc, vpaddlq_u16(vpaddlq_u8(v)));
+  }
+  *sum = (size_t)(vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1));
+  return i;
+}
+#endif /*LODEPNG_NEON*/
+
+/*
+Filters the scanline with vector instructions where possible, 16 bytes at a
+time. This is from the start for Up (filterType 2), and from after the first
+pixel for Sub, Average and Paeth (1, 3, 4), which must be done already.
+prevline must not be NULL for 2, 3 and 4. Returns the position of the first
+byte that is not filtered yet.
+*/
+static size_t filterVector(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                           size_t length, size_t bytewidth, unsigned char filterType)
+{
+#if defined(LODEPNG_SSE2)
+  if(has_sse2 < 0) has_sse2 = detectSSE2();
+  if(has_sse2) return filterSSE2(out, scanline, prevline, length, bytewidth, filterType);
+#elif defined(LODEPNG_NEON)
+  return filterNEON(out, scanline, prevline, length, bytewidth, filterType);
+#else
+  (void)out;
+  (void)scanline;
+  (void)prevline;
+  (void)length;
+#endif
+  return filterType == 2 ? 0 : bytewidth;
+}
+
+/*
+The sum of a filtered scanline for LFS_MINSUM: of the bytes as unsigned values
+for filter type None, and of their absolute values as signed values otherwise.
+*/
+static size_t filterSum(const unsigned char* data, size_t length, unsigned char filterType)
+{
+  size_t sum = 0, i = 0;
+#if defined(LODEPNG_SSE2)
+  if(has_sse2 < 0) has_sse2 = detectSSE2();
+  if(has_sse2) i = filterSumSSE2(&sum, data, length, filterType);
+#elif defined(LODEPNG_NEON)
+  i = filterSumNEON(&sum, data, length, filterType);
+#endif
+  if(filterType == 0)
+  {
+    for(; i < length; i++) sum += data[i];
+  }
+  else
+  {
+    for(; i < length; i++)
+    {
+      signed char s = (signed char)(data[i]);
+      sum += s < 0 ? -s : s;
+    }
+  }
+  return sum;
+}
+
+static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                           size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i;
+  switch(filterType)
+  {
+    case 0: /*None*/
+      for(i = 0; i < length; i++) out[i] = scanline[i];
+      break;
+    case 1: /*Sub*/
+      for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
+      i = filterVector(out, scanline, prevline, length, bytewidth, 1);
+      for(; i < length; i++) out[i] = scanline[i] - scanline[i - bytewidth];
+      break;
+    case 2: /*Up*/
+      if(prevline)
+      {
+        i = filterVector(out, scanline, prevline, length, bytewidth, 2);
+        for(; i < length; i++) out[i] = scanline[i] - prevline[i];
+      }
+      else
+      {
+        for(i = 0; i < length; i++) out[i] = scanline[i];
+      }
+      break;
+    case 3: /*Average*/
+      if(prevline)
+      {
+        for(i = 0; i < bytewidth; i++) out[i] = scanline[i] - prevline[i] / 2;
+        i = filterVector(out, scanline, prevline, length, bytewidth, 3);
+        for(; i < length; i++) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) / 2);
+      }
+      else
+      {
+        for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
+        for(i = bytewidth; i < length; i++) out[i] = scanline[i] - scanline[i - bytewidth] / 2;
+      }
+      break;
+    case 4: /*Paeth*/
+      if(prevline)
+      {
+        /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
+        for(i = 0; i < bytewidth; i++) out[i] = (scanline[i] - prevline[i]);
+        i = filterVector(out, scanline, prevline, length, bytewidth, 4);
+        for(; i < length; i++)
+        {
+          out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
+        }
+      }
+      else
+      {
+        for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
+        /*paethPredictor(scanline[i - bytewidth], 0, 0) is always scanline[i - bytewidth]: the Sub filter*/
+        i = filterVector(out, scanline, prevline, length, bytewidth, 1);
+        for(; i < length; i++) out[i] = (scanline[i] - scanline[i - bytewidth]);
+      }
+      break;
+    default: return; /*unexisting filter type given*/
+  }
+}
+
+void lodepng_filter_scanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                             size_t length, size_t bytewidth, unsigned char filterType)
+{
+  filterScanline(out, scanline, prevline, length, bytewidth, filterType);
+}
+
+/* log2 approximation. A slight bit faster than std::log. */
+static float flog2(float f)
 {
   float result = 0;
   while(f > 32) { result += 4; f /= 16; }
@@ -5419,13 +6233,183 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+/*deflate window size and longest match, and the bits of the hash of 3 bytes used by LFS_BRUTE_FORCE*/
+#define BRUTE_WINDOW 32768
+#define BRUTE_MAX_LENGTH 258
+#define BRUTE_HASH_BITS 15
+/*the amount of earlier positions with the same hash that are tried for a match*/
+#define BRUTE_MAX_CHAIN 16
+
+/*
+State of LFS_BRUTE_FORCE. The filtered scanlines chosen so far are the data
+that will be compressed: it has an LZ77 hash chain over them and the counts of
+the deflate symbols found in them, from which it estimates the size in bits of
+each filter attempt for the next scanline, as if appended to them.
+*/
+typedef struct BruteForce
+{
+  int* head; /*hash of 3 bytes to the last position with it, -1 if none*/
+  int* prev; /*position modulo BRUTE_WINDOW to the previous position with the same hash*/
+  int* undo; /*head before each position inserted by an attempt, to take the attempt back*/
+  size_t hashed; /*the positions before this are in the hash chain*/
+  unsigned ll_count[286]; /*counts of literal/length symbols*/
+  unsigned d_count[30]; /*counts of distance symbols*/
+  float ll_cost[286]; /*estimated bits of each literal/length symbol*/
+  float d_cost[30]; /*estimated bits of each distance symbol*/
+} BruteForce;
+
+static unsigned BruteForce_init(BruteForce* bf, size_t linebytes)
+{
+  size_t i;
+  bf->head = (int*)lodepng_malloc(sizeof(int) << BRUTE_HASH_BITS);
+  bf->prev = (int*)lodepng_malloc(sizeof(int) * BRUTE_WINDOW);
+  bf->undo = (int*)lodepng_malloc(sizeof(int) * (linebytes + 3));
+  bf->hashed = 0;
+  if(!bf->head || !bf->prev || !bf->undo) return 83; /*alloc fail*/
+  for(i = 0; i < ((size_t)1 << BRUTE_HASH_BITS); i++) bf->head[i] = -1;
+  for(i = 0; i < 286; i++) bf->ll_count[i] = 0;
+  for(i = 0; i < 30; i++) bf->d_count[i] = 0;
+  return 0;
+}
+
+static void BruteForce_cleanup(BruteForce* bf)
+{
+  lodepng_free(bf->head);
+  lodepng_free(bf->prev);
+  lodepng_free(bf->undo);
+}
+
+/*estimates the bits of each symbol from the counts, every symbol counts as seen once more than it was*/
+static void BruteForce_updateCosts(BruteForce* bf)
+{
+  unsigned i, total;
+  for(total = 286, i = 0; i < 286; i++) total += bf->ll_count[i];
+  for(i = 0; i < 286; i++) bf->ll_cost[i] = flog2((float)total / (bf->ll_count[i] + 1));
+  for(total = 30, i = 0; i < 30; i++) total += bf->d_count[i];
+  for(i = 0; i < 30; i++) bf->d_cost[i] = flog2((float)total / (bf->d_count[i] + 1));
+}
+
+static unsigned bruteHash(const unsigned char* data)
+{
+  return ((data[0] << 10) ^ (data[1] << 5) ^ data[2]) & ((1u << BRUTE_HASH_BITS) - 1u);
+}
+
+/*
+adds the positions before pos to the hash chain, as far as their 3 bytes are
+before end, remembering the heads they replace in undo from position first on
+*/
+static void BruteForce_insert(BruteForce* bf, const unsigned char* data, size_t pos, size_t end, size_t first)
+{
+  for(; bf->hashed < pos && bf->hashed + 3 <= end; bf->hashed++)
+  {
+    unsigned hashval = bruteHash(&data[bf->hashed]);
+    bf->undo[bf->hashed - first] = bf->head[hashval];
+    bf->prev[bf->hashed % BRUTE_WINDOW] = bf->head[hashval];
+    bf->head[hashval] = (int)bf->hashed;
+  }
+}
+
+/*
+LZ77-encodes data[start..end) greedily after the earlier data, and returns its
+estimated size in bits. If commit, the positions stay in the hash chain and the
+symbols are counted, otherwise the hash chain is restored afterwards.
+*/
+static float BruteForce_encode(BruteForce* bf, const unsigned char* data, size_t start, size_t end, int commit)
+{
+  float bits = 0;
+  size_t firsthashed = bf->hashed;
+  size_t pos = start;
+  while(pos < end)
+  {
+    unsigned length = 0, distance = 0;
+    BruteForce_insert(bf, data, pos, end, firsthashed);
+
+    if(pos + 3 <= end)
+    {
+      size_t maxlength = end - pos;
+      int candidate = bf->head[bruteHash(&data[pos])];
+      unsigned chain = BRUTE_MAX_CHAIN;
+      if(maxlength > BRUTE_MAX_LENGTH) maxlength = BRUTE_MAX_LENGTH;
+      while(candidate >= 0 && pos - candidate <= BRUTE_WINDOW && chain-- > 0)
+      {
+        int next;
+        /*only a match longer than the longest so far matters, try its last byte first*/
+        if(length == 0 || data[candidate + length] == data[pos + length])
+        {
+          size_t l = 0;
+          while(l < maxlength && data[candidate + l] == data[pos + l]) l++;
+          if(l > length)
+          {
+            length = (unsigned)l;
+            distance = (unsigned)(pos - candidate);
+            if(l == maxlength) break;
+          }
+        }
+        next = bf->prev[candidate % BRUTE_WINDOW];
+        if(next >= candidate) break; /*the entry was overwritten by a later position*/
+        candidate = next;
+      }
+    }
+
+    /*a length of only 3 with a long distance is rarely worth it, as in encodeLZ77*/
+    if(length < 3 || (length == 3 && distance > 4096))
+    {
+      bits += bf->ll_cost[data[pos]];
+      if(commit) bf->ll_count[data[pos]]++;
+      pos++;
+    }
+    else
+    {
+      unsigned long msb;
+      unsigned length_code = length - 3, length_extra = 0, dist_code = distance - 1, dist_extra = 0;
+      /*the codes as in addLengthDistance, length 11 and distance 5 have 1 extra bit*/
+      if(length == BRUTE_MAX_LENGTH) length_code = 28;
+      else if(length_code >= 8)
+      {
+        _BitScanReverse(&msb, length_code);
+        length_extra = (unsigned)msb - 2;
+        length_code = (length_code >> length_extra) + 4 * length_extra;
+      }
+      if(dist_code >= 4)
+      {
+        _BitScanReverse(&msb, dist_code);
+        dist_extra = (unsigned)msb - 1;
+        dist_code = (dist_code >> dist_extra) + 2 * dist_extra;
+      }
+      bits += bf->ll_cost[257 + length_code] + length_extra
+            + bf->d_cost[dist_code] + dist_extra;
+      if(commit)
+      {
+        bf->ll_count[257 + length_code]++;
+        bf->d_count[dist_code]++;
+      }
+      pos += length;
+    }
+  }
+
+  BruteForce_insert(bf, data, end, end, firsthashed);
+
+  if(!commit)
+  {
+    /*take back the positions of the attempt, in reverse*/
+    while(bf->hashed > firsthashed)
+    {
+      bf->hashed--;
+      bf->head[bruteHash(&data[bf->hashed])] = bf->undo[bf->hashed - firsthashed];
+    }
+  }
+  return bits;
+}
+
+static unsigned filter(unsigned char* out, const unsigned char* in, const unsigned char* prevline,
+                       unsigned w, unsigned h,
                        const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
 {
   /*
   For PNG filter method 0
   out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
   the scanlines with 1 extra byte per scanline
+  prevline is the scanline before the first one of in, or 0 if there is none
   */
 
   unsigned bpp = lodepng_get_bpp(info);
@@ -5433,7 +6417,6 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   size_t linebytes = (w * bpp + 7) / 8;
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
   unsigned x, y;
   unsigned error = 0;
   LodePNGFilterStrategy strategy = settings->filter_strategy;
@@ -5490,23 +6473,11 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
         {
           filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
 
-          /*calculate the sum of the result*/
-          sum[type] = 0;
-          if(type == 0)
-          {
-            for(x = 0; x < linebytes; x++) sum[type] += (unsigned char)(attempt[type].data[x]);
-          }
-          else
-          {
-            for(x = 0; x < linebytes; x++)
-            {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              signed char s = (signed char)(attempt[type].data[x]);
-              sum[type] += s < 0 ? -s : s;
-            }
-          }
+          /*calculate the sum of the result.
+          For differences, each byte should be treated as signed, values above 127 are negative
+          (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
+          This means filtertype 0 is almost never chosen, but that is justified.*/
+          sum[type] = filterSum(attempt[type].data, linebytes, type);
 
           /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
           if(type == 0 || sum[type] < smallest)
@@ -5532,28 +6503,46 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
     float smallest = 0;
     unsigned type, bestType = 0;
-    unsigned count[256];
+    /*four histograms, filled in turns, so that runs of the same byte don't wait on each other*/
+    unsigned count[4][256];
+    /*the part of the entropy of a byte value that is count times in a scanline, for every count*/
+    float* entropy;
 
-    for(type = 0; type < 5; type++)
+    entropy = (float*)lodepng_malloc((linebytes + 2) * sizeof(float));
+    if(!entropy) return 83; /*alloc fail*/
+    for(x = 0; x <= linebytes + 1; x++)
     {
-      ucvector_init(&attempt[type]);
-      if(!ucvector_resize(&attempt[type], linebytes)) return 83; /*alloc fail*/
+      float p = x / (float)(linebytes + 1);
+      entropy[x] = x == 0 ? 0 : flog2(1 / p) * p;
     }
 
-    for(y = 0; y < h; y++)
+    for(type = 0; type < 5; type++) ucvector_init(&attempt[type]);
+    for(type = 0; type < 5 && !error; type++)
+    {
+      if(!ucvector_resize(&attempt[type], linebytes)) error = 83; /*alloc fail*/
+    }
+
+    for(y = 0; y < h && !error; y++)
     {
       /*try the 5 filter types*/
       for(type = 0; type < 5; type++)
       {
+        const unsigned char* data = attempt[type].data;
         filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
-        for(x = 0; x < 256; x++) count[x] = 0;
-        for(x = 0; x < linebytes; x++) count[attempt[type].data[x]]++;
-        count[type]++; /*the filter type itself is part of the scanline*/
+        memset(count, 0, sizeof(count));
+        for(x = 0; x + 4 <= linebytes; x += 4)
+        {
+          count[0][data[x]]++;
+          count[1][data[x + 1]]++;
+          count[2][data[x + 2]]++;
+          count[3][data[x + 3]]++;
+        }
+        for(; x < linebytes; x++) count[0][data[x]]++;
+        count[0][type]++; /*the filter type itself is part of the scanline*/
         sum[type] = 0;
         for(x = 0; x < 256; x++)
         {
-          float p = count[x] / (float)(linebytes + 1);
-          sum[type] += count[x] == 0 ? 0 : flog2(1 / p) * p;
+          sum[type] += entropy[count[0][x] + count[1][x] + count[2][x] + count[3][x]];
         }
         /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
         if(type == 0 || sum[type] < smallest)
@@ -5571,6 +6560,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     }
 
     for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
+    lodepng_free(entropy);
   }
   else if(strategy == LFS_PREDEFINED)
   {
@@ -5587,40 +6577,35 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   else if(strategy == LFS_BRUTE_FORCE)
   {
     /*brute force filter chooser.
-    deflate the scanline after every filter attempt to see which one deflates best.
-    This is very slow and gives only slightly smaller, sometimes even larger, result*/
-    size_t size[5];
+    estimate the compressed size of the scanline after every filter attempt, appended to the
+    scanlines chosen before, to see which one deflates best. This is an LZ77 encoding of only
+    the scanline, which can refer to the earlier data, with symbol sizes estimated from the
+    symbols of the earlier data, so the earlier scanlines are not compressed again.*/
+    BruteForce bf;
+    float size[5];
     ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
-    size_t smallest = 0;
+    float smallest = 0;
     unsigned type = 0, bestType = 0;
-    unsigned char* dummy;
-    LodePNGCompressSettings zlibsettings = settings->zlibsettings;
-    /*use fixed tree on the attempts so that the tree is not adapted to the filtertype on purpose,
-    to simulate the true case where the tree is the same for the whole image. Sometimes it gives
-    better result with dynamic tree anyway. Using the fixed tree sometimes gives worse, but in rare
-    cases better compression. It does make this a bit less slow, so it's worth doing this.*/
-    zlibsettings.btype = 1;
-    /*a custom encoder likely doesn't read the btype setting and is optimized for complete PNG
-    images only, so disable it*/
-    zlibsettings.custom_zlib = 0;
-    zlibsettings.custom_deflate = 0;
-    for(type = 0; type < 5; type++)
+
+    for(type = 0; type < 5; type++) ucvector_init(&attempt[type]);
+    error = BruteForce_init(&bf, linebytes);
+    for(type = 0; type < 5 && !error; type++)
     {
-      ucvector_init(&attempt[type]);
-      ucvector_resize(&attempt[type], linebytes); /*todo: give error if resize failed*/
+      if(!ucvector_resize(&attempt[type], linebytes)) error = 83; /*alloc fail*/
     }
-    for(y = 0; y < h; y++) /*try the 5 filter types*/
+
+    for(y = 0; y < h && !error; y++)
     {
-      for(type = 0; type < 5; type++)
+      /*the scanline, with its filter type byte, in the out buffer*/
+      unsigned char* line = &out[y * (linebytes + 1)];
+      size_t start = y * (linebytes + 1), end = start + linebytes + 1;
+      BruteForce_updateCosts(&bf);
+      for(type = 0; type < 5; type++) /*try the 5 filter types*/
       {
-        unsigned testsize = attempt[type].size;
-        /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
-
         filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
-        size[type] = 0;
-        dummy = 0;
-        zlib_compress(&dummy, &size[type], attempt[type].data, testsize, &zlibsettings);
-        lodepng_free(dummy);
+        line[0] = type;
+        for(x = 0; x < linebytes; x++) line[1 + x] = attempt[type].data[x];
+        size[type] = BruteForce_encode(&bf, out, start, end, 0);
         /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
         if(type == 0 || size[type] < smallest)
         {
@@ -5629,10 +6614,12 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
         }
       }
       prevline = &in[y * linebytes];
-      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x < linebytes; x++) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
+      line[0] = bestType; /*the first byte of a scanline will be the filter type*/
+      for(x = 0; x < linebytes; x++) line[1 + x] = attempt[bestType].data[x];
+      BruteForce_encode(&bf, out, start, end, 1);
     }
     for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
+    BruteForce_cleanup(&bf);
   }
   else return 88; /* unknown filter strategy */
 
@@ -5721,52 +6708,87 @@ static void Adam7_interlace(unsigned char* out, const unsigned char* in, unsigne
   }
 }
 
-/*out must be buffer big enough to contain uncompressed IDAT chunk data, and in must contain the full image.
-return value is error**/
-static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                    unsigned w, unsigned h,
-                                    const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings)
+/*
+Puts the image, given in the PNG's colortype, in the layout of the uncompressed IDAT chunk data without the filter
+bytes: Adam7 interlaced if the PNG is, and with padding bits at the end of each scanline if needed. If neither is
+needed, *out is set to 0, in already has this layout.
+return value is error
+*/
+static unsigned layoutScanlines(unsigned char** out, const unsigned char* in, unsigned w, unsigned h,
+                                const LodePNGInfo* info_png)
 {
-  /*
-  This function converts the pure 2D image with the PNG's colortype, into filtered-padded-interlaced data. Steps:
-  *) if no Adam7: 1) add padding bits (= posible extra bits per scanline if bpp < 8) 2) filter
-  *) if adam7: 1) Adam7_interlace 2) 7x add padding bits 3) 7x filter
-  */
   unsigned bpp = lodepng_get_bpp(&info_png->color);
   unsigned error = 0;
 
+  *out = 0;
   if(info_png->interlace_method == 0)
   {
-    *outsize = h + (h * ((w * bpp + 7) / 8)); /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)lodepng_malloc(*outsize);
-    if(!(*out) && (*outsize)) error = 83; /*alloc fail*/
+    /*non multiple of 8 bits per scanline, padding bits needed per scanline*/
+    if(bpp < 8 && w * bpp != ((w * bpp + 7) / 8) * 8)
+    {
+      *out = (unsigned char*)lodepng_malloc(h * ((w * bpp + 7) / 8));
+      if(!(*out)) error = 83; /*alloc fail*/
+      else addPaddingBits(*out, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
+    }
+  }
+  else /*interlace_method is 1 (Adam7)*/
+  {
+    unsigned passw[7], passh[7];
+    size_t filter_passstart[8], padded_passstart[8], passstart[8];
+    unsigned char* adam7;
+
+    Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+
+    adam7 = (unsigned char*)lodepng_malloc(passstart[7]);
+    if(!adam7 && passstart[7]) error = 83; /*alloc fail*/
 
     if(!error)
     {
-      /*non multiple of 8 bits per scanline, padding bits needed per scanline*/
-      if(bpp < 8 && w * bpp != ((w * bpp + 7) / 8) * 8)
+      Adam7_interlace(adam7, in, w, h, bpp);
+      if(bpp < 8)
       {
-        unsigned char* padded = (unsigned char*)lodepng_malloc(h * ((w * bpp + 7) / 8));
-        if(!padded) error = 83; /*alloc fail*/
-        if(!error)
+        unsigned i;
+        *out = (unsigned char*)lodepng_malloc(padded_passstart[7]);
+        if(!(*out) && padded_passstart[7]) error = 83; /*alloc fail*/
+        for(i = 0; i < 7 && !error; i++)
         {
-          addPaddingBits(padded, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
-          error = filter(*out, padded, w, h, &info_png->color, settings);
+          addPaddingBits(&(*out)[padded_passstart[i]], &adam7[passstart[i]],
+                         ((passw[i] * bpp + 7) / 8) * 8, passw[i] * bpp, passh[i]);
         }
-        lodepng_free(padded);
-      }
-      else
-      {
-        /*we can immediatly filter into the out buffer, no other steps needed*/
-        error = filter(*out, in, w, h, &info_png->color, settings);
+        lodepng_free(adam7);
       }
+      /*with whole bytes per pixel, the passes need no padding*/
+      else *out = adam7;
     }
   }
+
+  return error;
+}
+
+/*
+Filters the scanlines as laid out by layoutScanlines into *out, which is allocated to the size of the uncompressed
+IDAT chunk data.
+return value is error
+*/
+static unsigned filterScanlines(unsigned char** out, size_t* outsize, const unsigned char* scanlines,
+                                unsigned w, unsigned h,
+                                const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings)
+{
+  unsigned bpp = lodepng_get_bpp(&info_png->color);
+  unsigned error = 0;
+
+  if(info_png->interlace_method == 0)
+  {
+    *outsize = h + (h * ((w * bpp + 7) / 8)); /*image size plus an extra byte per scanline + possible padding bits*/
+    *out = (unsigned char*)lodepng_malloc(*outsize);
+    if(!(*out) && (*outsize)) error = 83; /*alloc fail*/
+
+    if(!error) error = filter(*out, scanlines, 0, w, h, &info_png->color, settings);
+  }
   else /*interlace_method is 1 (Adam7)*/
   {
     unsigned passw[7], passh[7];
     size_t filter_passstart[8], padded_passstart[8], passstart[8];
-    unsigned char* adam7;
 
     Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
@@ -5774,42 +6796,140 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
     *out = (unsigned char*)lodepng_malloc(*outsize);
     if(!(*out)) error = 83; /*alloc fail*/
 
-    adam7 = (unsigned char*)lodepng_malloc(passstart[7]);
-    if(!adam7 && passstart[7]) error = 83; /*alloc fail*/
-
     if(!error)
     {
       unsigned i;
-
-      Adam7_interlace(adam7, in, w, h, bpp);
       for(i = 0; i < 7; i++)
       {
-        if(bpp < 8)
-        {
-          unsigned char* padded = (unsigned char*)lodepng_malloc(padded_passstart[i + 1] - padded_passstart[i]);
-          if(!padded) ERROR_BREAK(83); /*alloc fail*/
-          addPaddingBits(padded, &adam7[passstart[i]],
-                         ((passw[i] * bpp + 7) / 8) * 8, passw[i] * bpp, passh[i]);
-          error = filter(&(*out)[filter_passstart[i]], padded,
-                         passw[i], passh[i], &info_png->color, settings);
-          lodepng_free(padded);
-        }
-        else
-        {
-          error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]],
-                         passw[i], passh[i], &info_png->color, settings);
-        }
-
+        error = filter(&(*out)[filter_passstart[i]], &scanlines[padded_passstart[i]], 0,
+                       passw[i], passh[i], &info_png->color, settings);
         if(error) break;
       }
     }
+  }
 
-    lodepng_free(adam7);
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+The filtered scanlines of a non-interlaced image for custom_deflate_stream. They are filtered one band of
+rows at a time as they are read, the only thing needed from before a band is the unfiltered scanline above it.
+Only for filter strategies that choose the filter of a scanline from that scanline and the one above it.
+*/
+typedef struct FilterStream
+{
+  const unsigned char* scanlines; /*the unfiltered scanlines, as laid out by layoutScanlines*/
+  unsigned w, h;
+  const LodePNGColorMode* color;
+  const LodePNGEncoderSettings* settings;
+  size_t linebytes; /*the width of a scanline in bytes, not including the filter type*/
+  unsigned bandrows; /*the amount of rows filtered at once*/
+  unsigned char* band; /*the filtered rows y0 to y1 - 1, with their filter type*/
+  unsigned y0, y1;
+  size_t bandpos; /*position of the band in the filtered data*/
+  unsigned error;
+} FilterStream;
+
+/*a band of about this many bytes is filtered at once*/
+#define FILTER_BAND_SIZE 1048576
+
+static unsigned filter_stream_init(FilterStream* stream, const unsigned char* scanlines, unsigned w, unsigned h,
+                                   const LodePNGColorMode* color, const LodePNGEncoderSettings* settings)
+{
+  stream->scanlines = scanlines;
+  stream->w = w;
+  stream->h = h;
+  stream->color = color;
+  stream->settings = settings;
+  stream->linebytes = (w * lodepng_get_bpp(color) + 7) / 8;
+  stream->bandrows = FILTER_BAND_SIZE / (stream->linebytes + 1);
+  if(stream->bandrows < 1) stream->bandrows = 1;
+  if(stream->bandrows > h) stream->bandrows = h;
+  stream->band = (unsigned char*)lodepng_malloc(stream->bandrows * (stream->linebytes + 1));
+  stream->y0 = stream->y1 = 0;
+  stream->bandpos = 0;
+  stream->error = 0;
+  return stream->band || !h ? 0 : 83; /*alloc fail*/
+}
+
+static void filter_stream_cleanup(FilterStream* stream)
+{
+  lodepng_free(stream->band);
+}
+
+/*the read function given to custom_deflate_stream*/
+static void filterStreamRead(unsigned char* data, size_t pos, size_t size, void* context)
+{
+  FilterStream* stream = (FilterStream*)context;
+  size_t rowsize = stream->linebytes + 1;
+  if(pos == 0)
+  {
+    /*start over*/
+    stream->y0 = stream->y1 = 0;
+    stream->bandpos = 0;
+  }
+  while(size > 0)
+  {
+    size_t offset, amount;
+    if(pos >= stream->bandpos + (stream->y1 - stream->y0) * rowsize)
+    {
+      /*filter the next band*/
+      LodePNGEncoderSettings settings = *stream->settings;
+      unsigned y0 = stream->y1;
+      unsigned y1 = stream->h - y0 < stream->bandrows ? stream->h : y0 + stream->bandrows;
+      if(y0 >= y1) break; /*read beyond the end*/
+      if(settings.predefined_filters) settings.predefined_filters += y0;
+      stream->bandpos += (stream->y1 - stream->y0) * rowsize;
+      stream->y0 = y0;
+      stream->y1 = y1;
+      if(!stream->error)
+      {
+        stream->error = filter(stream->band, &stream->scanlines[y0 * stream->linebytes],
+                               y0 ? &stream->scanlines[(y0 - 1) * stream->linebytes] : 0,
+                               stream->w, y1 - y0, stream->color, &settings);
+      }
+    }
+    offset = pos - stream->bandpos;
+    amount = (stream->y1 - stream->y0) * rowsize - offset;
+    if(amount > size) amount = size;
+    __movsb(data, &stream->band[offset], amount);
+    data += amount;
+    pos += amount;
+    size -= amount;
   }
+}
+
+/*like addChunk_IDAT, with the scanlines filtered while custom_deflate_stream reads them*/
+static unsigned addChunk_IDAT_stream(ucvector* out, const unsigned char* scanlines, unsigned w, unsigned h,
+                                     const LodePNGInfo* info_png, LodePNGEncoderSettings* settings)
+{
+  ucvector zlibdata;
+  FilterStream stream;
+  unsigned error = filter_stream_init(&stream, scanlines, w, h, &info_png->color, settings);
+
+  ucvector_init(&zlibdata);
+  if(!error)
+  {
+    error = zlib_compress_stream(&zlibdata.data, &zlibdata.size, h * (stream.linebytes + 1),
+                                 filterStreamRead, &stream, &settings->zlibsettings);
+  }
+  if(!error) error = stream.error;
+  if(!error) error = addChunk(out, "IDAT", zlibdata.data, zlibdata.size);
+  ucvector_cleanup(&zlibdata);
+  filter_stream_cleanup(&stream);
 
   return error;
 }
 
+/*whether the IDAT chunk can be made with addChunk_IDAT_stream*/
+static unsigned canStreamIDAT(const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings)
+{
+  return settings->zlibsettings.custom_deflate_stream && !settings->zlibsettings.custom_zlib
+      && info_png->interlace_method == 0 && settings->filter_strategy != LFS_BRUTE_FORCE;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 /*
 palette must have 4 * palettesize bytes allocated, and given in format RGBARGBARGBARGBA...
 returns 0 if the palette is opaque,
@@ -5849,25 +6969,40 @@ static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t data
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-unsigned lodepng_encode(unsigned char** out, size_t* outsize,
-                        const unsigned char* image, unsigned w, unsigned h,
-                        LodePNGState* state)
+void lodepng_prepared_init(LodePNGPreparedImage* prepared)
 {
-  LodePNGInfo info;
-  ucvector outv;
-  unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
-  size_t datasize = 0;
+  prepared->w = prepared->h = 0;
+  lodepng_info_init(&prepared->info);
+  prepared->scanlines = 0;
+  prepared->buffer = 0;
+}
 
-  /*provide some proper output values if error will happen*/
-  *out = 0;
-  *outsize = 0;
-  state->error = 0;
+void lodepng_prepared_cleanup(LodePNGPreparedImage* prepared)
+{
+  lodepng_info_cleanup(&prepared->info);
+  lodepng_free(prepared->buffer);
+  prepared->scanlines = 0;
+  prepared->buffer = 0;
+}
 
-  lodepng_info_init(&info);
-  lodepng_info_copy(&info, &state->info_png);
+unsigned lodepng_prepare_encode(LodePNGPreparedImage* prepared,
+                                const unsigned char* image, unsigned w, unsigned h,
+                                LodePNGState* state)
+{
+  LodePNGInfo* info = &prepared->info;
+  unsigned char* converted = 0;
+  const unsigned char* pngimage = image; /*the image in the color type of the PNG*/
+
+  lodepng_free(prepared->buffer);
+  prepared->scanlines = 0;
+  prepared->buffer = 0;
+  prepared->w = w;
+  prepared->h = h;
+  state->error = lodepng_info_copy(info, &state->info_png);
+  if(state->error) return state->error;
 
-  if((info.color.colortype == LCT_PALETTE || state->encoder.force_palette)
-      && (info.color.palettesize == 0 || info.color.palettesize > 256))
+  if((info->color.colortype == LCT_PALETTE || state->encoder.force_palette)
+      && (info->color.palettesize == 0 || info->color.palettesize > 256))
   {
     state->error = 68; /*invalid palette size, it is only allowed to be 1-256*/
     return state->error;
@@ -5875,44 +7010,98 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
 
   if(state->encoder.auto_convert != LAC_NO)
   {
-    state->error = doAutoChooseColor(&info.color, image, w, h, &state->info_raw,
+    state->error = doAutoChooseColor(&info->color, image, w, h, &state->info_raw,
                                      state->encoder.auto_convert);
   }
   if(state->error) return state->error;
 
-  if(state->encoder.zlibsettings.windowsize > 32768)
-  {
-    CERROR_RETURN_ERROR(state->error, 60); /*error: windowsize larger than allowed*/
-  }
-  if(state->encoder.zlibsettings.btype > 2)
-  {
-    CERROR_RETURN_ERROR(state->error, 61); /*error: unexisting btype*/
-  }
   if(state->info_png.interlace_method > 1)
   {
     CERROR_RETURN_ERROR(state->error, 71); /*error: unexisting interlace mode*/
   }
 
-  state->error = checkColorValidity(info.color.colortype, info.color.bitdepth);
+  state->error = checkColorValidity(info->color.colortype, info->color.bitdepth);
   if(state->error) return state->error; /*error: unexisting color type given*/
   state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
   if(state->error) return state->error; /*error: unexisting color type given*/
 
-  if(!lodepng_color_mode_equal(&state->info_raw, &info.color))
+  if(!lodepng_color_mode_equal(&state->info_raw, &info->color))
   {
-    unsigned char* converted;
-    size_t size = (w * h * lodepng_get_bpp(&info.color) + 7) / 8;
+    size_t size = (w * h * lodepng_get_bpp(&info->color) + 7) / 8;
 
     converted = (unsigned char*)lodepng_malloc(size);
     if(!converted && size) state->error = 83; /*alloc fail*/
     if(!state->error)
     {
-      state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h, 0 /*fix_png*/);
+      state->error = lodepng_convert(converted, image, &info->color, &state->info_raw, w, h, 0 /*fix_png*/);
     }
-    if(!state->error) preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
+    pngimage = converted;
+  }
+  if(!state->error) state->error = layoutScanlines(&prepared->buffer, pngimage, w, h, info);
+
+  if(state->error) lodepng_free(converted);
+  else if(prepared->buffer)
+  {
     lodepng_free(converted);
+    prepared->scanlines = prepared->buffer;
+  }
+  else if(converted) prepared->scanlines = prepared->buffer = converted;
+  else prepared->scanlines = image;
+
+  return state->error;
+}
+
+unsigned lodepng_encode(unsigned char** out, size_t* outsize,
+                        const unsigned char* image, unsigned w, unsigned h,
+                        LodePNGState* state)
+{
+  LodePNGPreparedImage prepared;
+
+  /*provide some proper output values if error will happen*/
+  *out = 0;
+  *outsize = 0;
+
+  lodepng_prepared_init(&prepared);
+  if(!lodepng_prepare_encode(&prepared, image, w, h, state))
+  {
+    lodepng_encode_prepared(out, outsize, &prepared, state);
+  }
+  lodepng_prepared_cleanup(&prepared);
+
+  return state->error;
+}
+
+unsigned lodepng_encode_prepared(unsigned char** out, size_t* outsize,
+                                 const LodePNGPreparedImage* prepared, LodePNGState* state)
+{
+  const LodePNGInfo* info = &prepared->info;
+  ucvector outv;
+  unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
+  size_t datasize = 0;
+  int stream = 0; /*whether the IDAT chunk data is filtered while it's compressed instead*/
+
+  /*provide some proper output values if error will happen*/
+  *out = 0;
+  *outsize = 0;
+  state->error = 0;
+
+  if(state->encoder.zlibsettings.windowsize > 32768)
+  {
+    CERROR_RETURN_ERROR(state->error, 60); /*error: windowsize larger than allowed*/
+  }
+  if(state->encoder.zlibsettings.btype > 2)
+  {
+    CERROR_RETURN_ERROR(state->error, 61); /*error: unexisting btype*/
+  }
+
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(canStreamIDAT(info, &state->encoder)) stream = 1;
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  if(!stream)
+  {
+    state->error = filterScanlines(&data, &datasize, prepared->scanlines, prepared->w, prepared->h,
+                                   info, &state->encoder);
   }
-  else preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
 
   ucvector_init(&outv);
   while(!state->error) /*while only executed once, to break on error*/
@@ -5923,77 +7112,85 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     /*write signature and chunks*/
     writeSignature(&outv);
     /*IHDR*/
-    addChunk_IHDR(&outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
+    addChunk_IHDR(&outv, prepared->w, prepared->h, info->color.colortype, info->color.bitdepth, info->interlace_method);
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*unknown chunks between IHDR and PLTE*/
-    if(info.unknown_chunks_data[0])
+    if(info->unknown_chunks_data[0])
     {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[0], info.unknown_chunks_size[0]);
+      state->error = addUnknownChunks(&outv, info->unknown_chunks_data[0], info->unknown_chunks_size[0]);
       if(state->error) break;
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*PLTE*/
-    if(info.color.colortype == LCT_PALETTE)
+    if(info->color.colortype == LCT_PALETTE)
     {
-      addChunk_PLTE(&outv, &info.color);
+      addChunk_PLTE(&outv, &info->color);
     }
-    if(state->encoder.force_palette && (info.color.colortype == LCT_RGB || info.color.colortype == LCT_RGBA))
+    if(state->encoder.force_palette && (info->color.colortype == LCT_RGB || info->color.colortype == LCT_RGBA))
     {
-      addChunk_PLTE(&outv, &info.color);
+      addChunk_PLTE(&outv, &info->color);
     }
     /*tRNS*/
-    if(info.color.colortype == LCT_PALETTE && getPaletteTranslucency(info.color.palette, info.color.palettesize) != 0)
+    if(info->color.colortype == LCT_PALETTE && getPaletteTranslucency(info->color.palette, info->color.palettesize) != 0)
     {
-      addChunk_tRNS(&outv, &info.color);
+      addChunk_tRNS(&outv, &info->color);
     }
-    if((info.color.colortype == LCT_GREY || info.color.colortype == LCT_RGB) && info.color.key_defined)
+    if((info->color.colortype == LCT_GREY || info->color.colortype == LCT_RGB) && info->color.key_defined)
     {
-      addChunk_tRNS(&outv, &info.color);
+      addChunk_tRNS(&outv, &info->color);
     }
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*bKGD (must come between PLTE and the IDAt chunks*/
-    if(info.background_defined) addChunk_bKGD(&outv, &info);
+    if(info->background_defined) addChunk_bKGD(&outv, info);
     /*pHYs (must come before the IDAT chunks)*/
-    if(info.phys_defined) addChunk_pHYs(&outv, &info);
+    if(info->phys_defined) addChunk_pHYs(&outv, info);
 
     /*unknown chunks between PLTE and IDAT*/
-    if(info.unknown_chunks_data[1])
+    if(info->unknown_chunks_data[1])
     {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[1], info.unknown_chunks_size[1]);
+      state->error = addUnknownChunks(&outv, info->unknown_chunks_data[1], info->unknown_chunks_size[1]);
       if(state->error) break;
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*IDAT (multiple IDAT chunks must be consecutive)*/
+#ifdef LODEPNG_COMPILE_ZLIB
+    if(stream)
+    {
+      state->error = addChunk_IDAT_stream(&outv, prepared->scanlines, prepared->w, prepared->h,
+                                          info, &state->encoder);
+    }
+    else
+#endif /*LODEPNG_COMPILE_ZLIB*/
     state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
     if(state->error) break;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*tIME*/
-    if(info.time_defined) addChunk_tIME(&outv, &info.time);
+    if(info->time_defined) addChunk_tIME(&outv, &info->time);
     /*tEXt and/or zTXt*/
-    for(i = 0; i < info.text_num; i++)
+    for(i = 0; i < info->text_num; i++)
     {
-      if(strlen(info.text_keys[i]) > 79)
+      if(strlen(info->text_keys[i]) > 79)
       {
         state->error = 66; /*text chunk too large*/
         break;
       }
-      if(strlen(info.text_keys[i]) < 1)
+      if(strlen(info->text_keys[i]) < 1)
       {
         state->error = 67; /*text chunk too small*/
         break;
       }
       if(state->encoder.text_compression)
-        addChunk_zTXt(&outv, info.text_keys[i], info.text_strings[i], &state->encoder.zlibsettings);
+        addChunk_zTXt(&outv, info->text_keys[i], info->text_strings[i], &state->encoder.zlibsettings);
       else
-        addChunk_tEXt(&outv, info.text_keys[i], info.text_strings[i]);
+        addChunk_tEXt(&outv, info->text_keys[i], info->text_strings[i]);
     }
     /*LodePNG version id in text chunk*/
     if(state->encoder.add_id)
     {
       unsigned alread_added_id_text = 0;
-      for(i = 0; i < info.text_num; i++)
+      for(i = 0; i < info->text_num; i++)
       {
-        if(!strcmp(info.text_keys[i], "LodePNG"))
+        if(!strcmp(info->text_keys[i], "LodePNG"))
         {
           alread_added_id_text = 1;
           break;
@@ -6003,27 +7200,27 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
         addChunk_tEXt(&outv, "LodePNG", VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
     }
     /*iTXt*/
-    for(i = 0; i < info.itext_num; i++)
+    for(i = 0; i < info->itext_num; i++)
     {
-      if(strlen(info.itext_keys[i]) > 79)
+      if(strlen(info->itext_keys[i]) > 79)
       {
         state->error = 66; /*text chunk too large*/
         break;
       }
-      if(strlen(info.itext_keys[i]) < 1)
+      if(strlen(info->itext_keys[i]) < 1)
       {
         state->error = 67; /*text chunk too small*/
         break;
       }
       addChunk_iTXt(&outv, state->encoder.text_compression,
-                    info.itext_keys[i], info.itext_langtags[i], info.itext_transkeys[i], info.itext_strings[i],
+                    info->itext_keys[i], info->itext_langtags[i], info->itext_transkeys[i], info->itext_strings[i],
                     &state->encoder.zlibsettings);
     }
 
     /*unknown chunks between IDAT and IEND*/
-    if(info.unknown_chunks_data[2])
+    if(info->unknown_chunks_data[2])
     {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[2], info.unknown_chunks_size[2]);
+      state->error = addUnknownChunks(&outv, info->unknown_chunks_data[2], info->unknown_chunks_size[2]);
       if(state->error) break;
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
@@ -6033,7 +7230,6 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     break; /*this isn't really a while loop; no error happened so break out now!*/
   }
 
-  lodepng_info_cleanup(&info);
   lodepng_free(data);
   /*instead of cleaning the vector up, give it to the output*/
   *out = outv.data;
@@ -6042,6 +7238,14 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   return state->error;
 }
 
+unsigned lodepng_filter_prepared(unsigned char** out, size_t* outsize,
+                                 const LodePNGPreparedImage* prepared, const LodePNGEncoderSettings* settings)
+{
+  *out = 0;
+  *outsize = 0;
+  return filterScanlines(out, outsize, prepared->scanlines, prepared->w, prepared->h, &prepared->info, settings);
+}
+
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -6424,6 +7628,51 @@ unsigned encode(std::vector<unsigned char>& out,
   return encode(out, in.empty() ? 0 : &in[0], w, h, state);
 }
 
+PreparedImage::PreparedImage()
+{
+  lodepng_prepared_init(this);
+}
+
+PreparedImage::~PreparedImage()
+{
+  lodepng_prepared_cleanup(this);
+}
+
+unsigned prepareEncode(PreparedImage& prepared,
+                       const std::vector<unsigned char>& in, unsigned w, unsigned h,
+                       State& state)
+{
+  if(lodepng_get_raw_size(w, h, &state.info_raw) > in.size()) return 84;
+  return lodepng_prepare_encode(&prepared, in.empty() ? 0 : &in[0], w, h, &state);
+}
+
+unsigned encode(std::vector<unsigned char>& out, const PreparedImage& prepared, State& state)
+{
+  unsigned char* buffer;
+  size_t buffersize;
+  unsigned error = lodepng_encode_prepared(&buffer, &buffersize, &prepared, &state);
+  if(buffer)
+  {
+    out.insert(out.end(), &buffer[0], &buffer[buffersize]);
+    lodepng_free(buffer);
+  }
+  return error;
+}
+
+unsigned filterPrepared(std::vector<unsigned char>& out, const PreparedImage& prepared,
+                        const LodePNGEncoderSettings& settings)
+{
+  unsigned char* buffer;
+  size_t buffersize;
+  unsigned error = lodepng_filter_prepared(&buffer, &buffersize, &prepared, &settings);
+  if(buffer)
+  {
+    out.insert(out.end(), &buffer[0], &buffer[buffersize]);
+    lodepng_free(buffer);
+  }
+  return error;
+}
+
 #ifdef LODEPNG_COMPILE_DISK
 unsigned encode(const std::string& filename,
                 const unsigned char* in, unsigned w, unsigned h,
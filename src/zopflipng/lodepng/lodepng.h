@@ -303,6 +303,14 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned (*custom_deflate)(unsigned char**, size_t*,
                              const unsigned char*, size_t,
                              const LodePNGCompressSettings*);
+  /*use custom deflate encoder that reads its input of the given size in pieces instead (default: null).
+  It must get the input in order with read(data, pos, size, readcontext), with pos where the previous read
+  ended, or 0 to start over. The PNG encoder then filters non-interlaced images one band of scanlines at a
+  time as they are read, instead of holding the whole filtered image in memory, except with the
+  LFS_BRUTE_FORCE filter strategy, which needs all earlier scanlines. Ignored if custom_zlib is used.*/
+  unsigned (*custom_deflate_stream)(unsigned char**, size_t*, size_t,
+                                    void (*)(unsigned char*, size_t, size_t, void*), void*,
+                                    const LodePNGCompressSettings*);
 
   void* custom_context; /*optional custom settings for custom functions*/
 };
@@ -557,8 +565,8 @@ typedef enum LodePNGFilterStrategy
   on the image, this is better or worse than minsum.*/
   LFS_ENTROPY,
   /*
-  Brute-force-search PNG filters by compressing each filter for each scanline.
-  Experimental, very slow, and only rarely gives better compression than MINSUM.
+  Brute-force-search PNG filters by estimating the compressed size of each
+  filter for each scanline, as LZ77 data following the scanlines before it.
   */
   LFS_BRUTE_FORCE,
   /*use predefined_filters buffer: you specify the filter type for each scanline*/
@@ -674,6 +682,66 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+/*
+An image converted to the color type of the PNG and laid out in scanlines, ready to be
+filtered and compressed by lodepng_encode_prepared. This allows encoding the same image
+with several filter strategies or zlib settings, while the color type is chosen and the
+image converted only once.
+*/
+typedef struct LodePNGPreparedImage
+{
+  unsigned w, h;
+  /*the info of the PNG, with the color type chosen by auto_convert*/
+  LodePNGInfo info;
+  /*the uncompressed IDAT chunk data without the filter bytes: Adam7 interlaced if needed and
+  with padding bits at the end of the scanlines. This is buffer, or the image itself if
+  nothing had to be done to it.*/
+  const unsigned char* scanlines;
+  unsigned char* buffer; /*memory owned by this struct, or 0*/
+
+#ifdef LODEPNG_COMPILE_CPP
+  //For the lodepng::PreparedImage subclass.
+  virtual ~LodePNGPreparedImage(){}
+#endif
+} LodePNGPreparedImage;
+
+/*init and cleanup functions to use with this struct*/
+void lodepng_prepared_init(LodePNGPreparedImage* prepared);
+void lodepng_prepared_cleanup(LodePNGPreparedImage* prepared);
+
+/*
+Does the part of lodepng_encode that depends only on the image and the color settings
+of the state: choosing the color type (see auto_convert), converting the image to it,
+interlacing and adding padding bits. If the image needs none of this, prepared refers to
+the given image, which must then stay unchanged as long as prepared is used.
+*/
+unsigned lodepng_prepare_encode(LodePNGPreparedImage* prepared,
+                                const unsigned char* image, unsigned w, unsigned h,
+                                LodePNGState* state);
+
+/*
+Same as lodepng_encode, but for a prepared image. Only the filter and zlib settings of the
+encoder in the state are used, the PNG info is that of the state when preparing the image.
+*/
+unsigned lodepng_encode_prepared(unsigned char** out, size_t* outsize,
+                                 const LodePNGPreparedImage* prepared, LodePNGState* state);
+
+/*
+Filters one scanline of length bytes with PNG filter type filterType (0-4) into out.
+prevline is the unfiltered scanline above it, or 0 for the first scanline. bytewidth is
+the number of bytes per pixel, or 1 if a pixel is smaller than a byte.
+*/
+void lodepng_filter_scanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                             size_t length, size_t bytewidth, unsigned char filterType);
+
+/*
+Filters the scanlines of a prepared image with the filter strategy of settings, as
+lodepng_encode_prepared does, without compressing them. *out is allocated to the size of
+the uncompressed IDAT chunk data: each scanline preceded by its filter type byte.
+*/
+unsigned lodepng_filter_prepared(unsigned char** out, size_t* outsize,
+                                 const LodePNGPreparedImage* prepared, const LodePNGEncoderSettings* settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -749,6 +817,9 @@ buffer. It cannot be used to create gzip files however, and it only supports the
 part of zlib that is required for PNG, it does not support dictionaries.
 */
 
+/*Update a running Adler-32 checksum (start with 1), shared with zopfli*/
+extern "C" unsigned UpdateAdler32(unsigned adler, const unsigned char* data, size_t len);
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Inflate a buffer. Inflate is the decompression step of deflate. Out buffer must be freed after use.*/
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
@@ -847,6 +918,28 @@ unsigned encode(std::vector<unsigned char>& out,
 unsigned encode(std::vector<unsigned char>& out,
                 const std::vector<unsigned char>& in, unsigned w, unsigned h,
                 State& state);
+
+class PreparedImage : public LodePNGPreparedImage
+{
+  public:
+    PreparedImage();
+    virtual ~PreparedImage();
+
+  private:
+    //Not copyable, it may refer to the image it was prepared from.
+    PreparedImage(const PreparedImage& other);
+    PreparedImage& operator=(const PreparedImage& other);
+};
+
+//Same as lodepng_prepare_encode: in must stay unchanged as long as prepared is used.
+unsigned prepareEncode(PreparedImage& prepared,
+                       const std::vector<unsigned char>& in, unsigned w, unsigned h,
+                       State& state);
+//Same as other lodepng::encode, but for an image prepared with prepareEncode.
+unsigned encode(std::vector<unsigned char>& out, const PreparedImage& prepared, State& state);
+//Same as lodepng_filter_prepared, appending to out.
+unsigned filterPrepared(std::vector<unsigned char>& out, const PreparedImage& prepared,
+                        const LodePNGEncoderSettings& settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DISK
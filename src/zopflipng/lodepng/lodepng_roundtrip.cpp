@@ -0,0 +1,135 @@
+/*
+LodePNG round trip check
+
+Copyright (c) 2005-2012 Lode Vandevenne
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+    1. The origin of this software must not be misrepresented; you must not
+    claim that you wrote the original software. If you use this software
+    in a product, an acknowledgment in the product documentation would be
+    appreciated but is not required.
+
+    2. Altered source versions must be plainly marked as such, and must not be
+    misrepresented as being the original software.
+
+    3. This notice may not be removed or altered from any source
+    distribution.
+*/
+
+/*
+Encodes generated images in every color type and bit depth, with and without
+Adam7 interlacing and with every filter type, decodes them again and checks that
+the pixels are unchanged. This covers the vector filter and unfilter code paths,
+which depend on the pixel size and the scanline length, and the unfiltering of
+the Adam7 passes in place. Prints the failing cases and returns 1 if any.
+*/
+
+#include <stdio.h>
+#include <vector>
+
+#include "lodepng.h"
+#include "../../zopfli/crc.h"
+
+/*simple deterministic pseudo random generator, so failures are reproducible*/
+static unsigned nextRandom(unsigned* seed)
+{
+  *seed = *seed * 1103515245u + 12345u;
+  return (*seed >> 16) & 0x7fff;
+}
+
+/*
+Encodes and decodes one image, returns 0 if the pixels survive. The pixels are
+smooth with some noise, so that every filter type gets chosen sometimes.
+*/
+static int roundTrip(LodePNGColorType colortype, unsigned bitdepth, unsigned interlace,
+                     LodePNGFilterStrategy strategy, unsigned w, unsigned h, unsigned* seed)
+{
+  lodepng::State state;
+  std::vector<unsigned char> image, png, decoded;
+  std::vector<unsigned char> filters(h);
+  unsigned w2, h2, error, i;
+
+  state.info_raw.colortype = colortype;
+  state.info_raw.bitdepth = bitdepth;
+  if(colortype == LCT_PALETTE)
+  {
+    for(i = 0; i < (1u << bitdepth); i++)
+    {
+      lodepng_palette_add(&state.info_raw, nextRandom(seed), nextRandom(seed), nextRandom(seed), 255);
+    }
+  }
+  lodepng_color_mode_copy(&state.info_png.color, &state.info_raw);
+  state.info_png.interlace_method = interlace;
+  state.encoder.auto_convert = LAC_NO;
+  state.encoder.filter_palette_zero = 0;
+  state.encoder.filter_strategy = strategy;
+  state.encoder.zlibsettings.btype = 0;
+  for(i = 0; i < h; i++) filters[i] = (unsigned char)(i % 5);
+  state.encoder.predefined_filters = &filters[0];
+
+  image.resize(lodepng_get_raw_size(w, h, &state.info_raw));
+  for(i = 0; i < image.size(); i++)
+  {
+    image[i] = (unsigned char)(i ? image[i - 1] + nextRandom(seed) % 9 : nextRandom(seed));
+  }
+  if(bitdepth < 8 && !image.empty())
+  {
+    /*the padding bits at the end of the last byte are not kept*/
+    size_t bits = (size_t)w * h * lodepng_get_bpp(&state.info_raw);
+    if(bits % 8) image.back() &= (unsigned char)(0xff << (8 - bits % 8));
+  }
+
+  error = lodepng::encode(png, image, w, h, state);
+  if(!error)
+  {
+    lodepng::State decodestate;
+    lodepng_color_mode_copy(&decodestate.info_raw, &state.info_raw);
+    error = lodepng::decode(decoded, w2, h2, decodestate, png);
+  }
+  if(error || decoded != image)
+  {
+    printf("Failed: color type %d, bit depth %u, interlace %u, filter strategy %d, %ux%u: %s\n",
+           (int)colortype, bitdepth, interlace, (int)strategy, w, h,
+           error ? lodepng_error_text(error) : "pixels differ");
+    return 1;
+  }
+  return 0;
+}
+
+int main()
+{
+  static const LodePNGColorType colortypes[5] = {LCT_GREY, LCT_RGB, LCT_PALETTE, LCT_GREY_ALPHA, LCT_RGBA};
+  static const LodePNGFilterStrategy strategies[5] =
+      {LFS_ZERO, LFS_MINSUM, LFS_ENTROPY, LFS_BRUTE_FORCE, LFS_PREDEFINED};
+  static const unsigned sizes[6] = {1, 3, 8, 17, 45, 70};
+  unsigned seed = 1;
+  int failures = 0, total = 0;
+  unsigned c, bitdepth, interlace, s, x, y;
+
+  MakeCRCTable();
+
+  for(c = 0; c < 5; c++)
+  for(bitdepth = 1; bitdepth <= 16; bitdepth *= 2)
+  {
+    LodePNGColorType colortype = colortypes[c];
+    if(colortype == LCT_PALETTE ? bitdepth > 8 : (colortype != LCT_GREY && bitdepth < 8)) continue;
+    for(interlace = 0; interlace < 2; interlace++)
+    for(s = 0; s < 5; s++)
+    for(x = 0; x < 6; x++)
+    for(y = 0; y < 6; y++)
+    {
+      failures += roundTrip(colortype, bitdepth, interlace, strategies[s], sizes[x], sizes[y], &seed);
+      total++;
+    }
+  }
+
+  printf("%d of %d round trips failed\n", failures, total);
+  return failures ? 1 : 0;
+}
@@ -95,6 +95,9 @@ inline static void ShowHelp() {
          "--iterations=[number]: number of iterations, more iterations makes it"
          " slower but provides slightly better compression. Default: 15 for"
          " small files, 5 for large files.\n"
+         "--timelimit=[seconds]: spend at most about this long on each file,"
+         " keeping the best result found when the time is up. Default: 0, no"
+         " limit.\n"
          "--splitting=[0-3]: block split strategy:"
          " 0=none, 1=first, 2=last, 3=try both and take the best\n"
          "--filters=[types]: filter strategies to try:\n"
@@ -104,12 +107,16 @@ inline static void ShowHelp() {
          " p: predefined (keep from input, this likely overlaps another"
          " strategy)\n"
          " b: brute force (experimental)\n"
+         " l: local search: improve the filter type of each scanline, starting"
+         " from brute force, with an estimate of the compressed size. Slow\n"
          " By default, if this argument is not given, one that is most likely"
          " the best for this image is chosen by trying faster compression with"
          " each type.\n"
          " If this argument is used, all given filter types"
          " are tried with slow compression and the best result retained. A good"
          " set of filters to try is --filters=0me.\n"
+         "--threads=[number]: number of threads for the local search filter"
+         " strategy. Default: 1.\n"
          "--keepchunks=nAME,nAME,...: keep metadata chunks with these names"
          " that would normally be removed, e.g. tEXt,zTXt,iTXt,gAMA, ... \n"
          " Due to adding extra data, this increases the result size. By default"
@@ -122,7 +129,7 @@ inline static void ShowHelp() {
          "Compress more: zopflipng -m infile.png outfile.png\n"
          "Optimize multiple files: zopflipng --prefix a.png b.png c.png\n"
          "Compress really good and trying all filter strategies: zopflipng"
-         " --iterations=500 --splitting=3 --filters=01234mepb"
+         " --iterations=500 --splitting=3 --filters=01234mepbl"
          " --lossy_8bit --lossy_transparent infile.png outfile.png\n";
   fwrite(HelpText, 1, sizeof(HelpText)-1, stdout);
 }
@@ -174,6 +181,14 @@ int main(int argc, char *argv[]) {
         if (num < 1) num = 1;
         png_options.num_iterations = num;
         png_options.num_iterations_large = num;
+      } else if (isarg("--timelimit", arg)) {
+        double seconds = arghasvalue("--timelimit", arg) ? atof(argvalue("--timelimit", arg)) : 0;
+        if (seconds < 0) seconds = 0;
+        png_options.timelimit = seconds;
+      } else if (isarg("--threads", arg)) {
+        int num = arghasvalue("--threads", arg) ? atoi(argvalue("--threads", arg)) : 1;
+        if (num < 1) num = 1;
+        png_options.num_threads = num;
       } else if (isarg("--splitting", arg)) {
         int num = arghasvalue("--splitting", arg) ? atoi(argvalue("--splitting", arg)) : 1;
         if (num < 0 || num > 3) num = 1;
@@ -194,6 +209,7 @@ int main(int argc, char *argv[]) {
             case 'e': strategy = kStrategyEntropy; break;
             case 'p': strategy = kStrategyPredefined; break;
             case 'b': strategy = kStrategyBruteForce; break;
+            case 'l': strategy = kStrategyLocalSearch; break;
             default:
               printf("Unknown filter strategy: %c\n", f);
               return 1;
@@ -25,6 +25,7 @@
 #include "lodepng/lodepng.h"
 #include "lodepng/lodepng_util.h"
 #include "../zopfli/deflate.h"
+#include "../zopfli/util.h"
 
 #ifdef _MSC_VER
 #ifdef __cplusplus
@@ -46,33 +47,59 @@ ZopfliPNGOptions::ZopfliPNGOptions()
   , use_zopfli(true)
   , num_iterations(15)
   , num_iterations_large(5)
-  , block_split_strategy(1) {
+  , block_split_strategy(1)
+  , timelimit(0)
+  , num_threads(1) {
 }
 
-// Deflate compressor passed as fuction pointer to LodePNG to have it use Zopfli
-// as its compression backend.
-unsigned CustomPNGDeflate(unsigned char** out, size_t* outsize,
-                          const unsigned char* in, size_t insize,
-                          const LodePNGCompressSettings* settings) {
-  const ZopfliPNGOptions* png_options =
-      static_cast<const ZopfliPNGOptions*>(settings->custom_context);
+// Deflates the input given either at once as in, or piece by piece with read
+// if that is not null.
+void DeflateInput(const ZopfliOptions* options,
+                  const unsigned char* in, size_t insize,
+                  ZopfliReadFun* read, void* readcontext,
+                  unsigned char* bp, unsigned char** out, size_t* outsize) {
+  if (!read) {
+    ZopfliDeflate(options, 2 /* Dynamic */, 1, in, insize, bp, out, outsize);
+    return;
+  }
+  ZopfliOutput output;
+  ZopfliInitAppendOutput(*out, *outsize, &output);
+  ZopfliDeflateStream(options, 2 /* Dynamic */, 1, insize, read, readcontext,
+                      bp, &output);
+  ZopfliFinishAppendOutput(&output, out, outsize);
+}
+
+// Compresses with Zopfli with the settings of png_options, see DeflateInput
+// for in and read.
+void ZopfliPNGDeflate(const ZopfliPNGOptions* png_options,
+                      const unsigned char* in, size_t insize,
+                      ZopfliReadFun* read, void* readcontext,
+                      unsigned char** out, size_t* outsize) {
   unsigned char bp = 0;
   ZopfliOptions options;
   ZopfliInitOptions(&options);
 
   options.numiterations = insize < 200000
       ? png_options->num_iterations : png_options->num_iterations_large;
+  options.timelimit = png_options->timelimit;
 
   if (png_options->block_split_strategy == 3) {
     // Try both block splitting first and last.
     unsigned char* out2 = 0;
     size_t outsize2 = 0;
+    double deadline = ZopfliGetTime() + png_options->timelimit;
     options.blocksplittinglast = 0;
-    ZopfliDeflate(&options, 2 /* Dynamic */, 1, in, insize, &bp, out, outsize);
+    options.timelimit = png_options->timelimit / 2;
+    DeflateInput(&options, in, insize, read, readcontext, &bp, out, outsize);
     bp = 0;
     options.blocksplittinglast = 1;
-    ZopfliDeflate(&options, 2 /* Dynamic */, 1,
-                  in, insize, &bp, &out2, &outsize2);
+    if (png_options->timelimit > 0) {
+      // Whatever the first run left over, but keep it non-zero: 0 is no limit.
+      options.timelimit = deadline - ZopfliGetTime();
+      if (options.timelimit < 1e-6) options.timelimit = 1e-6;
+    }
+    DeflateInput(&options, in, insize, read, readcontext, &bp, &out2,
+                 &outsize2);
 
     if (outsize2 < *outsize) {
       free(*out);
@@ -85,9 +112,32 @@ unsigned CustomPNGDeflate(unsigned char** out, size_t* outsize,
   } else {
     if (png_options->block_split_strategy == 0) options.blocksplitting = 0;
     options.blocksplittinglast = png_options->block_split_strategy == 2;
-    ZopfliDeflate(&options, 2 /* Dynamic */, 1, in, insize, &bp, out, outsize);
+    DeflateInput(&options, in, insize, read, readcontext, &bp, out, outsize);
   }
+}
+
+// Deflate compressor passed as fuction pointer to LodePNG to have it use Zopfli
+// as its compression backend.
+unsigned CustomPNGDeflate(unsigned char** out, size_t* outsize,
+                          const unsigned char* in, size_t insize,
+                          const LodePNGCompressSettings* settings) {
+  ZopfliPNGDeflate(
+      static_cast<const ZopfliPNGOptions*>(settings->custom_context),
+      in, insize, 0, 0, out, outsize);
+  return 0;  // OK
+}
 
+// Like CustomPNGDeflate, but reading the input piece by piece, so that LodePNG
+// filters large images in bands as they are compressed.
+unsigned CustomPNGDeflateStream(unsigned char** out, size_t* outsize,
+                                size_t insize,
+                                void (*read)(unsigned char*, size_t, size_t,
+                                             void*),
+                                void* readcontext,
+                                const LodePNGCompressSettings* settings) {
+  ZopfliPNGDeflate(
+      static_cast<const ZopfliPNGOptions*>(settings->custom_context),
+      0, insize, read, readcontext, out, outsize);
   return 0;  // OK
 }
 
@@ -133,10 +183,158 @@ void LossyOptimizeTransparent(unsigned char* image, unsigned w, unsigned h) {
   }
 }
 
-// Tries to optimize given a single PNG filter strategy.
+// Number of passes of the per-scanline filter search.
+static const int kFilterSearchPasses = 4;
+
+// The work of one thread of the filter search: the scanlines first,
+// first + step, first + 2 * step...
+struct FilterSearchWorker {
+  const ZopfliOptions* options;
+  const ZopfliSymbolCosts* costs;
+  const unsigned char* raw;  // Unfiltered scanlines of linebytes each.
+  const unsigned char* data;  // The image filtered with filters.
+  const unsigned char* filters;
+  unsigned char* bestfilters;
+  unsigned h;
+  size_t linebytes;
+  size_t bytewidth;
+  unsigned first;
+  unsigned step;
+  double deadline;  // ZopfliGetTime() at which to stop, 0 for never.
+};
+
+// Sets the best filter type of each scanline of the worker, the others kept as
+// they are. A scanline is priced together with the next one, which may refer
+// to it, with the window of bytes before it as dictionary.
+// Has the type of ZopfliWorkerFun, to run on the threads of ZopfliRunWorkers.
+void SearchFilters(void* context) {
+  FilterSearchWorker* worker = static_cast<FilterSearchWorker*>(context);
+  size_t stride = worker->linebytes + 1;
+  std::vector<unsigned char> window;
+  for (unsigned y = worker->first; y < worker->h; y += worker->step) {
+    worker->bestfilters[y] = worker->filters[y];
+    if (worker->deadline > 0 && ZopfliGetTime() >= worker->deadline) continue;
+
+    size_t start = y * stride;
+    size_t end = (y + 2 < worker->h ? y + 2 : worker->h) * stride;
+    size_t context = start < ZOPFLI_WINDOW_SIZE ? start : ZOPFLI_WINDOW_SIZE;
+    window.assign(worker->data + start - context, worker->data + end);
+    unsigned char* row = &window[context];
+    const unsigned char* scanline = worker->raw + y * worker->linebytes;
+    const unsigned char* prevline = y ? scanline - worker->linebytes : 0;
+
+    double bestcost = ZopfliEstimateCost(worker->options, &window[0],
+                                         context, window.size(), worker->costs);
+    for (unsigned char f = 0; f < 5; f++) {
+      if (f == worker->filters[y]) continue;
+      row[0] = f;
+      lodepng_filter_scanline(row + 1, scanline, prevline, worker->linebytes,
+                              worker->bytewidth, f);
+      double cost = ZopfliEstimateCost(worker->options, &window[0],
+                                       context, window.size(), worker->costs);
+      if (cost < bestcost) {
+        bestcost = cost;
+        worker->bestfilters[y] = f;
+      }
+    }
+  }
+}
+
+// Optimizes the filter type of each scanline of the non-interlaced prepared
+// image by local search, starting from the given filter types: every pass tries
+// all filter types of each scanline with the others fixed, using a fast
+// estimate of the compressed size, on numthreads threads. The changes of a pass
+// are kept only if they make the whole image smaller by that estimate.
+// Returns 0 if ok, other value for error
+unsigned OptimizeFilters(const lodepng::PreparedImage& prepared,
+                         int numthreads, double timelimit,
+                         std::vector<unsigned char>* filters) {
+  unsigned h = prepared.h;
+  unsigned bpp = lodepng_get_bpp(&prepared.info.color);
+  size_t linebytes = (prepared.w * bpp + 7) / 8;
+  size_t bytewidth = (bpp + 7) / 8;
+  const unsigned char* raw = prepared.scanlines;
+
+  ZopfliOptions options;
+  ZopfliInitOptions(&options);
+  double deadline = timelimit > 0 ? ZopfliGetTime() + timelimit : 0;
+  if (numthreads < 1) numthreads = 1;
+  if ((unsigned)numthreads > h) numthreads = h;
+  std::vector<FilterSearchWorker> workers(numthreads);
+
+  // Filters the whole image with the filter types of predefined_filters.
+  LodePNGEncoderSettings settings;
+  lodepng_encoder_settings_init(&settings);
+  settings.filter_palette_zero = 0;
+  settings.filter_strategy = LFS_PREDEFINED;
+  settings.predefined_filters = &(*filters)[0];
+
+  std::vector<unsigned char> data, newdata;
+  std::vector<unsigned char> newfilters(h);
+  unsigned error = lodepng::filterPrepared(data, prepared, settings);
+  if (error) return error;
+  double cost = ZopfliEstimateCost(&options, &data[0], 0, data.size(), 0);
+
+  for (int pass = 0; pass < kFilterSearchPasses; pass++) {
+    if (deadline > 0 && ZopfliGetTime() >= deadline) break;
+
+    ZopfliSymbolCosts costs;
+    ZopfliGetSymbolCosts(&options, &data[0], 0, data.size(), &costs);
+    for (int i = 0; i < numthreads; i++) {
+      workers[i].options = &options;
+      workers[i].costs = &costs;
+      workers[i].raw = raw;
+      workers[i].data = &data[0];
+      workers[i].filters = &(*filters)[0];
+      workers[i].bestfilters = &newfilters[0];
+      workers[i].h = h;
+      workers[i].linebytes = linebytes;
+      workers[i].bytewidth = bytewidth;
+      workers[i].first = i;
+      workers[i].step = numthreads;
+      workers[i].deadline = deadline;
+    }
+    ZopfliRunWorkers(SearchFilters, &workers[0], sizeof(workers[0]),
+                     numthreads);
+
+    if (newfilters == *filters) break;
+    settings.predefined_filters = &newfilters[0];
+    newdata.clear();
+    error = lodepng::filterPrepared(newdata, prepared, settings);
+    if (error) return error;
+    double newcost =
+        ZopfliEstimateCost(&options, &newdata[0], 0, newdata.size(), 0);
+    if (newcost >= cost) break;
+    cost = newcost;
+    filters->swap(newfilters);
+    data.swap(newdata);
+  }
+  return 0;
+}
+
+// Sets the color mode of the raw image that is given to LodePNG to encode.
+void SetRawColorMode(const lodepng::State& inputstate, bool bit16,
+                     lodepng::State* state) {
+  if (inputstate.info_png.color.colortype == LCT_PALETTE) {
+    // Make it preserve the original palette order
+    lodepng_color_mode_copy(&state->info_raw, &inputstate.info_png.color);
+    state->info_raw.colortype = LCT_RGBA;
+    state->info_raw.bitdepth = 8;
+  }
+  if (bit16) {
+    state->info_raw.bitdepth = 16;
+  }
+}
+
+// Tries to optimize given a single PNG filter strategy. The image is encoded
+// from prepared, which is the image prepared with the color mode of
+// SetRawColorMode. If that has a palette, nopalette is the image prepared
+// without palette for very small output. It is prepared here the first time it
+// is needed, and can then be reused for the other filter strategies.
 // Returns 0 if ok, other value for error
 unsigned TryOptimize(
     const std::vector<unsigned char>& image, unsigned w, unsigned h,
+    const lodepng::PreparedImage& prepared, lodepng::PreparedImage* nopalette,
     const lodepng::State& inputstate, bool bit16,
     const std::vector<unsigned char>& origfile,
     ZopfliPNGFilterStrategy filterstrategy,
@@ -148,18 +346,11 @@ unsigned TryOptimize(
   state.encoder.zlibsettings.windowsize = windowsize;
   if (use_zopfli && png_options->use_zopfli) {
     state.encoder.zlibsettings.custom_deflate = CustomPNGDeflate;
+    state.encoder.zlibsettings.custom_deflate_stream = CustomPNGDeflateStream;
     state.encoder.zlibsettings.custom_context = (ZopfliPNGOptions *) png_options;
   }
 
-  if (inputstate.info_png.color.colortype == LCT_PALETTE) {
-    // Make it preserve the original palette order
-    lodepng_color_mode_copy(&state.info_raw, &inputstate.info_png.color);
-    state.info_raw.colortype = LCT_RGBA;
-    state.info_raw.bitdepth = 8;
-  }
-  if (bit16) {
-    state.info_raw.bitdepth = 16;
-  }
+  SetRawColorMode(inputstate, bit16, &state);
 
   state.encoder.filter_palette_zero = 0;
 
@@ -191,6 +382,33 @@ unsigned TryOptimize(
       state.encoder.filter_strategy = LFS_PREDEFINED;
       state.encoder.predefined_filters = &filters[0];
       break;
+    case kStrategyLocalSearch: {
+      // Start from the brute force filters, chosen by filtering the prepared
+      // scanlines without compressing them.
+      LodePNGEncoderSettings brute = state.encoder;
+      brute.filter_strategy = LFS_BRUTE_FORCE;
+      std::vector<unsigned char> data;
+      error = lodepng::filterPrepared(data, prepared, brute);
+      if (error) {
+        printf("Encoding error %i: %s\n", error, lodepng_error_text(error));
+        return error;
+      }
+      size_t stride = data.size() / h;
+      filters.resize(h);
+      for (unsigned y = 0; y < h; y++) filters[y] = data[y * stride];
+      // Spend at most half of the time limit on the search.
+      error = OptimizeFilters(prepared,
+                              png_options ? png_options->num_threads : 1,
+                              png_options ? png_options->timelimit / 2 : 0,
+                              &filters);
+      if (error) {
+        printf("Encoding error %i: %s\n", error, lodepng_error_text(error));
+        return error;
+      }
+      state.encoder.filter_strategy = LFS_PREDEFINED;
+      state.encoder.predefined_filters = &filters[0];
+      break;
+    }
     default:
       break;
   }
@@ -198,18 +416,17 @@ unsigned TryOptimize(
   state.encoder.add_id = false;
   state.encoder.text_compression = 1;
 
-  error = lodepng::encode(*out, image, w, h, state);
+  error = lodepng::encode(*out, prepared, state);
 
   // For very small output, also try without palette, it may be smaller thanks
-  // to no palette storage overhead.
-  if (!error && out->size() < 4096) {
-    lodepng::State teststate;
-    std::vector<unsigned char> temp;
-    lodepng::decode(temp, w, h, teststate, *out);
-    LodePNGColorMode& color = teststate.info_png.color;
-    if (color.colortype == LCT_PALETTE) {
-      std::vector<unsigned char> out2;
-      state.encoder.auto_convert = LAC_ALPHA;
+  // to no palette storage overhead. The color mode the encoder chose is that
+  // of the prepared image.
+  const LodePNGColorMode& color = prepared.info.color;
+  if (!error && out->size() < 4096 && color.colortype == LCT_PALETTE) {
+    if (!nopalette->scanlines) {
+      lodepng::State nopalettestate;
+      SetRawColorMode(inputstate, bit16, &nopalettestate);
+      nopalettestate.encoder.auto_convert = LAC_ALPHA;
       bool grey = true;
       for (size_t i = 0; i < color.palettesize; i++) {
         if (color.palette[i * 4 + 0] != color.palette[i * 4 + 2]
@@ -218,11 +435,13 @@ unsigned TryOptimize(
           break;
         }
       }
-      if (grey) state.info_png.color.colortype = LCT_GREY_ALPHA;
-
-      error = lodepng::encode(out2, image, w, h, state);
-      if (out2.size() < out->size()) out->swap(out2);
+      if (grey) nopalettestate.info_png.color.colortype = LCT_GREY_ALPHA;
+      error = lodepng::prepareEncode(*nopalette, image, w, h, nopalettestate);
     }
+
+    std::vector<unsigned char> out2;
+    if (!error) error = lodepng::encode(out2, *nopalette, state);
+    if (!error && out2.size() < out->size()) out->swap(out2);
   }
 
   if (error) {
@@ -238,6 +457,8 @@ unsigned TryOptimize(
 // filter type.
 unsigned AutoChooseFilterStrategy(const std::vector<unsigned char>& image,
                                   unsigned w, unsigned h,
+                                  const lodepng::PreparedImage& prepared,
+                                  lodepng::PreparedImage* nopalette,
                                   const lodepng::State& inputstate, bool bit16,
                                   const std::vector<unsigned char>& origfile,
                                   int numstrategies,
@@ -256,8 +477,8 @@ unsigned AutoChooseFilterStrategy(const std::vector<unsigned char>& image,
 
   for (int i = 0; i < numstrategies; i++) {
     out.clear();
-    error = TryOptimize(image, w, h, inputstate, bit16, origfile,
-                                 strategies[i], false, windowsize, 0, &out);
+    error = TryOptimize(image, w, h, prepared, nopalette, inputstate, bit16,
+                        origfile, strategies[i], false, windowsize, 0, &out);
     if (error) break;
     if (bestsize == 0 || out.size() < bestsize) {
       bestsize = out.size();
@@ -309,20 +530,23 @@ int ZopfliPNGOptimize(const std::vector<unsigned char>& origpng,
 
   ZopfliPNGFilterStrategy filterstrategies[kNumFilterStrategies] = {
     kStrategyZero, kStrategyOne, kStrategyTwo, kStrategyThree, kStrategyFour,
-    kStrategyMinSum, kStrategyEntropy, kStrategyPredefined, kStrategyBruteForce
+    kStrategyMinSum, kStrategyEntropy, kStrategyPredefined, kStrategyBruteForce,
+    kStrategyLocalSearch
   };
   bool strategy_enable[kNumFilterStrategies] = {
-    false, false, false, false, false, false, false, false, false
+    false, false, false, false, false, false, false, false, false, false
   };
   std::string strategy_name[kNumFilterStrategies] = {
     "zero", "one", "two", "three", "four",
-    "minimum sum", "entropy", "predefined", "brute force"
+    "minimum sum", "entropy", "predefined", "brute force", "local search"
   };
   for (size_t i = 0; i < png_options.filter_strategies.size(); i++) {
     strategy_enable[png_options.filter_strategies[i]] = true;
   }
 
 
+  double deadline = ZopfliGetTime() + png_options.timelimit;
+
   std::vector<unsigned char> image;
   unsigned w, h;
   unsigned error;
@@ -344,31 +568,61 @@ int ZopfliPNGOptimize(const std::vector<unsigned char>& origpng,
     bit16 = true;
   }
 
+  // The color type is chosen and the image converted to it only once, every
+  // filter strategy only filters and compresses the prepared image.
+  lodepng::PreparedImage prepared;
+  lodepng::PreparedImage nopalette;  // Prepared by TryOptimize if needed.
   if (!error) {
     // If lossy_transparent, remove RGB information from pixels with alpha=0
     if (png_options.lossy_transparent && !bit16) {
       LossyOptimizeTransparent(&image[0], w, h);
     }
 
+    lodepng::State state;
+    SetRawColorMode(inputstate, bit16, &state);
+    error = lodepng::prepareEncode(prepared, image, w, h, state);
+    if (error && verbose) {
+      printf("Encoding error %i: %s\n", error, lodepng_error_text(error));
+    }
+  }
+
+  if (!error) {
     if (png_options.auto_filter_strategy) {
-      error = AutoChooseFilterStrategy(image, w, h, inputstate, bit16,
-                                       origpng,
-                                       /* Don't try brute force */
-                                       kNumFilterStrategies - 1,
+      error = AutoChooseFilterStrategy(image, w, h, prepared, &nopalette,
+                                       inputstate, bit16, origpng,
+                                       /* Don't try brute force and local
+                                          search */
+                                       kNumFilterStrategies - 2,
                                        filterstrategies, strategy_enable);
     }
   }
 
   if (!error) {
     size_t bestsize = 0;
+    int numleft = 0;  // Enabled strategies not tried yet, to share the time.
+    for (int i = 0; i < kNumFilterStrategies; i++) {
+      if (strategy_enable[i]) numleft++;
+    }
 
     for (int i = 0; i < kNumFilterStrategies; i++) {
       if (!strategy_enable[i]) continue;
 
+      ZopfliPNGOptions trial_options = png_options;
+      if (png_options.timelimit > 0) {
+        double left = deadline - ZopfliGetTime();
+        if (left <= 0 && bestsize != 0) {
+          if (verbose) printf("Time limit reached, keeping best so far\n");
+          break;
+        }
+        // Keep it non-zero: 0 is no limit.
+        trial_options.timelimit = left > 1e-6 ? left / numleft : 1e-6;
+      }
+      numleft--;
+
       std::vector<unsigned char> temp;
-      error = TryOptimize(image, w, h, inputstate, bit16, origpng,
-                          filterstrategies[i], true /* use_zopfli */,
-                          windowsize, &png_options, &temp);
+      error = TryOptimize(image, w, h, prepared, &nopalette, inputstate, bit16,
+                          origpng, filterstrategies[i], true /* use_zopfli */,
+                          windowsize, &trial_options, &temp);
       if (!error) {
         if (verbose) {
           printf("Filter strategy %s: %d bytes\n",
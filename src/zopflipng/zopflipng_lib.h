@@ -35,6 +35,7 @@ enum ZopfliPNGFilterStrategy {
   kStrategyEntropy,
   kStrategyPredefined,
   kStrategyBruteForce,
+  kStrategyLocalSearch,
   kNumFilterStrategies /* Not a strategy but used for the size of this enum */
 };
 
@@ -67,6 +68,14 @@ struct ZopfliPNGOptions {
 
   // 0=none, 1=first, 2=last, 3=both
   int block_split_strategy;
+
+  // Maximum wall time in seconds to optimize one image, 0 for no limit. The
+  // time is shared between the filter strategies that are tried, and the best
+  // result found when time is up is returned.
+  double timelimit;
+
+  // Number of threads for the local search filter strategy.
+  int num_threads;
 };
 
 // Returns 0 on success, error code otherwise.